@@ -10,3 +10,8 @@
 COMPONENT_DEPENDS := nofrendo
 COMPONENT_ADD_INCLUDEDIRS := .
 
+
+# the OSD tasks time their own zones (prof.h)
+ifdef CONFIG_NOFRENDO_PROFILE
+CFLAGS += -DNOFRENDO_PROFILE
+endif
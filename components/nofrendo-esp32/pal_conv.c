@@ -0,0 +1,55 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdint.h>
+#include "pal_conv.h"
+
+//Entries are stored byte swapped, so a line converts with table lookups only and goes out to the
+//SPI DMA as is.
+void palconv_settable(uint16_t *table, const rgb_t *pal)
+{
+	uint16_t c;
+	int i;
+
+	for (i=0; i<PALCONV_ENTRIES; i++) {
+		c=(pal[i].b>>3)+((pal[i].g>>2)<<5)+((pal[i].r>>3)<<11);
+		table[i]=(c>>8)|((c&0xff)<<8);
+	}
+}
+
+//Four pixels per 32-bit load, two per 32-bit store. Both lines have to be 32-bit aligned
+//(bitmap lines are) and width a multiple of 4. Little endian only, like the ESP32.
+void palconv_line(uint16_t *dst, const uint8_t *src, int width, const uint16_t *table)
+{
+	const uint32_t *s=(const uint32_t *)src;
+	uint32_t *d=(uint32_t *)dst;
+	uint32_t p;
+	int x;
+
+	for (x=0; x<width; x+=4) {
+		p=*s++;
+		d[0]=table[p&0xFF]|((uint32_t)table[(p>>8)&0xFF]<<16);
+		d[1]=table[(p>>16)&0xFF]|((uint32_t)table[p>>24]<<16);
+		d+=2;
+	}
+}
+
+//One pixel at a time, what palconv_line() has to match
+void palconv_line_ref(uint16_t *dst, const uint8_t *src, int width, const uint16_t *table)
+{
+	int x;
+
+	for (x=0; x<width; x++)
+		dst[x]=table[src[x]];
+}
@@ -0,0 +1,31 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _PAL_CONV_H_
+#define _PAL_CONV_H_
+
+#include <stdint.h>
+#include <noftypes.h>
+#include <bitmap.h>
+
+//8-bit frame buffer pixels to RGB565 the way the LCD wants it over SPI: high byte first.
+//This has nothing ESP32-specific in it, the host build benchmarks it (nesbench -P).
+
+#define PALCONV_ENTRIES 256
+
+void palconv_settable(uint16_t *table, const rgb_t *pal);
+void palconv_line(uint16_t *dst, const uint8_t *src, int width, const uint16_t *table);
+void palconv_line_ref(uint16_t *dst, const uint8_t *src, int width, const uint16_t *table);
+
+#endif
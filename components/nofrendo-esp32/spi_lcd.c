@@ -25,7 +25,10 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "driver/periph_ctrl.h"
+#include "driver/spi_master.h"
+#include "esp_attr.h"
 #include "spi_lcd.h"
+#include "pal_conv.h"
 
 #define PIN_NUM_MISO CONFIG_HW_LCD_MISO_GPIO
 #define PIN_NUM_MOSI CONFIG_HW_LCD_MOSI_GPIO
@@ -351,74 +354,106 @@ static void spi_master_init()
     }
 }
 
-#define U16x2toU32(m,l) ((((uint32_t)(l>>8|(l&0xFF)<<8))<<16)|(m>>8|(m&0xFF)<<8))
+//Frames are streamed with the spi_master driver: the window is set once per frame, then stripes of
+//LCD_STRIPE_LINES lines are converted to RGB565 into one of two buffers while the DMA sends the other.
+#define LCD_MAX_WIDTH 320
+#define LCD_STRIPE_LINES 4
+#define LCD_STRIPES 2
+
+static spi_device_handle_t lcd_spi;
+static uint16_t lcd_stripe[LCD_STRIPES][LCD_MAX_WIDTH*LCD_STRIPE_LINES];
+static spi_transaction_t lcd_stripe_trans[LCD_STRIPES];
 
 extern uint16_t myPalette[];
 
+//DC goes with the transaction: user is 0 for a command, 1 for data
+static void IRAM_ATTR lcd_spi_pre_transfer(spi_transaction_t *t)
+{
+    if ((int)t->user) LCD_SEL_DATA(); else LCD_SEL_CMD();
+}
+
+static void lcd_spi_send(const uint8_t *data, int len, int dc)
+{
+    spi_transaction_t t;
+    memset(&t, 0, sizeof(t));
+    t.length=len*8;
+    t.user=(void*)dc;
+    if (len<=4) {
+        t.flags=SPI_TRANS_USE_TXDATA;
+        memcpy(t.tx_data, data, len);
+    } else {
+        t.tx_buffer=data;
+    }
+    spi_device_transmit(lcd_spi, &t);
+}
+
+static void lcd_set_window(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1)
+{
+    uint8_t cmd, xv[4]={x0>>8, x0&0xFF, x1>>8, x1&0xFF}, yv[4]={y0>>8, y0&0xFF, y1>>8, y1&0xFF};
+    cmd=0x2A; lcd_spi_send(&cmd, 1, 0);
+    lcd_spi_send(xv, 4, 1);
+    cmd=0x2B; lcd_spi_send(&cmd, 1, 0);
+    lcd_spi_send(yv, 4, 1);
+    cmd=0x2C; lcd_spi_send(&cmd, 1, 0);
+}
+
+//The raw register setup above sends the init sequence, after that the spi_master driver owns the bus.
+static void lcd_spi_stream_init()
+{
+    spi_bus_config_t buscfg={
+        .miso_io_num=PIN_NUM_MISO,
+        .mosi_io_num=PIN_NUM_MOSI,
+        .sclk_io_num=PIN_NUM_CLK,
+        .quadwp_io_num=-1,
+        .quadhd_io_num=-1
+    };
+    spi_device_interface_config_t devcfg={
+        .clock_speed_hz=40000000,
+        .mode=0,
+        .spics_io_num=PIN_NUM_CS,
+        .queue_size=LCD_STRIPES,
+        .pre_cb=lcd_spi_pre_transfer,
+    };
+    ESP_ERROR_CHECK(spi_bus_initialize(VSPI_HOST, &buscfg, 1));
+    ESP_ERROR_CHECK(spi_bus_add_device(VSPI_HOST, &devcfg, &lcd_spi));
+}
+
 void ili9341_write_frame(const uint16_t xs, const uint16_t ys, const uint16_t width, const uint16_t height, const uint8_t * data[]){
-    int x, y;
-    int i;
-    uint16_t x1, y1;
-    uint32_t xv, yv, dc;
-    uint32_t temp[16];
-    dc = (1 << PIN_NUM_DC);
-    
-    for (y=0; y<height; y++) {
-        //start line
-        x1 = xs+(width-1);
-        y1 = ys+y+(height-1);
-        xv = U16x2toU32(xs,x1);
-        yv = U16x2toU32((ys+y),y1);
-        
-        while (READ_PERI_REG(SPI_CMD_REG(SPI_NUM))&SPI_USR);
-        GPIO.out_w1tc = dc;
-        SET_PERI_REG_BITS(SPI_MOSI_DLEN_REG(SPI_NUM), SPI_USR_MOSI_DBITLEN, 7, SPI_USR_MOSI_DBITLEN_S);
-        WRITE_PERI_REG((SPI_W0_REG(SPI_NUM)), 0x2A);
-        SET_PERI_REG_MASK(SPI_CMD_REG(SPI_NUM), SPI_USR);
-        while (READ_PERI_REG(SPI_CMD_REG(SPI_NUM))&SPI_USR);
-        GPIO.out_w1ts = dc;
-        SET_PERI_REG_BITS(SPI_MOSI_DLEN_REG(SPI_NUM), SPI_USR_MOSI_DBITLEN, 31, SPI_USR_MOSI_DBITLEN_S);
-        WRITE_PERI_REG((SPI_W0_REG(SPI_NUM)), xv);
-        SET_PERI_REG_MASK(SPI_CMD_REG(SPI_NUM), SPI_USR);
-        while (READ_PERI_REG(SPI_CMD_REG(SPI_NUM))&SPI_USR);
-        GPIO.out_w1tc = dc;
-        SET_PERI_REG_BITS(SPI_MOSI_DLEN_REG(SPI_NUM), SPI_USR_MOSI_DBITLEN, 7, SPI_USR_MOSI_DBITLEN_S);
-        WRITE_PERI_REG((SPI_W0_REG(SPI_NUM)), 0x2B);
-        SET_PERI_REG_MASK(SPI_CMD_REG(SPI_NUM), SPI_USR);
-        while (READ_PERI_REG(SPI_CMD_REG(SPI_NUM))&SPI_USR);
-        GPIO.out_w1ts = dc;
-        SET_PERI_REG_BITS(SPI_MOSI_DLEN_REG(SPI_NUM), SPI_USR_MOSI_DBITLEN, 31, SPI_USR_MOSI_DBITLEN_S);
-        WRITE_PERI_REG((SPI_W0_REG(SPI_NUM)), yv);
-        SET_PERI_REG_MASK(SPI_CMD_REG(SPI_NUM), SPI_USR);
-        while (READ_PERI_REG(SPI_CMD_REG(SPI_NUM))&SPI_USR);
-        GPIO.out_w1tc = dc;
-        SET_PERI_REG_BITS(SPI_MOSI_DLEN_REG(SPI_NUM), SPI_USR_MOSI_DBITLEN, 7, SPI_USR_MOSI_DBITLEN_S);
-        WRITE_PERI_REG((SPI_W0_REG(SPI_NUM)), 0x2C);
-        SET_PERI_REG_MASK(SPI_CMD_REG(SPI_NUM), SPI_USR);
-        while (READ_PERI_REG(SPI_CMD_REG(SPI_NUM))&SPI_USR);
-        
-        x = 0;
-        GPIO.out_w1ts = dc;
-        SET_PERI_REG_BITS(SPI_MOSI_DLEN_REG(SPI_NUM), SPI_USR_MOSI_DBITLEN, 511, SPI_USR_MOSI_DBITLEN_S);
-        while (x<width) {
-            for (i=0; i<16; i++) {
-                if(data == NULL){
-                    temp[i] = 0;
-                    x += 2;
-                    continue;
-                }
-                x1 = myPalette[(unsigned char)(data[y][x])]; x++;
-                y1 = myPalette[(unsigned char)(data[y][x])]; x++;
-                temp[i] = U16x2toU32(x1,y1);
-            }
-            while (READ_PERI_REG(SPI_CMD_REG(SPI_NUM))&SPI_USR);
-            for (i=0; i<16; i++) {
-                WRITE_PERI_REG((SPI_W0_REG(SPI_NUM) + (i << 2)), temp[i]);
-            }
-            SET_PERI_REG_MASK(SPI_CMD_REG(SPI_NUM), SPI_USR);
+    spi_transaction_t *t;
+    int y, i, lines, n, buf, in_flight=0;
+
+    lcd_set_window(xs, ys, xs+width-1, ys+height-1);
+
+    for (y=0, n=0; y<height; y+=lines, n++) {
+        buf=n%LCD_STRIPES;
+        lines=height-y;
+        if (lines>LCD_STRIPE_LINES) lines=LCD_STRIPE_LINES;
+
+        //results come back in order, the oldest one in flight used this buffer
+        if (in_flight==LCD_STRIPES) {
+            spi_device_get_trans_result(lcd_spi, &t, portMAX_DELAY);
+            in_flight--;
+        }
+
+        for (i=0; i<lines; i++) {
+            if (data==NULL)
+                memset(&lcd_stripe[buf][i*width], 0, width*2);
+            else
+                palconv_line(&lcd_stripe[buf][i*width], data[y+i], width, myPalette);
         }
+
+        t=&lcd_stripe_trans[buf];
+        memset(t, 0, sizeof(*t));
+        t->length=width*lines*16;
+        t->tx_buffer=lcd_stripe[buf];
+        t->user=(void*)1;
+        spi_device_queue_trans(lcd_spi, t, portMAX_DELAY);
+        in_flight++;
     }
-    while (READ_PERI_REG(SPI_CMD_REG(SPI_NUM))&SPI_USR);
+
+    //the window commands of the next frame wait for their own results
+    while (in_flight--)
+        spi_device_get_trans_result(lcd_spi, &t, portMAX_DELAY);
 }
 
 void ili9341_init()
@@ -426,6 +461,7 @@ void ili9341_init()
     spi_master_init();
     ili_gpio_init();
     ILI9341_INITIAL ();
+    lcd_spi_stream_init();
 }
 
 
@@ -16,6 +16,7 @@
 #include <freertos/timers.h>
 #include <freertos/task.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
 //Nes stuff wants to define this as well...
 #undef false
 #undef true
@@ -31,31 +32,88 @@
 #include <gui.h>
 #include <log.h>
 #include <nes.h>
+#include <nes_apu.h>
 #include <nes_pal.h>
 #include <nesinput.h>
 #include <osd.h>
+#include <pace.h>
+#include <prof.h>
+#include <snd_ring.h>
 #include <stdint.h>
+#include <sys/time.h>
+#include <vid_drv.h>
+#include <vid_pipe.h>
 #include "driver/i2s.h"
 #include "sdkconfig.h"
 #include <spi_lcd.h>
+#include "pal_conv.h"
 
 #include <psxcontroller.h>
 
+#if CONFIG_NOFRENDO_PROFILE
+#include <esp_timer.h>
+#endif
+
 #define  DEFAULT_SAMPLERATE   22100
 #define  DEFAULT_FRAGSIZE     128
 
+//The emulator drops a frame of samples into the ring and carries on, audioTask feeds them to i2s.
+#define AUDIO_RINGSIZE 2048
+#define AUDIO_TARGET (2*DEFAULT_SAMPLERATE/NES_REFRESH_RATE)
+#define AUDIO_STATS_FRAGS (DEFAULT_SAMPLERATE*10/DEFAULT_FRAGSIZE)
+
 #define  DEFAULT_WIDTH        256
 #define  DEFAULT_HEIGHT       NES_VISIBLE_HEIGHT
 
 
-TimerHandle_t timer;
+//Frames are paced (pace.h) off a microsecond clock, or the samples audioTask has played.
+static uint32 timer_now(void *arg) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint32)tv.tv_sec*1000000u+tv.tv_usec;
+}
+
+//Sleep off whole ticks, spin the rest: a tick is too coarse for a 60 Hz frame.
+static void timer_wait(void *arg, uint32 until) {
+	int32 left=until-timer_now(NULL);
+	if (left>2*portTICK_PERIOD_MS*1000) vTaskDelay(left/(portTICK_PERIOD_MS*1000)-1);
+	while ((int32)(until-timer_now(NULL))>0) ;
+}
 
-//Seemingly, this will be called only once. Should call func with a freq of frequency,
+#if CONFIG_SOUND_ENA
+static uint32 audio_now(void *arg);
+static void audio_wait(void *arg, uint32 until);
+#endif
+
+#define PACE_STATS_FRAMES (NES_REFRESH_RATE * 10)
+
+//Called once when the ROM starts, nes_emulate() does the pacing from then on.
 int osd_installtimer(int frequency, void *func, int funcsize, void *counter, int countersize)
 {
-	printf("Timer install, freq=%d\n", frequency);
-	timer=xTimerCreate("nes",configTICK_RATE_HZ/frequency, pdTRUE, NULL, func);
-	xTimerStart(timer, 0);
+	pace_clock_t clock={NULL, timer_now, timer_wait, 1000000, 0, timer_now};
+#if CONFIG_NOFRENDO_PACE_AUDIO
+	clock.now=audio_now;
+	clock.wait=audio_wait;
+	clock.rate=DEFAULT_SAMPLERATE;
+	clock.lead=AUDIO_TARGET;
+	pace_setclock(PACE_AUDIO, &clock);
+#elif CONFIG_NOFRENDO_PACE_FREE
+	pace_setclock(PACE_FREE, &clock);
+#else
+	pace_setclock(PACE_TIMER, &clock);
+#endif
+#if CONFIG_NOFRENDO_SKIP_REFRESH
+	int skip=PACE_SKIP_REFRESH;
+#elif CONFIG_NOFRENDO_SKIP_LATE
+	int skip=PACE_SKIP_LATE;
+#else
+	int skip=PACE_SKIP_EVEN;
+#endif
+	pace_setskip(skip);
+	printf("Frame pacing: %s, %d Hz, frameskip %s\n", pace_policyname(pace_getpolicy()), frequency, pace_skipname(skip));
+#if CONFIG_NOFRENDO_APU_BLEP
+	apu_setsynth(APU_SYNTH_BLEP);
+#endif
    return 0;
 }
 
@@ -66,27 +124,62 @@ int osd_installtimer(int frequency, void *func, int funcsize, void *counter, int
 static void (*audio_callback)(void *buffer, int length) = NULL;
 #if CONFIG_SOUND_ENA
 QueueHandle_t queue;
-static uint16_t *audio_frame;
+static sndring_t *audioRing;
+//Samples audioTask has handed to i2s, the clock for PACE_AUDIO
+static volatile uint32 audioClock;
+static SemaphoreHandle_t audioPlayed;
+static int16_t *audio_frame;
+static uint16_t *audio_out;
 #endif
 
 static void do_audio_frame() {
 
 #if CONFIG_SOUND_ENA
-	int left=DEFAULT_SAMPLERATE/NES_REFRESH_RATE;
-	while(left) {
-		int n=DEFAULT_FRAGSIZE;
-		if (n>left) n=left;
-		audio_callback(audio_frame, n); //get more data
+	int n=DEFAULT_SAMPLERATE/NES_REFRESH_RATE;
+	audio_callback(audio_frame, n); //get more data
+	sndring_push(audioRing, audio_frame, n); //never waits, see snd_ring.c
+#else
+	//Nothing to render, but the APU still has to apply this frame's register writes
+	if (audio_callback) audio_callback(NULL, 0);
+#endif
+}
+
+#if CONFIG_SOUND_ENA
+static uint32 audio_now(void *arg) {
+	return audioClock;
+}
+
+static void audio_wait(void *arg, uint32 until) {
+	while ((int32)(audioClock-until)<0) xSemaphoreTake(audioPlayed, portMAX_DELAY);
+}
+
+//This runs on core 1, next to videoTask.
+static void audioTask(void *arg) {
+	sndring_stats_t stats;
+	int frags=0;
+	//Start once there's some slack in the ring
+	while (sndring_fill(audioRing)<AUDIO_TARGET) vTaskDelay(1);
+	while(1) {
+		PROF_BEGIN(PROF_SOUND);
+		sndring_read(audioRing, (int16_t *)audio_out, DEFAULT_FRAGSIZE);
 		//16 bit mono -> 32-bit (16 bit r+l)
-		for (int i=n-1; i>=0; i--) {
-			audio_frame[i*2+1]=audio_frame[i];
-			audio_frame[i*2]=audio_frame[i];
+		for (int i=DEFAULT_FRAGSIZE-1; i>=0; i--) {
+			audio_out[i*2+1]=audio_out[i];
+			audio_out[i*2]=audio_out[i];
+		}
+		PROF_END(PROF_SOUND);
+		i2s_write_bytes(0, audio_out, 4*DEFAULT_FRAGSIZE, portMAX_DELAY);
+		audioClock+=DEFAULT_FRAGSIZE;
+		xSemaphoreGive(audioPlayed);
+
+		if (++frags%AUDIO_STATS_FRAGS==0) {
+			sndring_getstats(audioRing, &stats);
+			printf("Audio: fill %u-%u, %u underruns, %u overruns, rate adjust %d/65536\n",
+				stats.min_fill, stats.max_fill, stats.underruns, stats.overruns, stats.adjust);
 		}
-		i2s_write_bytes(0, audio_frame, 4*n, portMAX_DELAY);
-		left-=n;
 	}
-#endif
 }
+#endif
 
 void osd_setsound(void (*playfunc)(void *buffer, int length))
 {
@@ -103,7 +196,11 @@ static void osd_stopsound(void)
 static int osd_init_sound(void)
 {
 #if CONFIG_SOUND_ENA
-	audio_frame=malloc(4*DEFAULT_FRAGSIZE);
+	audio_frame=malloc(2*DEFAULT_SAMPLERATE/NES_REFRESH_RATE);
+	audio_out=malloc(4*DEFAULT_FRAGSIZE);
+	audioRing=sndring_create(AUDIO_RINGSIZE, AUDIO_TARGET);
+	audioPlayed=xSemaphoreCreateBinary();
+	if (audio_frame==NULL || audio_out==NULL || audioRing==NULL) return -1;
 	i2s_config_t cfg={
 		.mode=I2S_MODE_DAC_BUILT_IN|I2S_MODE_TX|I2S_MODE_MASTER,
 		.sample_rate=DEFAULT_SAMPLERATE,
@@ -123,6 +220,7 @@ static int osd_init_sound(void)
 	CLEAR_PERI_REG_MASK(RTC_IO_PAD_DAC1_REG, RTC_IO_PDAC1_DAC_XPD_FORCE_M);
 	CLEAR_PERI_REG_MASK(RTC_IO_PAD_DAC1_REG, RTC_IO_PDAC1_XPD_DAC_M);
 
+	xTaskCreatePinnedToCore(&audioTask, "audioTask", 3072, NULL, 5, NULL, 1); //printf needs the room
 #endif
 
 	audio_callback = NULL;
@@ -150,7 +248,11 @@ static void free_write(int num_dirties, rect_t *dirty_rects);
 static void custom_blit(bitmap_t *bmp, int num_dirties, rect_t *dirty_rects);
 static char fb[1]; //dummy
 
-QueueHandle_t vidQueue;
+//Frames go from the emulator to videoTask through a pipeline of CONFIG_NOFRENDO_VID_BUFFERS buffers.
+static vidpipe_t *vidPipe;
+static SemaphoreHandle_t pipeMutex, pipeEvent[2];
+
+#define VIDPIPE_STATS_FRAMES (NES_REFRESH_RATE * 10)
 
 viddriver_t sdlDriver =
 {
@@ -197,22 +299,12 @@ static int set_mode(int width, int height)
    return 0;
 }
 
-uint16 myPalette[256];
+uint16 myPalette[PALCONV_ENTRIES];
 
 /* copy nes palette over to hardware */
 static void set_palette(rgb_t *pal)
 {
-	uint16 c;
-
-   int i;
-
-   for (i = 0; i < 256; i++)
-   {
-      c=(pal[i].b>>3)+((pal[i].g>>2)<<5)+((pal[i].r>>3)<<11);
-      //myPalette[i]=(c>>8)|((c&0xff)<<8);
-      myPalette[i]=c;
-   }
-
+	palconv_settable(myPalette, pal);
 }
 
 /* clear all frames to a particular color */
@@ -238,23 +330,111 @@ static void free_write(int num_dirties, rect_t *dirty_rects)
 }
 
 
+//vid_flush() hands the frame to the pipeline after this
 static void custom_blit(bitmap_t *bmp, int num_dirties, rect_t *dirty_rects) {
-	xQueueSend(vidQueue, &bmp, 0);
+}
+
+#if CONFIG_NOFRENDO_PROFILE
+#define PROF_DUMP_FRAMES (NES_REFRESH_RATE*CONFIG_NOFRENDO_PROFILE_INTERVAL)
+
+//The tasks run on both cores, so stamp their zones off the one microsecond timer
+//rather than each core's own cycle counter.
+static uint32 prof_timer(void) {
+	return (uint32)esp_timer_get_time();
+}
+
+static void prof_print(void *arg, const char *text) {
+	printf("%s", text);
+}
+
+//Only the last frame is kept, every so often it goes out over the log.
+static void prof_frame(void) {
+	static int frames=0;
+	if (++frames%PROF_DUMP_FRAMES==0) {
+		printf("Profile: trace start\n");
+		prof_writeheader(prof_print, NULL);
+		prof_writeevents(prof_print, NULL);
+		prof_writefooter(prof_print, NULL);
+		printf("Profile: trace end, %u zones dropped so far\n", prof_dropped());
+	}
+	prof_discard();
+}
+#endif
+
+//Every emulated frame, also the ones that don't get drawn: their audio still has to go out.
+void osd_endframe(void) {
+	pace_stats_t stats;
 	do_audio_frame();
+#if CONFIG_NOFRENDO_PROFILE
+	prof_frame();
+#endif
+
+	pace_getstats(&stats);
+	if (stats.frames%PACE_STATS_FRAMES==0) {
+		printf("Pacing: %u frames, %u late, %u skipped, %u resyncs, jitter avg %u us max %u us, idle %u ms\n",
+			stats.frames, stats.late, stats.skipped, stats.resyncs, stats.jitter_avg, stats.jitter_max, stats.idle);
+		printf("Frameskip: emulate %u us, render %u us, blit %u us, drawing %u/256 of frames, or 1 in %u\n",
+			stats.emulate_us, stats.render_us, stats.blit_us, stats.draw_share>>8, stats.divisor);
+	}
 }
 
 
+static void pipe_lock(void *arg) {
+	xSemaphoreTake(pipeMutex, portMAX_DELAY);
+}
+
+static void pipe_unlock(void *arg) {
+	xSemaphoreGive(pipeMutex);
+}
+
+//No condition variables in FreeRTOS: a binary semaphore per side remembers a signal given before the wait.
+static void pipe_wait(void *arg, int side) {
+	xSemaphoreGive(pipeMutex);
+	xSemaphoreTake(pipeEvent[side], portMAX_DELAY);
+	xSemaphoreTake(pipeMutex, portMAX_DELAY);
+}
+
+static void pipe_signal(void *arg, int side) {
+	xSemaphoreGive(pipeEvent[side]);
+}
+
+static const vidpipe_sync_t pipeSync={
+	NULL, pipe_lock, pipe_unlock, pipe_wait, pipe_signal, timer_now
+};
+
+static int init_vidpipe(void) {
+	pipeMutex=xSemaphoreCreateMutex();
+	pipeEvent[VIDPIPE_PRODUCER]=xSemaphoreCreateBinary();
+	pipeEvent[VIDPIPE_CONSUMER]=xSemaphoreCreateBinary();
+	vidPipe=vidpipe_create(DEFAULT_WIDTH, DEFAULT_HEIGHT, CONFIG_NOFRENDO_VID_BUFFERS, &pipeSync);
+	if (vidPipe==NULL) return -1;
+	vid_setpipeline(vidPipe);
+	return 0;
+}
+
 //This runs on core 1.
 static void videoTask(void *arg) {
 	int x, y;
 	bitmap_t *bmp=NULL;
+	vidpipe_stats_t stats;
 	x = (320-DEFAULT_WIDTH)/2;
     y = ((240-DEFAULT_HEIGHT)/2);
     while(1) {
-//		xQueueReceive(vidQueue, &bmp, portMAX_DELAY);//skip one frame to drop to 30
-		xQueueReceive(vidQueue, &bmp, portMAX_DELAY);
+		bmp=vidpipe_acquire(vidPipe);
+		if (bmp==NULL) break;
+		PROF_BEGIN(PROF_LCD);
 		ili9341_write_frame(x, y, DEFAULT_WIDTH, DEFAULT_HEIGHT, (const uint8_t **)bmp->line);
+		PROF_END(PROF_LCD);
+		vidpipe_release(vidPipe, bmp);
+
+		vidpipe_getstats(vidPipe, &stats);
+		if (stats.displayed%VIDPIPE_STATS_FRAMES==0) {
+			printf("Video: %u produced, %u displayed, %u dropped, stalls: emu %u ms, lcd %u ms\n",
+				stats.produced, stats.displayed, stats.dropped,
+				stats.producer_stall/1000, stats.consumer_stall/1000);
+		}
 	}
+	vTaskDelete(NULL);
 }
 
 
@@ -322,13 +502,18 @@ int osd_init()
 {
 	log_chain_logfunc(logprint);
 
+#if CONFIG_NOFRENDO_PROFILE
+	if (prof_init(prof_timer, 1, CONFIG_NOFRENDO_PROFILE_EVENTS))
+		return -1;
+#endif
 	if (osd_init_sound())
 		return -1;
 
 	ili9341_init();
 	ili9341_write_frame(0,0,320,240,NULL);
-	vidQueue=xQueueCreate(1, sizeof(bitmap_t *));
-	xTaskCreatePinnedToCore(&videoTask, "videoTask", 2048, NULL, 5, NULL, 1);
+	if (init_vidpipe())
+		return -1;
+	xTaskCreatePinnedToCore(&videoTask, "videoTask", 3072, NULL, 5, NULL, 1);
 	osd_initinput();
 	return 0;
 }
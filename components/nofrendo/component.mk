@@ -10,4 +10,38 @@
 COMPONENT_ADD_INCLUDEDIRS := cpu libsnss nes sndhrdw .
 COMPONENT_SRCDIRS := cpu libsnss nes sndhrdw mappers .
 
-CFLAGS += -Wno-error=char-subscripts -Wno-error=attributes -DNOFRENDO_DEBUG
+CFLAGS += -Wno-error=char-subscripts -Wno-error=attributes
+
+ifdef CONFIG_NOFRENDO_PPU_KERNEL_SCALAR
+CFLAGS += -DPPU_KERNEL=PPU_KERNEL_SCALAR
+else
+CFLAGS += -DPPU_KERNEL=PPU_KERNEL_SWAR32
+endif
+
+ifdef CONFIG_NOFRENDO_APU_FLOAT
+CFLAGS += -DAPU_FLOAT
+endif
+
+ifdef CONFIG_NOFRENDO_PROFILE
+CFLAGS += -DNOFRENDO_PROFILE
+endif
+
+ifdef CONFIG_NOFRENDO_CHRCACHE_SLOTS
+CFLAGS += -DPPU_CHRCACHE_SLOTS=$(CONFIG_NOFRENDO_CHRCACHE_SLOTS)
+endif
+
+ifdef CONFIG_NOFRENDO_DECODE_BITS
+CFLAGS += -DNES6502_DECODEBITS=$(CONFIG_NOFRENDO_DECODE_BITS)
+endif
+
+ifndef CONFIG_NOFRENDO_IDLE_SKIP
+CFLAGS += -DNES6502_IDLESKIP=0
+endif
+
+# release builds compile out ASSERTs, logging and memguard
+ifdef CONFIG_NOFRENDO_DEBUG
+CFLAGS += -DNOFRENDO_DEBUG
+ifndef CONFIG_NOFRENDO_MEMGUARD
+CFLAGS += -DNOFRENDO_MEMGUARD=false
+endif
+endif
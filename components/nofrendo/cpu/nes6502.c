@@ -24,6 +24,7 @@
 */
 
 
+#include <string.h>
 #include <noftypes.h>
 #include "nes6502.h"
 #include "dis6502.h"
@@ -59,13 +60,14 @@
 /* Immediate */
 #define IMMEDIATE_BYTE(value) \
 { \
-   value = bank_readbyte(PC++); \
+   value = (uint8) operand; \
+   PC++; \
 }
 
 /* Absolute */
 #define ABSOLUTE_ADDR(address) \
 { \
-   address = bank_readword(PC); \
+   address = operand; \
    PC += 2; \
 }
 
@@ -282,6 +284,8 @@
       if (((int8) btemp + (PC & 0x00FF)) & 0x100) \
          ADD_CYCLES(1); \
       ADD_CYCLES(3); \
+      if ((int8) btemp < 0) \
+         IDLE_LOOP(PC + (int8) btemp, PC); \
       PC += (int8) btemp; \
    } \
    else \
@@ -692,7 +696,7 @@
 
 #define JMP_INDIRECT() \
 { \
-   temp = bank_readword(PC); \
+   temp = operand; \
    /* bug in crossing page boundaries */ \
    if (0xFF == (temp & 0xFF)) \
       PC = (bank_readbyte(temp & 0xFF00) << 8) | bank_readbyte(temp); \
@@ -703,7 +707,9 @@
 
 #define JMP_ABSOLUTE() \
 { \
-   JUMP(PC); \
+   if (operand < PC) \
+      IDLE_LOOP(operand, PC + 2); \
+   PC = operand; \
    ADD_CYCLES(3); \
 }
 
@@ -712,7 +718,7 @@
    PC++; \
    PUSH(PC >> 8); \
    PUSH(PC & 0xFF); \
-   JUMP(PC - 1); \
+   PC = operand; \
    ADD_CYCLES(6); \
 }
 
@@ -1131,11 +1137,11 @@
 
 
 /* internal CPU context */
-static nes6502_context cpu;
-static int remaining_cycles = 0; /* so we can release timeslice */
+static THREAD_LOCAL nes6502_context cpu;
+static THREAD_LOCAL int remaining_cycles = 0; /* so we can release timeslice */
 /* memory region pointers */
-static uint8 *ram = NULL, *stack = NULL;
-static uint8 null_page[NES6502_BANKSIZE];
+static THREAD_LOCAL uint8 *ram = NULL, *stack = NULL;
+static THREAD_LOCAL uint8 null_page[NES6502_BANKSIZE];
 
 
 /*
@@ -1199,33 +1205,356 @@ INLINE void bank_writebyte(register uint32 address, register uint8 value)
    cpu.mem_page[address >> NES6502_BANKSHIFT][address & NES6502_BANKMASK] = value;
 }
 
+/*
+** Instruction decoding
+**
+** The operand of an instruction is fetched along with its opcode, the
+** addressing mode macros take it from there and only step PC past it.
+** Instructions in PRG ROM are kept decoded in a direct mapped cache, keyed
+** by their offset in the ROM image rather than their address, so a bank
+** switch doesn't invalidate anything (the ROM never changes) and code
+** running from RAM or SRAM simply isn't cached.  Cycle counts stay
+** constants in the handlers.
+*/
+
+/* bytes per instruction, opcode included */
+static const uint8 op_length[256] =
+{
+   2, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+   2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+   3, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+   2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+   1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+   2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+   1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+   2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+   2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+   2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+   2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+   2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+   2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+   2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+   2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+   2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3
+};
+
+typedef struct
+{
+   uint32 tag;                /* ROM offset of the opcode */
+   uint16 operand;
+   uint8 opcode, length;
+   const void *handler;       /* opcode label, with NES6502_JUMPTABLE */
+} decode_t;
+
+#define  DECODE_NOTAG         0x80000000  /* page isn't PRG ROM */
+#define  DECODE_EMPTY         0xFFFFFFFF  /* matches no tag */
+
+static THREAD_LOCAL uint8 *code_rom = NULL;
+static THREAD_LOCAL uint32 code_romsize = 0;
+static THREAD_LOCAL nes6502_decodestats decode_stats;
+static THREAD_LOCAL decode_t decode_scratch;
+
+#if NES6502_DECODEBITS
+#define  DECODE_MASK          ((1 << NES6502_DECODEBITS) - 1)
+
+static THREAD_LOCAL decode_t decode_cache[1 << NES6502_DECODEBITS];
+static THREAD_LOCAL uint32 code_tag[NES6502_NUMBANKS]; /* ROM offset of each page */
+
+static void decode_flush(void)
+{
+   int i;
+
+   for (i = 0; i <= DECODE_MASK; i++)
+      decode_cache[i].tag = DECODE_EMPTY;
+}
+
+static void decode_settag(int page)
+{
+   uint8 *ptr = cpu.mem_page[page];
+
+   if (page >= 8 && code_rom && ptr >= code_rom
+       && ptr + NES6502_BANKSIZE <= code_rom + code_romsize)
+      code_tag[page] = ptr - code_rom;
+   else
+      code_tag[page] = DECODE_NOTAG;
+}
+#else /* !NES6502_DECODEBITS */
+#define  decode_flush()
+#define  decode_settag(page)
+#endif /* !NES6502_DECODEBITS */
+
+/* decode the instruction at pc into its cache entry, or the scratch entry
+** when it can't be cached
+*/
+static const decode_t *decode_miss(decode_t *entry, uint32 pc, uint32 tag,
+                                   const void *const *table)
+{
+   if (tag & DECODE_NOTAG)
+      entry = &decode_scratch;
+
+   entry->opcode = bank_readbyte(pc);
+   entry->length = op_length[entry->opcode];
+   entry->handler = table ? table[entry->opcode] : NULL;
+   entry->operand = 0;
+   if (entry->length > 1)
+      entry->operand = bank_readbyte((pc + 1) & 0xFFFF);
+   if (entry->length > 2)
+      entry->operand |= bank_readbyte((pc + 2) & 0xFFFF) << 8;
+
+   /* the rest of it could be in the next page, mapped to any bank */
+   if (entry != &decode_scratch
+       && (pc & NES6502_BANKMASK) + entry->length <= NES6502_BANKSIZE)
+   {
+      entry->tag = tag;
+      decode_stats.misses++;
+   }
+   else
+   {
+      entry->tag = DECODE_EMPTY;
+      decode_stats.uncached++;
+   }
+
+   return entry;
+}
+
+#ifdef NES6502_HISTOGRAM
+
+/* how far an address is looked for before it counts as overflow */
+#define  HIST_PROBES          64
+
+static THREAD_LOCAL nes6502_hist hist;
+static THREAD_LOCAL nes6502_pchist *hist_pc;  /* instruction being executed, if any */
+static THREAD_LOCAL int hist_op = -1;
+static THREAD_LOCAL int32 hist_start;
+
+/* entry for the instruction at pc in the bank mapped there now */
+static nes6502_pchist *hist_findpc(uint32 pc)
+{
+   uint8 *page = cpu.mem_page[pc >> NES6502_BANKSHIFT];
+   nes6502_pchist *entry;
+   uint32 slot;
+   int probe;
+
+   slot = (((uint32) (unsigned long) page >> 4) ^ pc) * 0x9E3779B1;
+   slot >>= 32 - NES6502_HISTPCBITS;
+
+   for (probe = 0; probe < HIST_PROBES; probe++)
+   {
+      entry = &hist.pcs[(slot + probe) & (NES6502_HISTPCS - 1)];
+      if (entry->page == page && entry->pc == pc)
+         return entry;
+
+      if (NULL == entry->page)
+      {
+         entry->page = page;
+         entry->pc = pc;
+         hist.pcs_used++;
+         return entry;
+      }
+   }
+
+   hist.pc_overflow++;
+   return NULL;
+}
+
+/* the cycles since the last instruction started were its own */
+static void hist_close(void)
+{
+   uint32 cycles;
+
+   if (hist_op < 0)
+      return;
+
+   cycles = cpu.total_cycles - hist_start;
+   hist.op_cycles[hist_op] += cycles;
+   if (hist_pc)
+      hist_pc->cycles += cycles;
+
+   hist_op = -1;
+}
+
+static void hist_instr(uint32 pc)
+{
+   hist_close();
+
+   hist_op = bank_readbyte(pc);
+   hist_start = cpu.total_cycles;
+   hist.op_count[hist_op]++;
+
+   hist_pc = hist_findpc(pc);
+   if (hist_pc)
+      hist_pc->count++;
+}
+
+nes6502_hist *nes6502_gethist(void)
+{
+   return &hist;
+}
+
+void nes6502_resethist(void)
+{
+   memset(&hist, 0, sizeof(hist));
+   hist_pc = NULL;
+   hist_op = -1;
+}
+
+#define  HIST_INSTR(pc)          hist_instr(pc)
+#define  HIST_CLOSE()            hist_close()
+#define  HIST_COUNT(counter)     hist.counter++
+#define  HIST_HANDLER(table, n)  hist.table[(n) <= NES6502_HISTHANDLERS ? (n) : 0]++
+
+#else /* !NES6502_HISTOGRAM */
+
+#define  HIST_INSTR(pc)
+#define  HIST_CLOSE()
+#define  HIST_COUNT(counter)
+#define  HIST_HANDLER(table, n)
+
+#endif /* !NES6502_HISTOGRAM */
+
+/* Memory handlers are resolved once, when the context is set, into
+** per-256-byte page dispatch tables.  A page entry is either 0 (plain
+** paged memory), a handler index + 1, or a reference to a per-byte
+** table for the few pages that are shared between several handlers
+** (the $40xx I/O page, some mapper and sound chip registers).
+*/
+#define  HANDLER_PAGES        0x100
+#define  HANDLER_PAGESHIFT    8
+#define  HANDLER_SPLITPAGES   8
+#define  HANDLER_SPLIT        0x80  /* page entry flag: index of split table */
+#define  HANDLER_SCAN         0xFF  /* page entry: out of split tables, walk the list */
+
+static THREAD_LOCAL uint8 read_page[HANDLER_PAGES], write_page[HANDLER_PAGES];
+static THREAD_LOCAL uint8 read_split[HANDLER_SPLITPAGES][HANDLER_PAGES];
+static THREAD_LOCAL uint8 write_split[HANDLER_SPLITPAGES][HANDLER_PAGES];
+
+/* handler index + 1 for an address, 0 if none; same first-match order
+** as mem_readbyte/mem_writebyte used to walk the lists in
+*/
+static uint8 find_readhandler(uint32 address)
+{
+   nes6502_memread *mr;
+
+   for (mr = cpu.read_handler; mr->min_range != 0xFFFFFFFF && mr->read_func; mr++)
+   {
+      if (address >= mr->min_range && address <= mr->max_range)
+         return (uint8) (mr - cpu.read_handler + 1);
+   }
+
+   return 0;
+}
+
+static uint8 find_writehandler(uint32 address)
+{
+   nes6502_memwrite *mw;
+
+   for (mw = cpu.write_handler; mw->min_range != 0xFFFFFFFF && mw->write_func; mw++)
+   {
+      if (address >= mw->min_range && address <= mw->max_range)
+         return (uint8) (mw - cpu.write_handler + 1);
+   }
+
+   return 0;
+}
+
+static void build_page_table(uint8 (*find_handler)(uint32 address), uint8 *page_table,
+                             uint8 split_table[][HANDLER_PAGES], int first_page, int last_page)
+{
+   uint32 address;
+   int page, offset, num_splits = 0;
+   uint8 handler;
+
+   for (page = first_page; page <= last_page; page++)
+   {
+      address = (uint32) page << HANDLER_PAGESHIFT;
+      handler = find_handler(address);
+
+      for (offset = 1; offset < HANDLER_PAGES; offset++)
+      {
+         if (find_handler(address + offset) != handler)
+            break;
+      }
+
+      if (HANDLER_PAGES == offset)
+      {
+         page_table[page] = handler;
+      }
+      else if (num_splits < HANDLER_SPLITPAGES)
+      {
+         for (offset = 0; offset < HANDLER_PAGES; offset++)
+            split_table[num_splits][offset] = find_handler(address + offset);
+         page_table[page] = HANDLER_SPLIT | num_splits++;
+      }
+      else
+      {
+         page_table[page] = HANDLER_SCAN;
+      }
+   }
+}
+
+static void build_address_pages(void)
+{
+   memset(read_page, 0, sizeof(read_page));
+   memset(write_page, 0, sizeof(write_page));
+
+   /* RAM ($0000-$07FF) is never dispatched, and reads of $8000-$FFFF
+   ** always come straight from the banks
+   */
+   if (cpu.read_handler)
+      build_page_table(find_readhandler, read_page, read_split, 0x08, 0x7F);
+   if (cpu.write_handler)
+      build_page_table(find_writehandler, write_page, write_split, 0x08, 0xFF);
+}
+
 /* read a byte of 6502 memory */
 static uint8 mem_readbyte(uint32 address)
 {
    nes6502_memread *mr;
+   uint8 handler;
 
    /* TODO: following 2 cases are N2A03-specific */
    if (address < 0x800)
    {
       /* RAM */
+      HIST_COUNT(ram_reads);
       return ram[address];
    }
    else if (address >= 0x8000)
    {
       /* always paged memory */
+      HIST_COUNT(rom_reads);
       return bank_readbyte(address);
    }
+
    /* check memory range handlers */
-   else
+   handler = read_page[address >> HANDLER_PAGESHIFT];
+   if (handler)
    {
-      for (mr = cpu.read_handler; mr->min_range != 0xFFFFFFFF; mr++)
+      if (HANDLER_SCAN == handler)
       {
-         if (address >= mr->min_range && address <= mr->max_range)
-            return mr->read_func(address);
+         for (mr = cpu.read_handler; mr->min_range != 0xFFFFFFFF; mr++)
+         {
+            if (address >= mr->min_range && address <= mr->max_range)
+            {
+               HIST_HANDLER(read_count, mr - cpu.read_handler + 1);
+               return mr->read_func(address);
+            }
+         }
+      }
+      else
+      {
+         if (handler & HANDLER_SPLIT)
+            handler = read_split[handler & ~HANDLER_SPLIT][address & 0xFF];
+         if (handler)
+         {
+            HIST_HANDLER(read_count, handler);
+            return cpu.read_handler[handler - 1].read_func(address);
+         }
       }
    }
 
    /* return paged memory */
+   HIST_HANDLER(read_count, 0);
    return bank_readbyte(address);
 }
 
@@ -1233,30 +1562,326 @@ static uint8 mem_readbyte(uint32 address)
 static void mem_writebyte(uint32 address, uint8 value)
 {
    nes6502_memwrite *mw;
+   uint8 handler;
 
    /* RAM */
    if (address < 0x800)
    {
+      HIST_COUNT(ram_writes);
       ram[address] = value;
       return;
    }
+
    /* check memory range handlers */
-   else
+   handler = write_page[address >> HANDLER_PAGESHIFT];
+   if (handler)
    {
-      for (mw = cpu.write_handler; mw->min_range != 0xFFFFFFFF; mw++)
+      if (HANDLER_SCAN == handler)
       {
-         if (address >= mw->min_range && address <= mw->max_range)
+         for (mw = cpu.write_handler; mw->min_range != 0xFFFFFFFF; mw++)
          {
-            mw->write_func(address, value);
+            if (address >= mw->min_range && address <= mw->max_range)
+            {
+               HIST_HANDLER(write_count, mw - cpu.write_handler + 1);
+               mw->write_func(address, value);
+               return;
+            }
+         }
+      }
+      else
+      {
+         if (handler & HANDLER_SPLIT)
+            handler = write_split[handler & ~HANDLER_SPLIT][address & 0xFF];
+         if (handler)
+         {
+            HIST_HANDLER(write_count, handler);
+            cpu.write_handler[handler - 1].write_func(address, value);
             return;
          }
       }
    }
 
    /* write to paged memory */
+   HIST_HANDLER(write_count, 0);
    bank_writebyte(address, value);
 }
 
+/*
+** Idle loop skipping
+**
+** A backward jump marks a loop.  The second time round, the loop is
+** checked to be made of nothing but reads, register operations and
+** branches (idle_scan); once it has then gone round IDLE_ROUNDS times
+** leaving every register as it was, it will keep doing exactly that
+** until something outside the CPU changes memory, which only happens
+** between timeslices, or a status register it polls changes on its own,
+** which the register's idle_poll says when.  The whole rounds that fit
+** before either are skipped by adding their cycles; the last one or two
+** run as normal, so the timeslice ends on the same instruction.
+*/
+static THREAD_LOCAL bool idle_enabled = true;
+static THREAD_LOCAL nes6502_idlestats idle_stats;
+
+#if NES6502_IDLESKIP
+
+#define  IDLE_MAXBYTES        16    /* longest loop looked at */
+#define  IDLE_MAXPOLLS        2     /* status register reads in it */
+
+/* The first read of a status register can still change it (the vblank
+** flag), so one round with no change isn't proof of the next.
+*/
+#define  IDLE_ROUNDS          2
+
+enum
+{
+   IDLE_UNKNOWN,
+   IDLE_NO,
+   IDLE_YES
+};
+
+typedef struct
+{
+   uint32 head, end;          /* first byte of the loop, and past its jump back */
+   uint8 *page;               /* bank it was checked in */
+   int verdict;
+   int num_polls;
+   uint32 poll[IDLE_MAXPOLLS];
+   int rounds;                /* in a row with nothing changing, -1 before the first */
+   uint32 cycles;             /* total_cycles the last time at the head */
+   uint32 until;              /* and until when the polled registers stay put */
+   uint8 a, x, y, p, s;
+} idle_t;
+
+static THREAD_LOCAL idle_t idle;
+
+/* Loops found not to be idle, so nested loops taking turns don't get
+** scanned over and over.  Hashed on the head.
+*/
+#define  IDLE_REJECTED        16
+
+typedef struct
+{
+   uint32 head, end;
+   uint8 *page;
+} idle_reject_t;
+
+static THREAD_LOCAL idle_reject_t idle_rejected[IDLE_REJECTED];
+
+static void idle_flush(void)
+{
+   memset(idle_rejected, 0, sizeof(idle_rejected));
+   memset(&idle, 0, sizeof(idle));
+   idle.verdict = IDLE_NO;
+}
+
+/* a backward jump to somewhere else than last time */
+NOINLINE void idle_start(uint32 head, uint32 end)
+{
+   idle_reject_t *rejected = &idle_rejected[head & (IDLE_REJECTED - 1)];
+
+   idle.head = head;
+   idle.end = end;
+   idle.page = cpu.mem_page[head >> NES6502_BANKSHIFT];
+   idle.verdict = IDLE_UNKNOWN;
+   idle.rounds = -1;
+
+   if (false == idle_enabled
+       || (rejected->head == head && rejected->end == end && rejected->page == idle.page))
+      idle.verdict = IDLE_NO;
+}
+
+/* does reading this address change nothing but what's read? */
+static int idle_readable(uint32 address)
+{
+   uint8 handler;
+
+   if (address < 0x800 || address >= 0x8000)
+      return IDLE_YES;
+
+   handler = read_page[address >> HANDLER_PAGESHIFT];
+   if (handler & HANDLER_SPLIT && HANDLER_SCAN != handler)
+      handler = read_split[handler & ~HANDLER_SPLIT][address & 0xFF];
+
+   /* paged memory */
+   if (0 == handler)
+      return IDLE_YES;
+
+   if (NULL == cpu.idle_poll || idle.num_polls == IDLE_MAXPOLLS)
+      return IDLE_NO;
+
+   /* a status register, asked again every time round */
+   idle.poll[idle.num_polls++] = address;
+   return IDLE_YES;
+}
+
+/* the loop from idle.head to idle.end, in PRG ROM and nothing but reads */
+static int idle_scan(void)
+{
+   uint32 pc = idle.head, address;
+   uint8 *page = idle.page;
+   uint8 opcode;
+
+   idle.num_polls = 0;
+
+   if (idle.end - idle.head > IDLE_MAXBYTES
+       || (idle.head >> NES6502_BANKSHIFT) != ((idle.end - 1) >> NES6502_BANKSHIFT)
+       || NULL == code_rom || page < code_rom || page + NES6502_BANKSIZE > code_rom + code_romsize)
+      return IDLE_NO;
+
+   while (pc < idle.end)
+   {
+      opcode = bank_readbyte(pc);
+      address = 0;
+      if (op_length[opcode] > 1)
+         address = bank_readbyte(pc + 1);
+      if (op_length[opcode] > 2)
+         address |= bank_readbyte(pc + 2) << 8;
+
+      switch (opcode)
+      {
+      /* no INX, DEX and the like: a loop counting down is never idle */
+      case 0x18: case 0x38: case 0xB8: case 0xEA:        /* CLC SEC CLV NOP */
+      case 0xAA: case 0xA8: case 0x8A: case 0x98: case 0xBA: /* transfers */
+      case 0xA9: case 0xA2: case 0xA0:                   /* LDx #$nn */
+      case 0x29: case 0x09: case 0x49:                   /* AND ORA EOR #$nn */
+      case 0xC9: case 0xE0: case 0xC0:                   /* CMP CPX CPY #$nn */
+      case 0x10: case 0x30: case 0x50: case 0x70:        /* branches */
+      case 0x90: case 0xB0: case 0xD0: case 0xF0:
+      case 0xA5: case 0xA6: case 0xA4: case 0x24:        /* reads of $nn */
+      case 0x25: case 0x05: case 0x45:
+      case 0xC5: case 0xE4: case 0xC4:
+         break;
+
+      case 0xAD: case 0xAE: case 0xAC: case 0x2C:        /* reads of $nnnn */
+      case 0x2D: case 0x0D: case 0x4D:
+      case 0xCD: case 0xEC: case 0xCC:
+         if (IDLE_NO == idle_readable(address))
+            return IDLE_NO;
+         break;
+
+      case 0x4C:                                         /* JMP $nnnn, the jump back */
+         if (pc + 3 != idle.end)
+            return IDLE_NO;
+         break;
+
+      default:
+         return IDLE_NO;
+      }
+
+      pc += op_length[opcode];
+   }
+
+   /* has to end exactly on the jump back */
+   return (pc == idle.end) ? IDLE_YES : IDLE_NO;
+}
+
+/* at the head of the loop again, with these registers */
+NOINLINE void idle_round(uint8 a, uint8 x, uint8 y, uint8 p, uint8 s)
+{
+   int32 round, rounds, limit;
+   uint32 poll, steady = (uint32) -1;
+   idle_reject_t *rejected;
+   int i;
+
+   if (IDLE_UNKNOWN == idle.verdict || idle.page != cpu.mem_page[idle.head >> NES6502_BANKSHIFT])
+   {
+      idle.page = cpu.mem_page[idle.head >> NES6502_BANKSHIFT];
+      idle.verdict = idle_scan();
+      idle.rounds = -1;
+      if (IDLE_NO == idle.verdict)
+      {
+         rejected = &idle_rejected[idle.head & (IDLE_REJECTED - 1)];
+         rejected->head = idle.head;
+         rejected->end = idle.end;
+         rejected->page = idle.page;
+         return;
+      }
+   }
+
+   for (i = 0; i < idle.num_polls; i++)
+   {
+      poll = cpu.idle_poll(idle.poll[i]);
+      if (0 == poll)
+      {
+         idle.verdict = IDLE_NO;
+         return;
+      }
+
+      if (poll < steady)
+         steady = poll;
+   }
+
+   /* the last round only counts if what it read was still there now */
+   if (idle.rounds >= 0 && a == idle.a && x == idle.x && y == idle.y && p == idle.p && s == idle.s
+       && (int32) (cpu.total_cycles - idle.until) <= 0)
+      idle.rounds++;
+   else
+      idle.rounds = 0;
+
+   idle.a = a;
+   idle.x = x;
+   idle.y = y;
+   idle.p = p;
+   idle.s = s;
+
+   /* far enough for ever, near enough to compare */
+   if (steady > 0x3FFFFFFF)
+      steady = 0x3FFFFFFF;
+
+   round = (int32) (cpu.total_cycles - idle.cycles);
+   idle.cycles = cpu.total_cycles;
+   idle.until = cpu.total_cycles + steady;
+
+   if (idle.rounds < IDLE_ROUNDS || round <= 0 || remaining_cycles <= round)
+      return;
+
+   /* leave at least a cycle, so the slice ends on the same instruction */
+   limit = remaining_cycles - 1;
+   if ((uint32) limit > steady)
+      limit = steady;
+
+   rounds = limit / round;
+   if (0 == rounds)
+      return;
+
+   ADD_CYCLES(rounds * round);
+   idle.cycles = cpu.total_cycles;
+
+   idle_stats.skips++;
+   idle_stats.iterations += rounds;
+   idle_stats.cycles += rounds * round;
+}
+
+/* idle_start() and idle_round() are kept out of line, inlined into
+** nes6502_execute() they slow down ROMs without idle loops by a few percent
+*/
+#define  IDLE_LOOP(first, past) \
+{ \
+   if ((first) != idle.head || (past) != idle.end) \
+      idle_start((first), (past)); \
+   else if (IDLE_NO != idle.verdict) \
+      idle_round(A, X, Y, COMBINE_FLAGS(), S); \
+}
+
+#else /* !NES6502_IDLESKIP */
+#define  idle_flush()
+#define  IDLE_LOOP(first, past)
+#endif /* !NES6502_IDLESKIP */
+
+void nes6502_setidleskip(bool enable)
+{
+   idle_enabled = enable;
+   idle_flush();
+}
+
+void nes6502_getidlestats(nes6502_idlestats *stats, bool reset_flag)
+{
+   *stats = idle_stats;
+
+   if (reset_flag)
+      memset(&idle_stats, 0, sizeof(idle_stats));
+}
+
 /* set the current context */
 void nes6502_setcontext(nes6502_context *context)
 {
@@ -1275,6 +1900,60 @@ void nes6502_setcontext(nes6502_context *context)
 
    ram = cpu.mem_page[0];  /* quick zero-page/RAM references */
    stack = ram + STACK_OFFSET;
+
+   for (loop = 0; loop < NES6502_NUMBANKS; loop++)
+      decode_settag(loop);
+
+   build_address_pages();
+   idle_flush();
+}
+
+/* point a single 4kB page of 6502 memory somewhere, NULL for the
+** dead page.  Cheap enough for bank switches from inside the CPU.
+*/
+void nes6502_setpage(int page, uint8 *ptr)
+{
+   ASSERT(page >= 0 && page < NES6502_NUMBANKS);
+
+   cpu.mem_page[page] = (NULL == ptr) ? null_page : ptr;
+
+   if (0 == page)
+   {
+      ram = cpu.mem_page[0];
+      stack = ram + STACK_OFFSET;
+   }
+
+   decode_settag(page);
+}
+
+/* tell the CPU where PRG ROM is; pages mapped anywhere else are decoded
+** every time they are executed
+*/
+void nes6502_setrom(uint8 *rom, uint32 size)
+{
+   int page;
+
+   code_rom = rom;
+   code_romsize = size;
+   decode_flush();
+   memset(&decode_stats, 0, sizeof(decode_stats));
+
+   idle_flush();
+   memset(&idle_stats, 0, sizeof(idle_stats));
+
+   /* a new cart: whatever the last one wrote to unmapped memory is gone */
+   memset(null_page, 0, sizeof(null_page));
+
+   for (page = 0; page < NES6502_NUMBANKS; page++)
+      decode_settag(page);
+}
+
+void nes6502_getdecodestats(nes6502_decodestats *stats, bool reset_flag)
+{
+   *stats = decode_stats;
+
+   if (reset_flag)
+      memset(&decode_stats, 0, sizeof(decode_stats));
 }
 
 /* get the current context */
@@ -1333,6 +2012,28 @@ uint32 nes6502_getcycles(bool reset_flag)
 
 #define  MIN(a,b)    (((a) < (b)) ? (a) : (b))
 
+/* decode the instruction at PC and step past its opcode */
+#if NES6502_DECODEBITS
+#define  FETCH(table) \
+{ \
+   tag = code_tag[PC >> NES6502_BANKSHIFT] + (PC & NES6502_BANKMASK); \
+   instr = &decode_cache[tag & DECODE_MASK]; \
+   if (tag == instr->tag) \
+      hits++; \
+   else \
+      instr = decode_miss(&decode_cache[tag & DECODE_MASK], PC, tag, (table)); \
+   operand = instr->operand; \
+   PC++; \
+}
+#else /* !NES6502_DECODEBITS */
+#define  FETCH(table) \
+{ \
+   instr = decode_miss(NULL, PC, DECODE_NOTAG, (table)); \
+   operand = instr->operand; \
+   PC++; \
+}
+#endif /* !NES6502_DECODEBITS */
+
 #ifdef NES6502_JUMPTABLE
 
 #define  OPCODE_BEGIN(xx)  op##xx:
@@ -1342,14 +2043,18 @@ uint32 nes6502_getcycles(bool reset_flag)
    if (remaining_cycles <= 0) \
       goto end_execute; \
    log_printf(nes6502_disasm(PC, COMBINE_FLAGS(), A, X, Y, S)); \
-   goto *opcode_table[bank_readbyte(PC++)];
+   HIST_INSTR(PC); \
+   FETCH(opcode_table); \
+   goto *instr->handler;
 
 #else /* !NES6520_DISASM */
 
 #define  OPCODE_END \
    if (remaining_cycles <= 0) \
       goto end_execute; \
-   goto *opcode_table[bank_readbyte(PC++)];
+   HIST_INSTR(PC); \
+   FETCH(opcode_table); \
+   goto *instr->handler;
 
 #endif /* !NES6502_DISASM */
 
@@ -1366,12 +2071,19 @@ uint32 nes6502_getcycles(bool reset_flag)
 */
 int nes6502_execute(int timeslice_cycles)
 {
-   int old_cycles = cpu.total_cycles;
+   uint32 old_cycles = cpu.total_cycles;
 
    uint32 temp, addr; /* for macros */
    uint8 btemp, baddr; /* for macros */
    uint8 data;
 
+   /* instruction being executed */
+   const decode_t *instr;
+   uint32 operand;
+#if NES6502_DECODEBITS
+   uint32 tag, hits = 0;
+#endif /* NES6502_DECODEBITS */
+
    /* flags */
    uint8 n_flag, v_flag, b_flag;
    uint8 d_flag, i_flag, z_flag, c_flag;
@@ -1422,6 +2134,11 @@ int nes6502_execute(int timeslice_cycles)
 
    remaining_cycles = timeslice_cycles;
 
+#if NES6502_IDLESKIP
+   /* between timeslices anything may have changed */
+   idle.rounds = -1;
+#endif /* NES6502_IDLESKIP */
+
    GET_GLOBAL_REGS();
 
    /* check for DMA cycle burning */
@@ -1453,9 +2170,11 @@ int nes6502_execute(int timeslice_cycles)
 #ifdef NES6502_DISASM
       log_printf(nes6502_disasm(PC, COMBINE_FLAGS(), A, X, Y, S));
 #endif /* NES6502_DISASM */
+      HIST_INSTR(PC);
 
       /* Fetch and execute instruction */
-      switch (bank_readbyte(PC++))
+      FETCH(NULL);
+      switch (instr->opcode)
       {
 #endif /* !NES6502_JUMPTABLE */
 
@@ -2394,11 +3113,18 @@ end_execute:
    }
 #endif /* !NES6502_JUMPTABLE */
 
+   /* interrupts and DMA next time aren't the last instruction's */
+   HIST_CLOSE();
+
+#if NES6502_DECODEBITS
+   decode_stats.hits += hits;
+#endif /* NES6502_DECODEBITS */
+
    /* store local copy of regs */
    STORE_LOCAL_REGS();
 
    /* Return our actual amount of executed cycles */
-   return (cpu.total_cycles - old_cycles);
+   return (int) (cpu.total_cycles - old_cycles);
 }
 
 /* Issue a CPU Reset */
@@ -34,6 +34,33 @@
 /* Define this to enable decimal mode in ADC / SBC (not needed in NES) */
 /*#define  NES6502_DECIMAL*/
 
+/* Define this to count executed opcodes and their cycles, the hits on
+** each memory handler, and every instruction address per bank
+** (nes6502_gethist).  Costs a good deal of speed and half a meg of RAM.
+*/
+/*#define  NES6502_HISTOGRAM*/
+
+/* Instructions in PRG ROM are decoded once into a direct mapped cache of
+** this many entries (as a power of 2), keyed by ROM offset so that bank
+** switches don't invalidate it.  12 bytes an entry on a 32-bit CPU; 0
+** turns it off and decodes every instruction the slow way.  Off unless
+** the build asks for it, 10 is a reasonable size to start from.
+*/
+#ifndef NES6502_DECODEBITS
+#define  NES6502_DECODEBITS   0
+#endif /* !NES6502_DECODEBITS */
+
+/* Loops that only wait, the same few instructions going round reading
+** RAM, ROM or a status register with nothing else changing, are fast-
+** forwarded to the end of the timeslice (or until the value read would
+** change) instead of being run.  The cycle count comes out the same.
+** nes6502_setidleskip() turns it off at runtime, for the calling thread
+** with NOFRENDO_REENTRANT; 0 leaves it out.
+*/
+#ifndef NES6502_IDLESKIP
+#define  NES6502_IDLESKIP     1
+#endif /* !NES6502_IDLESKIP */
+
 #define  NES6502_NUMBANKS  16
 #define  NES6502_BANKSHIFT 12
 #define  NES6502_BANKSIZE  (0x10000 / NES6502_NUMBANKS)
@@ -83,6 +110,11 @@ typedef struct
    nes6502_memread *read_handler;
    nes6502_memwrite *write_handler;
 
+   /* cycles a handler read keeps returning the same value with no further
+   ** side effects, 0 if it doesn't; NULL for none of them
+   */
+   uint32 (*idle_poll)(uint32 address);
+
    uint32 pc_reg;
    uint8 a_reg, p_reg;
    uint8 x_reg, y_reg;
@@ -92,9 +124,54 @@ typedef struct
    
    uint8 int_pending, int_latency;
 
-   int32 total_cycles, burn_cycles;
+   uint32 total_cycles;       /* wraps, compare through (int32) differences */
+   int32 burn_cycles;
 } nes6502_context;
 
+/* instruction fetches through the decode cache */
+typedef struct
+{
+   uint32 hits, misses;
+   uint32 uncached;           /* outside PRG ROM, or across a page boundary */
+} nes6502_decodestats;
+
+/* waiting loops fast-forwarded since the last ROM was set */
+typedef struct
+{
+   uint32 skips;
+   uint32 iterations;         /* times round the loops that weren't run */
+   uint32 cycles;             /* and the cycles they would have taken */
+} nes6502_idlestats;
+
+#ifdef NES6502_HISTOGRAM
+
+#define  NES6502_HISTPCBITS   15
+#define  NES6502_HISTPCS      (1 << NES6502_HISTPCBITS)
+#define  NES6502_HISTHANDLERS 32
+
+/* an instruction address, in the bank that was mapped there */
+typedef struct
+{
+   uint8 *page;
+   uint32 pc;
+   uint32 count, cycles;
+} nes6502_pchist;
+
+typedef struct
+{
+   uint32 op_count[256], op_cycles[256];
+
+   /* [0] is paged memory without a handler, [n] is read/write_handler[n - 1] */
+   uint32 read_count[NES6502_HISTHANDLERS + 1];
+   uint32 write_count[NES6502_HISTHANDLERS + 1];
+   uint32 ram_reads, ram_writes, rom_reads;
+
+   uint32 pcs_used, pc_overflow;
+   nes6502_pchist pcs[NES6502_HISTPCS];
+} nes6502_hist;
+
+#endif /* NES6502_HISTOGRAM */
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
@@ -113,6 +190,21 @@ extern void nes6502_release(void);
 extern void nes6502_setcontext(nes6502_context *cpu);
 extern void nes6502_getcontext(nes6502_context *cpu);
 
+/* Bank switching */
+extern void nes6502_setpage(int page, uint8 *ptr);
+
+/* PRG ROM, the only memory whose instructions get cached */
+extern void nes6502_setrom(uint8 *rom, uint32 size);
+extern void nes6502_getdecodestats(nes6502_decodestats *stats, bool reset_flag);
+
+extern void nes6502_setidleskip(bool enable);
+extern void nes6502_getidlestats(nes6502_idlestats *stats, bool reset_flag);
+
+#ifdef NES6502_HISTOGRAM
+extern nes6502_hist *nes6502_gethist(void);
+extern void nes6502_resethist(void);
+#endif /* NES6502_HISTOGRAM */
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -155,7 +155,7 @@ enum
 
 
 /* TODO: roll options into a structure */
-static message_t msg;
+static THREAD_LOCAL message_t msg;
 static bool option_showfps = false;
 static bool option_showgui = false;
 static int option_wavetype = GUI_WAVENONE;
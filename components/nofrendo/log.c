@@ -71,7 +71,7 @@ int log_print(const char *string)
 int log_printf(const char *format, ... )
 {
    /* don't allocate on stack every call */
-   static char buffer[1024 + 1];
+   static THREAD_LOCAL char buffer[1024 + 1];
    va_list arg;
 
    va_start(arg, format);
@@ -129,8 +129,11 @@ void log_assert(int expr, int line, const char *file, char *msg)
    else
       log_printf("ASSERT: line %d of %s\n", line, file);
 
+#ifdef __XTENSA__
    asm("break.n 1");
-//   exit(-1);
+#else /* !__XTENSA__ */
+   exit(-1);
+#endif /* !__XTENSA__ */
 }
 
 
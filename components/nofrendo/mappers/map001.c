@@ -50,11 +50,11 @@ not be possible.
 */
 
 /* TODO: roll this into something... */
-static int bitcount = 0;
-static uint8 latch = 0;
-static uint8 regs[4];
-static int bank_select;
-static uint8 lastreg;
+static THREAD_LOCAL int bitcount = 0;
+static THREAD_LOCAL uint8 latch = 0;
+static THREAD_LOCAL uint8 regs[4];
+static THREAD_LOCAL int bank_select;
+static THREAD_LOCAL uint8 lastreg;
 
 static void map1_write(uint32 address, uint8 value)
 {
@@ -151,6 +151,7 @@ static void map1_init(void)
 {
    bitcount = 0;
    latch = 0;
+   lastreg = 0;
 
    memset(regs, 0, sizeof(regs));
 
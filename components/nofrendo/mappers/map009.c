@@ -29,8 +29,8 @@
 #include <nes_ppu.h>
 #include <libsnss.h>
 
-static uint8 latch[2];
-static uint8 regs[4];
+static THREAD_LOCAL uint8 latch[2];
+static THREAD_LOCAL uint8 regs[4];
 
 /* Used when tile $FD/$FE is accessed */
 static void mmc9_latchfunc(uint32 address, uint8 value)
@@ -28,7 +28,7 @@
 #include <nes_ppu.h>
 #include <nes.h>
 
-static struct
+static THREAD_LOCAL struct
 {
    int counter;
    bool enabled;
@@ -23,6 +23,7 @@
 ** $Id: map018.c,v 1.2 2001/04/27 14:37:11 neil Exp $
 */
 
+#include <string.h>
 #include <noftypes.h>
 #include <nes_mmc.h>
 #include <nes_ppu.h>
@@ -46,22 +47,28 @@ do { \
    mmc_bankvrom(1, (bank) << 10, (highnybbles[(bank)] << 4)+lownybbles[(bank)]); \
 }
 
-static struct
+static THREAD_LOCAL struct
 {
    int counter, enabled;
    uint8 nybbles[4];
    int clockticks;
 } irq;
 
+static THREAD_LOCAL uint8 lownybbles[8];
+static THREAD_LOCAL uint8 highnybbles[8];
+static THREAD_LOCAL uint8 lowprgnybbles[3];
+static THREAD_LOCAL uint8 highprgnybbles[3];
+
 static void map18_init(void)
 {
    irq.counter = irq.enabled = 0;
+
+   memset(lownybbles, 0, sizeof(lownybbles));
+   memset(highnybbles, 0, sizeof(highnybbles));
+   memset(lowprgnybbles, 0, sizeof(lowprgnybbles));
+   memset(highprgnybbles, 0, sizeof(highprgnybbles));
 }
 
-static uint8 lownybbles[8];
-static uint8 highnybbles[8];
-static uint8 lowprgnybbles[3];
-static uint8 highprgnybbles[3];
 
 
 static void map18_write(uint32 address, uint8 value)
@@ -39,7 +39,7 @@
    ppu_mirrorhipages(); \
 }
 
-static struct
+static THREAD_LOCAL struct
 {
    int counter, enabled;
 } irq;
@@ -29,7 +29,7 @@
 #include <log.h>
 #include <vrcvisnd.h>
 
-static struct
+static THREAD_LOCAL struct
 {
    int counter, enabled;
    int latch, wait_state;
@@ -29,11 +29,11 @@
 #include <libsnss.h>
 #include <log.h>
 
-#define  MAP40_IRQ_PERIOD  (4096 / 113.666666)
+#define  MAP40_IRQ_CYCLES  4096
 
-static struct
+static THREAD_LOCAL struct
 {
-   int enabled, counter;
+   int enabled, counter;      /* 6502 cycles to go, the timer counts them once enabled */
 } irq;
 
 /* mapper 40: SMB 2j (hack) */
@@ -45,22 +45,14 @@ static void map40_init(void)
    mmc_bankrom(8, 0xE000, 7);
 
    irq.enabled = false;
-   irq.counter = (int) MAP40_IRQ_PERIOD;
+   irq.counter = MAP40_IRQ_CYCLES;
 }
 
-static void map40_hblank(int vblank)
+static void map40_irq(void)
 {
-   UNUSED(vblank);
-
-   if (irq.enabled && irq.counter)
-   {
-      irq.counter--;
-      if (0 == irq.counter)
-      {
-         nes_irq();
-         irq.enabled = false;
-      }
-   }
+   nes_irq();
+   irq.enabled = false;
+   irq.counter = 0;
 }
 
 static void map40_write(uint32 address, uint8 value)
@@ -71,10 +63,14 @@ static void map40_write(uint32 address, uint8 value)
    {
    case 0: /* 0x8000-0x9FFF */
       irq.enabled = false;
-      irq.counter = (int) MAP40_IRQ_PERIOD;
+      irq.counter = MAP40_IRQ_CYCLES;
+      nes_settimer(0, NULL);
       break;
 
    case 1: /* 0xA000-0xBFFF */
+      /* only 0x8000-0x9FFF stops the counter, and it resets it too */
+      if (false == irq.enabled && irq.counter)
+         nes_settimer(irq.counter, map40_irq);
       irq.enabled = true;
       break;
 
@@ -89,14 +85,27 @@ static void map40_write(uint32 address, uint8 value)
 
 static void map40_getstate(SnssMapperBlock *state)
 {
-   state->extraData.mapper40.irqCounter = irq.counter;
+   int counter;
+
+   /* a running counter is only kept by the timer */
+   counter = irq.enabled ? nes_gettimer() : irq.counter;
+
+   /* SNSS counts scanlines */
+   state->extraData.mapper40.irqCounter = counter * NES_CPU_DIVIDER
+                                          / NES_SCANLINE_CLOCKS;
    state->extraData.mapper40.irqCounterEnabled = irq.enabled;
 }
 
 static void map40_setstate(SnssMapperBlock *state)
 {
-   irq.counter = state->extraData.mapper40.irqCounter;
+   irq.counter = state->extraData.mapper40.irqCounter * NES_SCANLINE_CLOCKS
+                 / NES_CPU_DIVIDER;
    irq.enabled = state->extraData.mapper40.irqCounterEnabled;
+
+   if (irq.enabled && irq.counter)
+      nes_settimer(irq.counter, map40_irq);
+   else
+      nes_settimer(0, NULL);
 }
 
 static map_memwrite map40_memwrite[] =
@@ -111,7 +120,7 @@ mapintf_t map40_intf =
    "SMB 2j (pirate)", /* mapper name */
    map40_init, /* init routine */
    NULL, /* vblank callback */
-   map40_hblank, /* hblank callback */
+   NULL, /* hblank callback */
    map40_getstate, /* get state (snss) */
    map40_setstate, /* set state (snss) */
    NULL, /* memory read structure */
@@ -32,10 +32,9 @@
 #include <libsnss.h>
 #include <log.h>
 
-static struct
+static THREAD_LOCAL struct
 {
   bool enabled;
-  uint32 counter;
 } irq;
 
 /********************************/
@@ -43,9 +42,9 @@ static struct
 /********************************/
 static void map42_irq_reset (void)
 {
-  /* Turn off IRQs */
+  /* Turn off IRQs, the counter goes back to zero */
   irq.enabled = false;
-  irq.counter = 0x0000;
+  nes_settimer (0, NULL);
 
   /* Done */
   return;
@@ -72,29 +71,13 @@ static void map42_init (void)
 /****************************************/
 /* Mapper #42 callback for IRQ handling */
 /****************************************/
-static void map42_hblank (int vblank)
+static void map42_irq (void)
 {
-   /* Counter is M2 based so it doesn't matter whether */
-   /* the PPU is in its VBlank period or not           */
-   UNUSED(vblank);
-
-   /* Increment the counter if it is enabled and check for strike */
-   if (irq.enabled)
-   {
-     /* Is there a constant for cycles per scanline? */
-     /* If so, someone ought to substitute it here   */
-     irq.counter = irq.counter + 114;
-
-     /* IRQ is triggered after 24576 M2 cycles */
-     if (irq.counter >= 0x6000)
-     {
-       /* Trigger the IRQ */
-       nes_irq ();
-
-       /* Reset the counter */
-       map42_irq_reset ();
-     }
-   }
+   /* Trigger the IRQ */
+   nes_irq ();
+
+   /* Reset the counter */
+   map42_irq_reset ();
 }
 
 /******************************************/
@@ -114,8 +97,15 @@ static void map42_write (uint32 address, uint8 value)
                break;
 
     /* Register 2: IRQ */
-    case 0x02: if (value & 0x02) irq.enabled = true;
-               else              map42_irq_reset ();
+    case 0x02: if (value & 0x02)
+               {
+                 /* IRQ is triggered after 24576 M2 cycles */
+                 if (false == irq.enabled)
+                   nes_settimer (0x6000, map42_irq);
+                 irq.enabled = true;
+               }
+               else
+                 map42_irq_reset ();
                break;
 
     /* Register 3: unused */
@@ -162,7 +152,7 @@ mapintf_t map42_intf =
    "Baby Mario (bootleg)",           /* Mapper name */
    map42_init,                       /* Initialization routine */
    NULL,                             /* VBlank callback */
-   map42_hblank,                     /* HBlank callback */
+   NULL,                             /* HBlank callback */
    map42_getstate,                   /* Get state (SNSS) */
    map42_setstate,                   /* Set state (SNSS) */
    NULL,                             /* Memory read structure */
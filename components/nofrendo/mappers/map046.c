@@ -32,10 +32,10 @@
 #include <libsnss.h>
 #include <log.h>
 
-static uint8 prg_low_bank;
-static uint8 chr_low_bank;
-static uint8 prg_high_bank;
-static uint8 chr_high_bank;
+static THREAD_LOCAL uint8 prg_low_bank;
+static THREAD_LOCAL uint8 chr_low_bank;
+static THREAD_LOCAL uint8 prg_high_bank;
+static THREAD_LOCAL uint8 chr_high_bank;
 
 /*************************************************/
 /* Set banks from the combined register values   */
@@ -56,6 +56,8 @@ static void map46_set_banks (void)
 static void map46_init (void)
 {
   /* High bank switch register is set to zero on reset */
+  prg_low_bank = 0x00;
+  chr_low_bank = 0x00;
   prg_high_bank = 0x00;
   chr_high_bank = 0x00;
   map46_set_banks ();
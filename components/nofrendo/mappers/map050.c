@@ -32,7 +32,7 @@
 #include <libsnss.h>
 #include <log.h>
 
-static struct
+static THREAD_LOCAL struct
 {
   bool enabled;
   uint32 counter;
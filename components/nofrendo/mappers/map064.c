@@ -28,14 +28,14 @@
 #include <nes.h>
 #include <log.h>
 
-static struct
+static THREAD_LOCAL struct
 {
    int counter, latch;
    bool enabled, reset;
 } irq;
 
-static uint8 command = 0;
-static uint16 vrombase = 0x0000;
+static THREAD_LOCAL uint8 command = 0;
+static THREAD_LOCAL uint16 vrombase = 0x0000;
 
 static void map64_hblank(int vblank)
 {
@@ -171,6 +171,9 @@ static void map64_init(void)
 
    irq.counter = irq.latch = 0;
    irq.reset = irq.enabled = false;
+
+   command = 0;
+   vrombase = 0x0000;
 }
 
 static map_memwrite map64_memwrite[] =
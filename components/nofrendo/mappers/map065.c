@@ -27,7 +27,7 @@
 #include <nes_mmc.h>
 #include <nes_ppu.h>
 
-static struct
+static THREAD_LOCAL struct
 {
    int counter;
    bool enabled;
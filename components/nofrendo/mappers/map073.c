@@ -31,10 +31,11 @@
 #include <libsnss.h>
 #include <log.h>
 
-static struct
+static THREAD_LOCAL struct
 {
   bool enabled;
   uint32 counter;
+  uint32 cycle;     /* 6502 cycle the counter was last brought up to */
 } irq;
 
 /**************************/
@@ -45,40 +46,52 @@ static void map73_init (void)
   /* Turn off IRQs */
   irq.enabled = false;
   irq.counter = 0x0000;
+  irq.cycle = nes6502_getcycles (false);
 
   /* Done */
   return;
 }
 
+/********************************************/
+/* Mapper #73: bring the counter up to date */
+/********************************************/
+static void map73_sync (void)
+{
+   uint32 now = nes6502_getcycles (false);
+
+   /* Counter is M2 based, it counts every 6502 cycle */
+   if (irq.enabled)
+     irq.counter += now - irq.cycle;
+
+   irq.cycle = now;
+}
+
 /****************************************/
 /* Mapper #73 callback for IRQ handling */
 /****************************************/
-static void map73_hblank (int vblank)
+static void map73_irq (void)
 {
-   /* Counter is M2 based so it doesn't matter whether */
-   /* the PPU is in its VBlank period or not           */
-   UNUSED (vblank);
+   map73_sync ();
+
+   /* Counter triggered on overflow into Q16, clip to sixteen-bit word */
+   irq.counter &= 0xFFFF;
 
-   /* Increment the counter if it is enabled and check for strike */
+   /* Trigger the IRQ */
+   nes_irq ();
+
+   /* Shut off IRQ counter */
+   irq.enabled = false;
+}
+
+/*************************************************/
+/* Mapper #73: time the overflow, after a change */
+/*************************************************/
+static void map73_settimer (void)
+{
    if (irq.enabled)
-   {
-     /* Is there a constant for cycles per scanline? */
-     /* If so, someone ought to substitute it here   */
-     irq.counter = irq.counter + 114;
-
-     /* Counter triggered on overflow into Q16 */
-     if (irq.counter & 0x10000)
-     {
-       /* Clip to sixteen-bit word */
-       irq.counter &= 0xFFFF;
-
-       /* Trigger the IRQ */
-       nes_irq ();
-
-       /* Shut off IRQ counter */
-       irq.enabled = false;
-     }
-   }
+     nes_settimer ((int) (0x10000 - irq.counter), map73_irq);
+   else
+     nes_settimer (0, NULL);
 }
 
 /******************************************/
@@ -86,6 +99,8 @@ static void map73_hblank (int vblank)
 /******************************************/
 static void map73_write (uint32 address, uint8 value)
 {
+  map73_sync ();
+
   switch (address & 0xF000)
   {
     case 0x8000: irq.counter &= 0xFFF0;
@@ -107,6 +122,8 @@ static void map73_write (uint32 address, uint8 value)
     default:     break;
   }
 
+  map73_settimer ();
+
   /* Done */
   return;
 }
@@ -147,7 +164,7 @@ mapintf_t map73_intf =
    "Konami VRC3",                    /* Mapper name */
    map73_init,                       /* Initialization routine */
    NULL,                             /* VBlank callback */
-   map73_hblank,                     /* HBlank callback */
+   NULL,                             /* HBlank callback */
    map73_getstate,                   /* Get state (SNSS) */
    map73_setstate,                   /* Set state (SNSS) */
    NULL,                             /* Memory read structure */
@@ -28,7 +28,7 @@
 #include <nes_ppu.h>
 #include <nes.h>
 
-static struct
+static THREAD_LOCAL struct
 {
    bool enabled, expired;
    int counter;
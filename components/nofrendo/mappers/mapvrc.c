@@ -23,6 +23,7 @@
 ** $Id: mapvrc.c,v 1.2 2001/04/27 14:37:11 neil Exp $
 */
 
+#include <string.h>
 #include <noftypes.h>
 #include <nes_mmc.h>
 #include <nes.h>
@@ -37,20 +38,24 @@
    mmc_bankvrom(1, (bank) << 10, (highnybbles[(bank)] << 4)+lownybbles[(bank)]); \
 }
 
-static struct
+static THREAD_LOCAL struct
 {
    int counter, enabled;
    int latch, wait_state;
 } irq;
 
-static int select_c000 = 0;
-static uint8 lownybbles[8];
-static uint8 highnybbles[8];
+static THREAD_LOCAL int select_c000 = 0;
+static THREAD_LOCAL uint8 lownybbles[8];
+static THREAD_LOCAL uint8 highnybbles[8];
 
 static void vrc_init(void)
 {
    irq.counter = irq.enabled = 0;
    irq.latch = irq.wait_state = 0;
+
+   select_c000 = 0;
+   memset(lownybbles, 0, sizeof(lownybbles));
+   memset(highnybbles, 0, sizeof(highnybbles));
 }
 
 static void map21_write(uint32 address, uint8 value)
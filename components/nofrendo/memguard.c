@@ -50,8 +50,14 @@ typedef struct memblock_s
    int   line_num;
 } memblock_t;
 
-/* debugging flag */
-bool mem_debug = true;
+/* debugging flag: guard and track heap blocks in NOFRENDO_DEBUG builds.
+** Only looked at on the first allocation, blocks can't change type later.
+*/
+#ifndef NOFRENDO_MEMGUARD
+#define  NOFRENDO_MEMGUARD    true
+#endif /* !NOFRENDO_MEMGUARD */
+
+bool mem_debug = NOFRENDO_MEMGUARD;
 
 
 #ifdef NOFRENDO_DEBUG
@@ -228,8 +234,8 @@ static void mem_deleteblock(void *data, char *file, int line)
       {
          if (mem_checkguardblock(mem_record[i].block_addr, GUARD_LENGTH))
          {
-            sprintf(fail, "mem_deleteblock 0x%08X at line %d of %s -- block corrupt",
-                    (uint32) data, line, file);
+            sprintf(fail, "mem_deleteblock %p at line %d of %s -- block corrupt",
+                    data, line, file);
             ASSERT_MSG(fail);
          }
 
@@ -238,8 +244,8 @@ static void mem_deleteblock(void *data, char *file, int line)
       }
    }
 
-   sprintf(fail, "mem_deleteblock 0x%08X at line %d of %s -- block not found",
-           (uint32) data, line, file);
+   sprintf(fail, "mem_deleteblock %p at line %d of %s -- block not found",
+           data, line, file);
    ASSERT_MSG(fail);
 }
 #endif /* NOFRENDO_DEBUG */
@@ -253,10 +259,11 @@ void *_my_malloc(int size, char *file, int line)
    void *temp;
    char fail[256];
 
-   if (NULL == mem_record && false != mem_debug)
+   if (NULL == mem_record && 0 == mem_blockcount && false != mem_debug)
       mem_init();
 
-   if (false != mem_debug)
+   /* guarded blocks if and only if the block manager is running */
+   if (NULL != mem_record)
       temp = mem_guardalloc(size, GUARD_LENGTH);
    else
       temp = malloc(size);
@@ -269,7 +276,7 @@ void *_my_malloc(int size, char *file, int line)
       ASSERT_MSG(fail);
    }
 
-   if (false != mem_debug)
+   if (NULL != mem_record)
       mem_addblock(temp, size, file, line);
 
    mem_blockcount++;
@@ -297,7 +304,7 @@ void _my_free(void **data, char *file, int line)
 
    mem_blockcount--; /* dec our block count */
 
-   if (false != mem_debug)
+   if (NULL != mem_record)
    {
       mem_deleteblock(*data, file, line);
       mem_freeguardblock(*data, GUARD_LENGTH);
@@ -397,8 +404,8 @@ void mem_checkleaks(void)
       {
          if (mem_record[i].block_addr)
          {
-            log_printf("addr: 0x%08X, size: %d, line %d of %s%s\n",
-                    (uint32) mem_record[i].block_addr,
+            log_printf("addr: %p, size: %d, line %d of %s%s\n",
+                    mem_record[i].block_addr,
                     mem_record[i].block_size,
                     mem_record[i].line_num,
                     mem_record[i].file_name,
@@ -426,8 +433,8 @@ void mem_checkblocks(void)
       {
          if (mem_checkguardblock(mem_record[i].block_addr, GUARD_LENGTH))
          {
-            log_printf("addr: 0x%08X, size: %d, line %d of %s -- block corrupt\n",
-                    (uint32) mem_record[i].block_addr,
+            log_printf("addr: %p, size: %d, line %d of %s -- block corrupt\n",
+                    mem_record[i].block_addr,
                     mem_record[i].block_size,
                     mem_record[i].line_num,
                     mem_record[i].file_name);
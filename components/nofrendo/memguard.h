@@ -58,6 +58,7 @@ extern void mem_cleanup(void);
 extern void mem_checkblocks(void);
 extern void mem_checkleaks(void);
 
+/* set before the first allocation to turn block guarding off/on */
 extern bool mem_debug;
 
 #endif   /* _MEMGUARD_H_ */
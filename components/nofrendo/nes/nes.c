@@ -36,21 +36,16 @@
 #include <nes_ppu.h>
 #include <nes_rom.h>
 #include <nes_mmc.h>
+#include <nesinput.h>
 #include <vid_drv.h>
 #include <nofrendo.h>
+#include <pace.h>
+#include <prof.h>
 
 
-#define  NES_CLOCK_DIVIDER    12
-//#define  NES_MASTER_CLOCK     21477272.727272727272
-#define  NES_MASTER_CLOCK     (236250000 / 11)
-#define  NES_SCANLINE_CYCLES  (1364.0 / NES_CLOCK_DIVIDER)
-#define  NES_FIQ_PERIOD       (NES_MASTER_CLOCK / NES_CLOCK_DIVIDER / 60)
-
 #define  NES_RAMSIZE          0x800
 
-#define  NES_SKIP_LIMIT       (NES_REFRESH_RATE / 5)   /* 12 or 10, depending on PAL/NTSC */
-
-static nes_t nes;
+static THREAD_LOCAL nes_t nes;
 
 /* find out if a file is ours */
 int nes_isourfile(const char *filename)
@@ -111,6 +106,17 @@ static uint8 read_protect(uint32 address)
    return 0xFF;
 }
 
+/* handler reads a waiting loop can spin on, see nes6502.h */
+static uint32 idle_poll(uint32 address)
+{
+   if (address < 0x2000)
+      return (uint32) -1;  /* RAM mirrors */
+   if (address < 0x4000)
+      return ppu_idlecycles(address);
+
+   return 0;
+}
+
 #define  LAST_MEMORY_HANDLER  { -1, -1, NULL }
 /* read/write handlers for standard NES */
 static nes6502_memread default_readhandler[] =
@@ -268,24 +274,146 @@ static uint8 nes_clearfiq(void)
    return 0;
 }
 
-void nes_setfiq(uint8 value)
+/* Event scheduler
+**
+** Instead of stepping the 6502 a scanline at a time and checking after
+** each step whether anything else was due, everything with a time of
+** its own -- the end of a line, the VBLANK NMI, mapper hblanks, the APU
+** frame IRQ, mapper cycle counters -- is queued with the 6502 cycle it's
+** due on, and the 6502 runs straight up to the first one.  An event
+** queued from inside a timeslice that falls before the end of it cuts
+** the timeslice short.
+**
+** Each kind of event is queued at most once, so the queue is a sorted
+** list of event numbers (plus one, 0 ends it) packed 4 bits apiece into
+** a word, soonest in the low bits: taking the first one off is a shift.
+*/
+#define  SCHED_BITS     4
+#define  SCHED_MASK     ((1 << SCHED_BITS) - 1)
+
+INLINE void sched_cancel(int event)
 {
-   nes.fiq_state = value;
-   nes.fiq_cycles = (int) NES_FIQ_PERIOD;
+   uint32 order = nes.sched.order;
+   int shift = 0;
+
+   if (0 == (nes.sched.pending & (1 << event)))
+      return;
+
+   while ((int) ((order >> shift) & SCHED_MASK) != event + 1)
+      shift += SCHED_BITS;
+
+   nes.sched.order = (order & ((1 << shift) - 1))
+                   | ((order >> (shift + SCHED_BITS)) << shift);
+   nes.sched.pending &= ~(1 << event);
 }
 
-static void nes_checkfiq(int cycles)
+/* queue event for 6502 cycle when, or move it there if it's queued */
+INLINE void sched_at(int event, uint32 when)
 {
-   nes.fiq_cycles -= cycles;
-   if (nes.fiq_cycles <= 0)
+   uint32 order;
+   int32 diff;
+   int shift = 0, queued;
+
+   sched_cancel(event);
+
+   /* soonest first, events due on the same cycle in enum order */
+   order = nes.sched.order;
+   while (0 != (queued = (order >> shift) & SCHED_MASK))
    {
-      nes.fiq_cycles += (int) NES_FIQ_PERIOD;
-      if (0 == (nes.fiq_state & 0xC0))
-      {
-         nes.fiq_occurred = true;
-         nes6502_irq();
-      }
+      diff = (int32) (nes.sched.when[queued - 1] - when);
+      if (diff > 0 || (0 == diff && queued - 1 > event))
+         break;
+      shift += SCHED_BITS;
    }
+
+   nes.sched.order = (order & ((1 << shift) - 1))
+                   | ((uint32) (event + 1) << shift)
+                   | ((order >> shift) << (shift + SCHED_BITS));
+   nes.sched.when[event] = when;
+   nes.sched.pending |= 1 << event;
+
+   if ((int32) (when - nes.sched.slice_end) < 0)
+      nes6502_release();
+}
+
+/* run the 6502 up to the first event, and take it off the queue */
+static int sched_next(void)
+{
+   int event;
+   int32 cycles;
+
+   ASSERT(nes.sched.order);
+
+   for (;;)
+   {
+      /* an event queued from inside the timeslice may come first */
+      event = (nes.sched.order & SCHED_MASK) - 1;
+      cycles = (int32) (nes.sched.when[event] - nes6502_getcycles(false));
+      if (cycles <= 0)
+         break;
+
+      nes.sched.slice_end = nes.sched.when[event];
+      PROF_BEGIN(PROF_CPU);
+      nes6502_execute(cycles);
+      PROF_END(PROF_CPU);
+   }
+
+   nes.sched.order >>= SCHED_BITS;
+   nes.sched.pending &= ~(1 << event);
+
+   return event;
+}
+
+static void sched_reset(void)
+{
+   nes.sched.order = 0;
+   nes.sched.pending = 0;
+   nes.sched.slice_end = nes6502_getcycles(false);
+}
+
+void nes_setfiq(uint8 value)
+{
+   nes.fiq_state = value;
+
+   /* the frame counter restarts on every write */
+   if (value & 0xC0)
+      sched_cancel(SCHED_FIQ);
+   else
+      sched_at(SCHED_FIQ, nes6502_getcycles(false) + NES_FIQ_CYCLES);
+}
+
+static void nes_fiq(void)
+{
+   nes.fiq_occurred = true;
+   nes6502_irq();
+
+   sched_at(SCHED_FIQ, nes.sched.when[SCHED_FIQ] + NES_FIQ_CYCLES);
+}
+
+/* Calls timer once the 6502 has run the given number of cycles, for
+** mappers with an IRQ counter clocked by the CPU.  One timer at a time,
+** setting it again replaces it, a NULL timer stops it.
+*/
+void nes_settimer(int cycles, void (*timer)(void))
+{
+   nes.timer = timer;
+
+   if (NULL == timer)
+      sched_cancel(SCHED_TIMER);
+   else
+      sched_at(SCHED_TIMER, nes6502_getcycles(false) + cycles);
+}
+
+/* 6502 cycles left before the timer goes off, 0 if none is set */
+int nes_gettimer(void)
+{
+   int32 left;
+
+   if (0 == (nes.sched.pending & (1 << SCHED_TIMER)))
+      return 0;
+
+   left = (int32) (nes.sched.when[SCHED_TIMER] - nes6502_getcycles(false));
+   return (left > 0) ? left : 0;
 }
 
 void nes_nmi(void)
@@ -293,41 +421,103 @@ void nes_nmi(void)
    nes6502_nmi();
 }
 
-static void nes_renderframe(bool draw_flag)
+/* start nes.scanline and queue what happens on it */
+static void nes_startline(void)
 {
-   int elapsed_cycles;
    mapintf_t *mapintf = nes.mmc->intf;
-   int in_vblank = 0;
 
-   while (262 != nes.scanline)
+   PROF_BEGIN(PROF_PPU);
+   ppu_scanline(nes.bmp, nes.scanline, NULL != nes.bmp);
+   PROF_END(PROF_PPU);
+
+   nes.line_start = nes6502_getcycles(false);
+
+   if (241 == nes.scanline)
+   {
+      /* 7-9 cycle delay between when VINT flag goes up and NMI is taken */
+      sched_at(SCHED_NMI, nes.line_start + 7);
+   }
+
+   /* nothing happens on the PPU's side from the NMI up to the pre-render
+   ** line, without a mapper counting lines the 6502 gets them in one go
+   */
+   nes.num_lines = 1;
+   if (241 == nes.scanline && NULL == mapintf->hblank)
+      nes.num_lines = NES_SCANLINES - 1 - 241;
+
+   if (mapintf->hblank)
    {
-//      ppu_scanline(nes.vidbuf, nes.scanline, draw_flag);
-		ppu_scanline(vid_getbuffer(), nes.scanline, draw_flag);
+      /* scanline counters clock at hblank, after the visible pixels:
+      ** with mid-line PPU writes taking effect, an IRQ handler run any
+      ** earlier would split the line it was meant to follow
+      */
+      sched_at(SCHED_HBLANK, nes.line_start + NES_HDRAW_CYCLES);
+   }
+
+   /* a line isn't a whole number of 6502 cycles, the fraction left over
+   ** is carried into the next one
+   */
+   nes.scanline_clocks += nes.num_lines * NES_SCANLINE_CLOCKS;
+
+   sched_at(SCHED_LINE, nes.line_start + nes.scanline_clocks / NES_CPU_DIVIDER);
+}
+
+static void nes_endline(void)
+{
+   uint32 cycles = nes6502_getcycles(false) - nes.line_start;
 
-      if (241 == nes.scanline)
+   nes.scanline_clocks -= (int32) cycles * NES_CPU_DIVIDER;
+
+   ppu_endscanline(nes.scanline);
+   nes.scanline += nes.num_lines;
+
+   if (NES_SCANLINES != nes.scanline)
+      nes_startline();
+}
+
+/* a frame that isn't drawn (bmp is NULL) takes the no-render path */
+static void nes_renderframe(bitmap_t *bmp)
+{
+   mapintf_t *mapintf = nes.mmc->intf;
+
+   nes.bmp = bmp;
+   nes_startline();
+
+   while (NES_SCANLINES != nes.scanline)
+   {
+      switch (sched_next())
       {
-         /* 7-9 cycle delay between when VINT flag goes up and NMI is taken */
-         elapsed_cycles = nes6502_execute(7);
-         nes.scanline_cycles -= elapsed_cycles;
-         nes_checkfiq(elapsed_cycles);
+      case SCHED_LINE:
+         nes_endline();
+         break;
 
+      case SCHED_NMI:
          ppu_checknmi();
 
          if (mapintf->vblank)
+         {
+            PROF_BEGIN(PROF_MAPPER);
             mapintf->vblank();
-         in_vblank = 1;
-      } 
+            PROF_END(PROF_MAPPER);
+         }
+         break;
 
-      if (mapintf->hblank)
-         mapintf->hblank(in_vblank);
+      case SCHED_HBLANK:
+         PROF_BEGIN(PROF_MAPPER);
+         mapintf->hblank(nes.scanline >= 241);
+         PROF_END(PROF_MAPPER);
+         break;
 
-      nes.scanline_cycles += (float) NES_SCANLINE_CYCLES;
-      elapsed_cycles = nes6502_execute((int) nes.scanline_cycles);
-      nes.scanline_cycles -= (float) elapsed_cycles;
-      nes_checkfiq(elapsed_cycles);
+      case SCHED_FIQ:
+         nes_fiq();
+         break;
 
-      ppu_endscanline(nes.scanline);
-      nes.scanline++;
+      case SCHED_TIMER:
+         PROF_BEGIN(PROF_MAPPER);
+         nes.timer();
+         PROF_END(PROF_MAPPER);
+         break;
+      }
    }
 
    nes.scanline = 0;
@@ -338,7 +528,9 @@ static void system_video(bool draw)
    /* TODO: hack */
    if (false == draw)
    {
+      PROF_BEGIN(PROF_GUI);
       gui_frame(false);
+      PROF_END(PROF_GUI);
       return;
    }
 
@@ -347,10 +539,14 @@ static void system_video(bool draw)
 //            0, 0, NES_SCREEN_WIDTH, NES_VISIBLE_HEIGHT);
 
    /* overlay our GUI on top of it */
+   PROF_BEGIN(PROF_GUI);
    gui_frame(true);
+   PROF_END(PROF_GUI);
 
    /* blit to screen */
+   PROF_BEGIN(PROF_BLIT);
    vid_flush();
+   PROF_END(PROF_BLIT);
 
    /* grab input */
    osd_getinput();
@@ -359,54 +555,61 @@ static void system_video(bool draw)
 /* main emulation loop */
 void nes_emulate(void)
 {
-   int last_ticks, frames_to_render;
+   bool draw;
 
    osd_setsound(nes.apu->process);
 
-   last_ticks = nofrendo_ticks;
-   frames_to_render = 0;
-   nes.scanline_cycles = 0;
-   nes.fiq_cycles = (int) NES_FIQ_PERIOD;
+   /* the OSD layer set up the clock in osd_installtimer() */
+   pace_start(NES_REFRESH_RATE);
 
    while (false == nes.poweroff)
    {
-      if (nofrendo_ticks != last_ticks)
-      {
-         int tick_diff = nofrendo_ticks - last_ticks;
+      PROF_BEGIN(PROF_PACE);
+      draw = pace_nextframe(nes.autoframeskip);
+      PROF_END(PROF_PACE);
 
-         frames_to_render += tick_diff;
-         gui_tick(tick_diff);
-         last_ticks = nofrendo_ticks;
-      }
+      PROF_BEGIN(PROF_FRAME);
+      gui_tick(1);
 
       if (true == nes.pause)
       {
          /* TODO: dim the screen, and pause/silence the apu */
          system_video(true);
-         frames_to_render = 0;
       }
-      else if (frames_to_render > 1)
+      else
       {
-         frames_to_render--;
-         nes_renderframe(false);
-         system_video(false);
-      }
-      else if ((1 == frames_to_render && true == nes.autoframeskip)
-               || false == nes.autoframeskip)
-      {
-         frames_to_render = 0;
-         nes_renderframe(true);
-         system_video(true);
+         nes_renderframe(draw ? vid_getbuffer() : NULL);
+         osd_endframe();
+         pace_emulated();
+         system_video(draw);
+         pace_shown();
       }
+      PROF_END(PROF_FRAME);
    }
 }
 
+/* Emulate one frame of the current machine, for runners that drive
+** machines themselves rather than through nes_emulate(): nothing goes
+** through the OSD layer, the GUI or frame pacing.  The frame is drawn
+** into bmp, or takes the no-render path if it's NULL; the frame's sound
+** is left for the caller to take with apu_process().
+*/
+void nes_runframe(bitmap_t *bmp)
+{
+   nes_renderframe(bmp);
+}
+
+/* rand() is shared by every thread, machines running side by side
+** would each see a different sequence
+*/
+static THREAD_LOCAL unsigned int trash_seed = 1;
+
 static void mem_trash(uint8 *buffer, int length)
 {
    int i;
 
    for (i = 0; i < length; i++)
-      buffer[i] = (uint8) rand();
+      buffer[i] = (uint8) rand_r(&trash_seed);
 }
 
 /* Reset NES hardware */
@@ -419,12 +622,18 @@ void nes_reset(int reset_type)
          mem_trash(nes.rominfo->vram, 0x2000 * nes.rominfo->vram_banks);
    }
 
+   /* before the mapper gets to set a timer */
+   sched_reset();
+   nes.timer = NULL;
+
    apu_reset();
    ppu_reset(reset_type);
    mmc_reset();
    nes6502_reset();
 
    nes.scanline = 241;
+   nes.scanline_clocks = 0;
+   nes_setfiq(nes.fiq_state);
 
    gui_sendmsg(GUI_GREEN, "NES %s", 
                (HARD_RESET == reset_type) ? "powered on" : "reset");
@@ -471,6 +680,9 @@ int nes_insertcart(const char *filename, nes_t *machine)
    if (NULL == machine->rominfo)
       goto _fail;
 
+   /* 16kB PRG banks */
+   nes6502_setrom(machine->rominfo->rom, machine->rominfo->rom_banks * 0x4000);
+
    /* map cart's SRAM to CPU $6000-$7FFF */
    if (machine->rominfo->sram)
    {
@@ -515,6 +727,12 @@ nes_t *nes_create(void)
 
    memset(machine, 0, sizeof(nes_t));
 
+   /* state kept per thread rather than per machine starts over, so a
+   ** thread can run one ROM after another and get the same results
+   */
+   trash_seed = 1;
+   input_strobe();
+
    /* bitmap */
    /* 8 pixel overdraw */
 //   machine->vidbuf = bmp_create(NES_SCREEN_WIDTH, NES_SCREEN_HEIGHT, 8);
@@ -541,10 +759,11 @@ nes_t *nes_create(void)
 
    machine->cpu->read_handler = machine->readhandler;
    machine->cpu->write_handler = machine->writehandler;
+   machine->cpu->idle_poll = idle_poll;
 
    /* apu */
    osd_getsoundinfo(&osd_sound);
-   machine->apu = apu_create(0, osd_sound.sample_rate, NES_REFRESH_RATE, osd_sound.bps);
+   machine->apu = apu_create(osd_sound.sample_rate, NES_REFRESH_RATE, osd_sound.bps);
 
    if (NULL == machine->apu)
       goto _fail;
@@ -27,6 +27,7 @@
 #define _NES_H_
 
 #include <noftypes.h>
+#include <nes_clock.h>
 #include <nes_apu.h>
 #include <nes_mmc.h>
 #include <nes_ppu.h>
@@ -56,6 +57,25 @@ enum
    HARD_RESET
 };
 
+/* things that happen at a set 6502 cycle, see nes_renderframe() */
+enum
+{
+   SCHED_LINE,       /* end of the current scanline */
+   SCHED_NMI,        /* VBLANK NMI, a few cycles into line 241 */
+   SCHED_HBLANK,     /* mapper scanline counters, after the visible pixels */
+   SCHED_FIQ,        /* APU frame IRQ */
+   SCHED_TIMER,      /* mapper cycle counter, see nes_settimer() */
+   SCHED_EVENTS
+};
+
+typedef struct sched_s
+{
+   uint32 when[SCHED_EVENTS];    /* 6502 cycle each event is due on */
+   uint32 order;                 /* queued events, see nes.c */
+   uint8 pending;                /* bit per queued event */
+   uint32 slice_end;             /* where the 6502 was told to stop */
+} sched_t;
+
 
 typedef struct nes_s
 {
@@ -77,12 +97,16 @@ typedef struct nes_s
 
    bool fiq_occurred;
    uint8 fiq_state;
-   int fiq_cycles;
 
    int scanline;
+   int num_lines;    /* run as one, see nes_startline() */
 
    /* Timing stuff */
-   float scanline_cycles;
+   sched_t sched;
+   int32 scanline_clocks;  /* master cycles still to run, see nes_startline() */
+   uint32 line_start;
+   bitmap_t *bmp;
+   void (*timer)(void);
    bool autoframeskip;
 
    /* control */
@@ -106,9 +130,12 @@ extern void nes_destroy(nes_t **machine);
 extern int nes_insertcart(const char *filename, nes_t *machine);
 
 extern void nes_setfiq(uint8 state);
+extern void nes_settimer(int cycles, void (*timer)(void));
+extern int nes_gettimer(void);
 extern void nes_nmi(void);
 extern void nes_irq(void);
 extern void nes_emulate(void);
+extern void nes_runframe(bitmap_t *bmp);
 
 extern void nes_reset(int reset_type);
 
@@ -0,0 +1,73 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** nes_clock.h
+**
+** The master clock every part of the NES is divided down from
+**
+** Timing is kept in whole master cycles and whole 6502 cycles, never
+** in fractions of a cycle, so it comes out the same on every host.  The
+** master clock itself isn't a whole number of Hz, it is given as a
+** fraction; only the APU, which turns cycles into samples, needs it.
+*/
+
+#ifndef _NES_CLOCK_H_
+#define _NES_CLOCK_H_
+
+#ifdef PAL
+
+/* 26.6017125 MHz */
+#define  NES_MASTER_CLOCK_NUM    53203425
+#define  NES_MASTER_CLOCK_DEN    2
+
+#define  NES_CPU_DIVIDER         16
+#define  NES_PPU_DIVIDER         5
+#define  NES_SCANLINES           312
+
+/* 4-step APU frame sequence, in 6502 cycles */
+#define  NES_FIQ_CYCLES          33254
+
+#else /* !PAL */
+
+/* 236.25 / 11 MHz */
+#define  NES_MASTER_CLOCK_NUM    236250000
+#define  NES_MASTER_CLOCK_DEN    11
+
+#define  NES_CPU_DIVIDER         12
+#define  NES_PPU_DIVIDER         4
+#define  NES_SCANLINES           262
+
+#define  NES_FIQ_CYCLES          29830
+
+#endif /* !PAL */
+
+/* 341 PPU dots a line */
+#define  NES_SCANLINE_CLOCKS     (341 * NES_PPU_DIVIDER)
+
+/* 256 visible pixels, rounded up to a 6502 cycle so that whatever runs
+** then lands in hblank
+*/
+#define  NES_HDRAW_CYCLES        ((256 * NES_PPU_DIVIDER + NES_CPU_DIVIDER - 1) \
+                                  / NES_CPU_DIVIDER)
+
+/* PPU dots to and from 6502 cycles, rounded down */
+#define  NES_DOTS_TO_CYCLES(x)   ((x) * NES_PPU_DIVIDER / NES_CPU_DIVIDER)
+#define  NES_CYCLES_TO_DOTS(x)   ((x) * NES_CPU_DIVIDER / NES_PPU_DIVIDER)
+
+#endif /* !_NES_CLOCK_H_ */
@@ -49,7 +49,7 @@
 #define  MMC_LAST2KVROM    (MMC_2KVROM - 1)
 #define  MMC_LAST1KVROM    (MMC_1KVROM - 1)
 
-static mmc_t mmc;
+static THREAD_LOCAL mmc_t mmc;
 
 rominfo_t *mmc_getinfo(void)
 {
@@ -108,55 +108,42 @@ void mmc_bankvrom(int size, uint32 address, int bank)
 /* ROM bankswitching */
 void mmc_bankrom(int size, uint32 address, int bank)
 {
-   nes6502_context mmc_cpu;
-
-   nes6502_getcontext(&mmc_cpu); 
+   int page = address >> NES6502_BANKSHIFT;
+   int num_pages = size >> 2; /* 4kB CPU pages */
+   uint8 *rom;
 
    switch (size)
    {
    case 8:
       if (bank == MMC_LASTBANK)
          bank = MMC_LAST8KROM;
-      {
-         int page = address >> NES6502_BANKSHIFT;
-         mmc_cpu.mem_page[page] = &mmc.cart->rom[(bank % MMC_8KROM) << 13];
-         mmc_cpu.mem_page[page + 1] = mmc_cpu.mem_page[page] + 0x1000;
-      }
-
+      rom = &mmc.cart->rom[(bank % MMC_8KROM) << 13];
       break;
 
    case 16:
       if (bank == MMC_LASTBANK)
          bank = MMC_LAST16KROM;
-      {
-         int page = address >> NES6502_BANKSHIFT;
-         mmc_cpu.mem_page[page] = &mmc.cart->rom[(bank % MMC_16KROM) << 14];
-         mmc_cpu.mem_page[page + 1] = mmc_cpu.mem_page[page] + 0x1000;
-         mmc_cpu.mem_page[page + 2] = mmc_cpu.mem_page[page] + 0x2000;
-         mmc_cpu.mem_page[page + 3] = mmc_cpu.mem_page[page] + 0x3000;
-      }
+      rom = &mmc.cart->rom[(bank % MMC_16KROM) << 14];
       break;
 
    case 32:
       if (bank == MMC_LASTBANK)
          bank = MMC_LAST32KROM;
-
-      mmc_cpu.mem_page[8] = &mmc.cart->rom[(bank % MMC_32KROM) << 15];
-      mmc_cpu.mem_page[9] = mmc_cpu.mem_page[8] + 0x1000;
-      mmc_cpu.mem_page[10] = mmc_cpu.mem_page[8] + 0x2000;
-      mmc_cpu.mem_page[11] = mmc_cpu.mem_page[8] + 0x3000;
-      mmc_cpu.mem_page[12] = mmc_cpu.mem_page[8] + 0x4000;
-      mmc_cpu.mem_page[13] = mmc_cpu.mem_page[8] + 0x5000;
-      mmc_cpu.mem_page[14] = mmc_cpu.mem_page[8] + 0x6000;
-      mmc_cpu.mem_page[15] = mmc_cpu.mem_page[8] + 0x7000;
+      rom = &mmc.cart->rom[(bank % MMC_32KROM) << 15];
+      page = 8;
       break;
 
    default:
       log_printf("invalid ROM bank size %d\n", size);
-      break;
+      return;
    }
 
-   nes6502_setcontext(&mmc_cpu);
+   /* patch the live CPU pages directly, no context round trip */
+   while (num_pages--)
+   {
+      nes6502_setpage(page++, rom);
+      rom += NES6502_BANKSIZE;
+   }
 }
 
 /* Check to see if this mapper is supported */
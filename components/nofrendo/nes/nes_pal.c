@@ -60,12 +60,12 @@ rgb_t shady_palette[] =
 ** care of Kevin Horton (khorton@iquest.net)
 */
 
-/* our global palette */
-rgb_t nes_palette[64];
+/* our global palette, one per thread along with its hue and tint */
+THREAD_LOCAL rgb_t nes_palette[64];
 
 
-static float hue = 334.0f;
-static float tint = 0.4f;
+static THREAD_LOCAL float hue = 334.0f;
+static THREAD_LOCAL float tint = 0.4f;
 
 #include <gui.h>
 
@@ -37,23 +37,269 @@
 #include <vid_drv.h>
 #include <nes_pal.h>
 #include <nesinput.h>
+#include <ppu_kern.h>
 
 
 /* PPU access */
 #define  PPU_MEM(x)           ppu.page[(x) >> 10][(x)]
 
-/* Background (color 0) and solid sprite pixel flags */
-#define  BG_TRANS             0x80
-#define  SP_PIXEL             0x40
-#define  BG_CLEAR(V)          ((V) & BG_TRANS)
-#define  BG_SOLID(V)          (0 == BG_CLEAR(V))
-#define  SP_CLEAR(V)          (0 == ((V) & SP_PIXEL))
-
 /* Full BG color */
 #define  FULLBG               (ppu.palette[0] | BG_TRANS)
 
 /* the NES PPU */
-static ppu_t ppu;
+static THREAD_LOCAL ppu_t ppu;
+
+static void ppu_linechanged(void);
+static void ppu_checkstrike(int scanline, int strike_x);
+
+
+/* Decoded CHR cache: pattern table rows with one byte (color 0-3) per
+** pixel, so drawing a tile row is a palette lookup per pixel instead of
+** bitplane shuffling.  Slots hold a decoded 1kB CHR page each and are
+** found by the page's data pointer whenever ppu_setpage() switches a
+** bank in, so bank switching back and forth only decodes once.  CHR-RAM
+** writes through $2007 are decoded right away.  Define
+** PPU_CHRCACHE_HFLIP to also keep horizontally flipped rows for sprites,
+** at twice the memory.
+*/
+#ifndef PPU_CHRCACHE_SLOTS
+#define  PPU_CHRCACHE_SLOTS   8     /* 4kB each, spares keep switched out pages */
+#endif /* !PPU_CHRCACHE_SLOTS */
+
+#define  CHR_PAGES            8     /* $0000-$1FFF */
+#define  CHR_TILES            64    /* tiles per 1kB page */
+
+#if PPU_CHRCACHE_SLOTS < CHR_PAGES
+#error PPU_CHRCACHE_SLOTS needs a slot for each of the 8 mapped pages
+#endif
+
+typedef struct chrslot_s
+{
+   uint8 row[CHR_TILES][8][8];
+#ifdef PPU_CHRCACHE_HFLIP
+   uint8 flip[CHR_TILES][8][8];
+#endif /* PPU_CHRCACHE_HFLIP */
+   uint8 *data;                     /* CHR page cached here, NULL if free */
+} chrslot_t;
+
+static THREAD_LOCAL chrslot_t chr_cache[PPU_CHRCACHE_SLOTS];
+static THREAD_LOCAL chrslot_t *chr_page[CHR_PAGES];    /* slot of each mapped CHR page */
+static THREAD_LOCAL int chr_victim;
+
+static void chr_decoderow(chrslot_t *slot, int offset)
+{
+   uint8 pat1 = slot->data[offset & ~8], pat2 = slot->data[offset | 8];
+   uint8 *row = slot->row[offset >> 4][offset & 7];
+   int x;
+
+   for (x = 0; x < 8; x++)
+      row[x] = ((pat1 >> (7 - x)) & 1) | (((pat2 >> (7 - x)) & 1) << 1);
+
+#ifdef PPU_CHRCACHE_HFLIP
+   for (x = 0; x < 8; x++)
+      slot->flip[offset >> 4][offset & 7][7 - x] = row[x];
+#endif /* PPU_CHRCACHE_HFLIP */
+}
+
+/* decoded row of the pattern byte at a CHR address ($0000-$1FFF) */
+INLINE const uint8 *chr_getrow(uint32 address)
+{
+   return chr_page[address >> 10]->row[(address >> 4) & (CHR_TILES - 1)][address & 7];
+}
+
+#ifdef PPU_CHRCACHE_HFLIP
+INLINE const uint8 *chr_getflip(uint32 address)
+{
+   return chr_page[address >> 10]->flip[(address >> 4) & (CHR_TILES - 1)][address & 7];
+}
+#endif /* PPU_CHRCACHE_HFLIP */
+
+/* a write to CHR-RAM */
+INLINE void chr_write(uint32 address)
+{
+   chr_decoderow(chr_page[address >> 10], address & 0x3FF);
+}
+
+/* find (or decode) the cache slot for whatever CHR page is mapped in */
+static void chr_mappage(int page)
+{
+   chrslot_t *slot;
+   uint8 *data;
+   int i, other;
+
+   if (NULL == ppu.page[page])
+   {
+      chr_page[page] = NULL;
+      return;
+   }
+
+   data = ppu.page[page] + (page << 10);
+
+   for (i = 0; i < PPU_CHRCACHE_SLOTS; i++)
+   {
+      if (data == chr_cache[i].data)
+      {
+         chr_page[page] = &chr_cache[i];
+         return;
+      }
+   }
+
+   /* round robin, skipping slots the other pages are using */
+   for (;;)
+   {
+      slot = &chr_cache[chr_victim];
+      chr_victim = (chr_victim + 1) % PPU_CHRCACHE_SLOTS;
+
+      for (other = 0; other < CHR_PAGES; other++)
+      {
+         if (other != page && chr_page[other] == slot)
+            break;
+      }
+
+      if (CHR_PAGES == other)
+         break;
+   }
+
+   slot->data = data;
+   for (i = 0; i < CHR_TILES * 16; i += 16)
+   {
+      for (other = 0; other < 8; other++)
+         chr_decoderow(slot, i + other);
+   }
+
+   chr_page[page] = slot;
+}
+
+/* CHR memory changed behind our back (reset, state load) */
+static void chr_flush(void)
+{
+   int i;
+
+   for (i = 0; i < PPU_CHRCACHE_SLOTS; i++)
+      chr_cache[i].data = NULL;
+
+   for (i = 0; i < CHR_PAGES; i++)
+      chr_page[i] = NULL;
+
+   for (i = 0; i < CHR_PAGES; i++)
+      chr_mappage(i);
+}
+
+
+/* Sprite evaluation: the sprites on each visible line, in OAM order and
+** at most PPU_MAXSPRITE of them, like the secondary OAM the PPU fills
+** for every line.  The table for all lines is built in one pass over
+** OAM, and only built again after OAM or the sprite size changed, which
+** in most games happens once a frame with the OAM DMA.
+**
+** Frames that aren't drawn only need the overflow flag, for which the
+** number of sprites on each line is enough.
+*/
+#define  OAM_OVERFLOW         0x80  /* more than PPU_MAXSPRITE on the line */
+
+/* OAM entry */
+typedef struct obj_s
+{
+   uint8 y_loc;
+   uint8 tile;
+   uint8 atr;
+   uint8 x_loc;
+} obj_t;
+
+static THREAD_LOCAL uint8 oam_line[NES_SCREEN_HEIGHT][PPU_MAXSPRITE];
+static THREAD_LOCAL uint8 oam_count[NES_SCREEN_HEIGHT];   /* sprites in oam_line, OAM_OVERFLOW */
+static THREAD_LOCAL uint8 oam_busy[NES_SCREEN_HEIGHT];    /* all sprites on the line */
+static THREAD_LOCAL bool oam_dirty = true, busy_dirty = true;
+
+/* a line that isn't drawn has sprite 0 on it */
+static THREAD_LOCAL bool strike_line = false;
+
+INLINE void oam_changed(void)
+{
+   oam_dirty = busy_dirty = true;
+}
+
+static void oam_evaluate(void)
+{
+   obj_t *sprite_ptr = (obj_t *) ppu.oam;
+   int sprite_num, line, last;
+
+   memset(oam_count, 0, sizeof(oam_count));
+
+   for (sprite_num = 0; sprite_num < 64; sprite_num++, sprite_ptr++)
+   {
+      /* sprites are drawn a line below their y; y >= 239 is offscreen */
+      line = sprite_ptr->y_loc + 1;
+      last = line + ppu.obj_height;
+      if (last > NES_SCREEN_HEIGHT)
+         last = NES_SCREEN_HEIGHT;
+
+      for (; line < last; line++)
+      {
+         if (oam_count[line] < PPU_MAXSPRITE)
+            oam_line[line][oam_count[line]++] = sprite_num;
+         else
+            oam_count[line] |= OAM_OVERFLOW;
+      }
+   }
+
+   oam_dirty = false;
+}
+
+/* secondary OAM for a line, returns the count and the overflow flag */
+INLINE int oam_getline(int scanline)
+{
+   if (oam_dirty)
+      oam_evaluate();
+
+   return oam_count[scanline];
+}
+
+/* the overflow flag alone: counts sprites starting and ending on each
+** line, and adds them up
+*/
+static void oam_countlines(void)
+{
+   obj_t *sprite_ptr = (obj_t *) ppu.oam;
+   int8 delta[NES_SCREEN_HEIGHT + 1];
+   int sprite_num, line, last, busy;
+
+   memset(delta, 0, sizeof(delta));
+
+   for (sprite_num = 0; sprite_num < 64; sprite_num++, sprite_ptr++)
+   {
+      line = sprite_ptr->y_loc + 1;
+      if (line >= NES_SCREEN_HEIGHT)
+         continue;
+
+      last = line + ppu.obj_height;
+      if (last > NES_SCREEN_HEIGHT)
+         last = NES_SCREEN_HEIGHT;
+
+      delta[line]++;
+      delta[last]--;
+   }
+
+   busy = 0;
+   for (line = 0; line < NES_SCREEN_HEIGHT; line++)
+   {
+      busy += delta[line];
+      oam_busy[line] = busy;
+   }
+
+   busy_dirty = false;
+}
+
+INLINE bool oam_overflow(int scanline)
+{
+   if (false == oam_dirty)
+      return (oam_count[scanline] & OAM_OVERFLOW) ? true : false;
+
+   if (busy_dirty)
+      oam_countlines();
+
+   return oam_busy[scanline] > PPU_MAXSPRITE;
+}
 
 
 void ppu_displaysprites(bool display)
@@ -88,6 +334,9 @@ void ppu_setcontext(ppu_t *src_ppu)
    ppu.page[13] = ppu.page[9] - 0x1000;
    ppu.page[14] = ppu.page[10] - 0x1000;
    ppu.page[15] = ppu.page[11] - 0x1000;
+
+   chr_flush();
+   oam_changed();
 }
 
 void ppu_getcontext(ppu_t *dest_ppu)
@@ -120,9 +369,20 @@ void ppu_getcontext(ppu_t *dest_ppu)
    dest_ppu->page[15] = dest_ppu->page[11] - 0x1000;
 }
 
+/* not rand(), see nes.c */
+static THREAD_LOCAL unsigned int trash_seed = 1;
+
+static void mem_trash(uint8 *buffer, int length)
+{
+   int i;
+
+   for (i = 0; i < length; i++)
+      buffer[i] = (uint8) rand_r(&trash_seed);
+}
+
 ppu_t *ppu_create(void)
 {
-   static bool pal_generated = false;
+   static THREAD_LOCAL bool pal_generated = false;
    ppu_t *temp;
 
    temp = malloc(sizeof(ppu_t));
@@ -131,6 +391,19 @@ ppu_t *ppu_create(void)
 
    memset(temp, 0, sizeof(ppu_t));
 
+   /* the caches and the seed belong to the thread, a machine run on it
+   ** after another one has to start from the same state as the first
+   */
+   memset(chr_cache, 0, sizeof(chr_cache));
+   memset(chr_page, 0, sizeof(chr_page));
+   chr_victim = 0;
+   memset(oam_line, 0, sizeof(oam_line));
+   memset(oam_count, 0, sizeof(oam_count));
+   memset(oam_busy, 0, sizeof(oam_busy));
+   oam_dirty = busy_dirty = true;
+   strike_line = false;
+   trash_seed = 1;
+
    temp->latchfunc = NULL;
    temp->vromswitch = NULL;
    temp->vram_present = false;
@@ -159,6 +432,8 @@ void ppu_destroy(ppu_t **src_ppu)
 
 void ppu_setpage(int size, int page_num, uint8 *location)
 {
+   int page;
+
    /* deliberately fall through */
    switch (size)
    {
@@ -176,6 +451,12 @@ void ppu_setpage(int size, int page_num, uint8 *location)
       ppu.page[page_num++] = location;
       break;
    }
+
+   /* page_num is one past the last page now */
+   for (page = page_num - size; page < page_num && page < CHR_PAGES; page++)
+      chr_mappage(page);
+
+   ppu_linechanged();
 }
 
 /* make sure $3000-$3F00 mirrors $2000-$2F00 */
@@ -185,6 +466,8 @@ void ppu_mirrorhipages(void)
    ppu.page[13] = ppu.page[9] - 0x1000;
    ppu.page[14] = ppu.page[10] - 0x1000;
    ppu.page[15] = ppu.page[11] - 0x1000;
+
+   ppu_linechanged();
 }
 
 void ppu_mirror(int nt1, int nt2, int nt3, int nt4)
@@ -197,20 +480,20 @@ void ppu_mirror(int nt1, int nt2, int nt3, int nt4)
    ppu.page[13] = ppu.page[9] - 0x1000;
    ppu.page[14] = ppu.page[10] - 0x1000;
    ppu.page[15] = ppu.page[11] - 0x1000;
+
+   ppu_linechanged();
 }
 
-/* bleh, for snss */
-uint8 *ppu_getpage(int page)
+/* CHR-RAM was written to directly, not through $2007 */
+void ppu_vramchanged(void)
 {
-   return ppu.page[page];
+   chr_flush();
 }
 
-static void mem_trash(uint8 *buffer, int length)
+/* bleh, for snss */
+uint8 *ppu_getpage(int page)
 {
-   int i;
-
-   for (i = 0; i < length; i++)
-      buffer[i] = (uint8) rand();
+   return ppu.page[page];
 }
 
 /* reset state of ppu */
@@ -219,6 +502,10 @@ void ppu_reset(int reset_type)
    if (HARD_RESET == reset_type)
       mem_trash(ppu.oam, 256);
 
+   /* CHR-RAM has been trashed */
+   chr_flush();
+   oam_changed();
+
    ppu.ctrl0 = 0;
    ppu.ctrl1 = PPU_CTRL1F_OBJON | PPU_CTRL1F_BGON;
    ppu.stat = 0;
@@ -233,7 +520,7 @@ void ppu_reset(int reset_type)
 
 /* we render a scanline of graphics first so we know exactly
 ** where the sprite 0 strike is going to occur (in terms of
-** cpu cycles), using the relation that 3 pixels == 1 cpu cycle
+** cpu cycles), 3 pixels to a cpu cycle (3.2 on PAL)
 */
 static void ppu_setstrike(int x_loc)
 {
@@ -241,8 +528,7 @@ static void ppu_setstrike(int x_loc)
    {
       ppu.strikeflag = true;
 
-      /* 3 pixels per cpu cycle */
-      ppu.strike_cycle = nes6502_getcycles(false) + (x_loc / 3);
+      ppu.strike_cycle = ppu.line_cycle + NES_DOTS_TO_CYCLES(x_loc);
    }
 }
 
@@ -260,6 +546,7 @@ static void ppu_oamdma(uint8 value)
       ppu.oam[oam_loc++] = nes6502_getbyte(cpu_address++);
    }
    while (oam_loc != ppu.oam_addr);
+   oam_changed();
 
    /* TODO: enough with houdini */
    cpu_address -= 256;
@@ -355,7 +642,7 @@ uint8 ppu_read(uint32 address)
 
       if (ppu.strikeflag)
       {
-         if (nes6502_getcycles(false) >= ppu.strike_cycle)
+         if ((int32) (nes6502_getcycles(false) - ppu.strike_cycle) >= 0)
             value |= PPU_STATF_STRIKE;
       }
 
@@ -401,6 +688,54 @@ uint8 ppu_read(uint32 address)
    return value;
 }
 
+/* For the 6502's idle loop skipping: how many cycles from now reads of a
+** register keep returning the same value, once read.  The status
+** register only changes on its own when sprite 0 strikes.
+*/
+uint32 ppu_idlecycles(uint32 address)
+{
+   uint32 now;
+
+   switch (address & 0x2007)
+   {
+   case PPU_STAT:
+      now = nes6502_getcycles(false);
+      if (ppu.strikeflag && (int32) (ppu.strike_cycle - now) > 0)
+         return ppu.strike_cycle - now;
+      return (uint32) -1;
+
+   /* steps the VRAM address */
+   case PPU_VDATA:
+      return 0;
+
+   default:
+      return (uint32) -1;
+   }
+}
+
+/* ppu_renderbg() and ppu_bgsolid() take vaddr as the tile at the left
+** edge of the line.  A $2006 write in the visible part of a line points
+** it at the tile under the current dot instead, so step coarse x back
+** over the tiles left of that one.  The next line gets coarse x from the
+** latch again.
+*/
+static void ppu_rewindvaddr(void)
+{
+   int x, pos;
+
+   if (NULL == ppu.line_buf && false == strike_line)
+      return;
+
+   x = NES_CYCLES_TO_DOTS((int) (nes6502_getcycles(false) - ppu.line_cycle));
+   if (x < 0 || x >= NES_SCREEN_WIDTH)
+      return;
+
+   /* coarse x and the horizontal nametable bit, as one 6-bit tile count */
+   pos = ((ppu.vaddr >> 5) & 0x20) | (ppu.vaddr & 0x1F);
+   pos = (pos - ((x + ppu.tile_xofs) >> 3)) & 0x3F;
+   ppu.vaddr = (ppu.vaddr & ~0x041F) | ((pos & 0x20) << 5) | (pos & 0x1F);
+}
+
 /* Write to $2000-$2007 */
 void ppu_write(uint32 address, uint8 value)
 {
@@ -412,7 +747,11 @@ void ppu_write(uint32 address, uint8 value)
    case PPU_CTRL0:
       ppu.ctrl0 = value;
 
-      ppu.obj_height = (value & PPU_CTRL0F_OBJ16) ? 16 : 8;
+      if (ppu.obj_height != ((value & PPU_CTRL0F_OBJ16) ? 16 : 8))
+      {
+         ppu.obj_height = (value & PPU_CTRL0F_OBJ16) ? 16 : 8;
+         oam_changed();
+      }
       ppu.bg_base = (value & PPU_CTRL0F_BGADDR) ? 0x1000 : 0;
       ppu.obj_base = (value & PPU_CTRL0F_OBJADDR) ? 0x1000 : 0;
       ppu.vaddr_inc = (value & PPU_CTRL0F_ADDRINC) ? 32 : 1;
@@ -421,6 +760,8 @@ void ppu_write(uint32 address, uint8 value)
       /* Mask out bits 10 & 11 in the ppu latch */
       ppu.vaddr_latch &= ~0x0C00;
       ppu.vaddr_latch |= ((value & 3) << 10);
+
+      ppu_linechanged();
       break;
 
    case PPU_CTRL1:
@@ -430,6 +771,8 @@ void ppu_write(uint32 address, uint8 value)
       ppu.bg_on = (value & PPU_CTRL1F_BGON) ? true : false;
       ppu.obj_mask = (value & PPU_CTRL1F_OBJMASK) ? false : true;
       ppu.bg_mask = (value & PPU_CTRL1F_BGMASK) ? false : true;
+
+      ppu_linechanged();
       break;
 
    case PPU_OAMADDR:
@@ -438,6 +781,7 @@ void ppu_write(uint32 address, uint8 value)
 
    case PPU_OAMDATA:
       ppu.oam[ppu.oam_addr++] = value;
+      oam_changed();
       break;
 
    case PPU_SCROLL:
@@ -447,6 +791,9 @@ void ppu_write(uint32 address, uint8 value)
          ppu.vaddr_latch &= ~0x001F;
          ppu.vaddr_latch |= (value >> 3);    /* Tile number */
          ppu.tile_xofs = (value & 7);  /* Tile offset (0-7 pix) */
+
+         /* fine x scroll takes effect right away */
+         ppu_linechanged();
       }
       else
       {
@@ -473,6 +820,9 @@ void ppu_write(uint32 address, uint8 value)
          ppu.vaddr_latch &= ~0x00FF;
          ppu.vaddr_latch |= value;
          ppu.vaddr = ppu.vaddr_latch;
+
+         ppu_rewindvaddr();
+         ppu_linechanged();
       }
       
       ppu.flipflop ^= 1;
@@ -488,6 +838,8 @@ void ppu_write(uint32 address, uint8 value)
             log_printf("VRAM write to $%04X, scanline %d\n", 
                        ppu.vaddr, nes_getcontextptr()->scanline);
             PPU_MEM(ppu.vaddr) = 0xFF; /* corrupt */
+            if (ppu.vaddr < 0x2000)
+               chr_write(ppu.vaddr);
          }
          else 
          {
@@ -497,6 +849,8 @@ void ppu_write(uint32 address, uint8 value)
                ppu.vaddr -= 0x1000;
 
             PPU_MEM(addr) = value;
+            if (addr < 0x2000)
+               chr_write(addr);
          }
       }
       else
@@ -516,6 +870,9 @@ void ppu_write(uint32 address, uint8 value)
 
       ppu.vaddr += ppu.vaddr_inc;
       ppu.vaddr &= 0x3FFF;
+
+      /* palette or CHR-RAM changes */
+      ppu_linechanged();
       break;
 
    default:
@@ -575,129 +932,36 @@ void ppu_setvromswitch(ppuvromswitch_t func)
    ppu.vromswitch = func;
 }
 
-/* rendering routines */
-INLINE void draw_bgtile(uint8 *surface, uint8 pat1, uint8 pat2, 
-                        const uint8 *colors)
-{
-   uint32 pattern = ((pat2 & 0xAA) << 8) | ((pat2 & 0x55) << 1)
-                    | ((pat1 & 0xAA) << 7) | (pat1 & 0x55);
-   
-   *surface++ = colors[(pattern >> 14) & 3];
-   *surface++ = colors[(pattern >> 6) & 3];
-   *surface++ = colors[(pattern >> 12) & 3];
-   *surface++ = colors[(pattern >> 4) & 3];
-   *surface++ = colors[(pattern >> 10) & 3];
-   *surface++ = colors[(pattern >> 2) & 3];
-   *surface++ = colors[(pattern >> 8) & 3];
-   *surface = colors[pattern & 3];
-}
+/* rendering routines, the 8-pixel kernels are in ppu_kern.h */
+#define  draw_bgtile          kern_bgtile
 
-INLINE int draw_oamtile(uint8 *surface, uint8 attrib, uint8 pat1, 
-                        uint8 pat2, const uint8 *col_tbl, bool check_strike)
+/* address is the CHR address of the sprite row */
+INLINE int draw_oamtile(uint8 *surface, uint8 attrib, uint32 address,
+                        const uint8 *col_tbl, bool check_strike)
 {
-   int strike_pixel = -1;
-   uint32 color = ((pat2 & 0xAA) << 8) | ((pat2 & 0x55) << 1)
-                  | ((pat1 & 0xAA) << 7) | (pat1 & 0x55);
-
-   /* sprite is not 100% transparent */
-   if (color)
-   {
-      uint8 colors[8];
+   const uint8 *row = chr_getrow(address);
 
-      /* swap pixels around if our tile is flipped */
-      if (0 == (attrib & OAMF_HFLIP))
-      {
-         colors[0] = (color >> 14) & 3;
-         colors[1] = (color >> 6) & 3;
-         colors[2] = (color >> 12) & 3;
-         colors[3] = (color >> 4) & 3;
-         colors[4] = (color >> 10) & 3;
-         colors[5] = (color >> 2) & 3;
-         colors[6] = (color >> 8) & 3;
-         colors[7] = color & 3;
-      }
-      else
-      {
-         colors[7] = (color >> 14) & 3;
-         colors[6] = (color >> 6) & 3;
-         colors[5] = (color >> 12) & 3;
-         colors[4] = (color >> 4) & 3;
-         colors[3] = (color >> 10) & 3;
-         colors[2] = (color >> 2) & 3;
-         colors[1] = (color >> 8) & 3;
-         colors[0] = color & 3;
-      }
+   /* sprite is 100% transparent */
+   if (0 == (((uint32 *) row)[0] | ((uint32 *) row)[1]))
+      return -1;
 
-      /* check for solid sprite pixel overlapping solid bg pixel */
-      if (check_strike)
-      {
-         if (colors[0] && BG_SOLID(surface[0]))
-            strike_pixel = 0;
-         else if (colors[1] && BG_SOLID(surface[1]))
-            strike_pixel = 1;
-         else if (colors[2] && BG_SOLID(surface[2]))
-            strike_pixel = 2;
-         else if (colors[3] && BG_SOLID(surface[3]))
-            strike_pixel = 3;
-         else if (colors[4] && BG_SOLID(surface[4]))
-            strike_pixel = 4;
-         else if (colors[5] && BG_SOLID(surface[5]))
-            strike_pixel = 5;
-         else if (colors[6] && BG_SOLID(surface[6]))
-            strike_pixel = 6;
-         else if (colors[7] && BG_SOLID(surface[7]))
-            strike_pixel = 7;
-      }
-
-      /* draw the character */
-      if (attrib & OAMF_BEHIND)
-      {
-         if (colors[0])
-            surface[0] = SP_PIXEL | (BG_CLEAR(surface[0]) ? col_tbl[colors[0]] : surface[0]);
-         if (colors[1])
-            surface[1] = SP_PIXEL | (BG_CLEAR(surface[1]) ? col_tbl[colors[1]] : surface[1]);
-         if (colors[2])
-            surface[2] = SP_PIXEL | (BG_CLEAR(surface[2]) ? col_tbl[colors[2]] : surface[2]);
-         if (colors[3])
-            surface[3] = SP_PIXEL | (BG_CLEAR(surface[3]) ? col_tbl[colors[3]] : surface[3]);
-         if (colors[4])
-            surface[4] = SP_PIXEL | (BG_CLEAR(surface[4]) ? col_tbl[colors[4]] : surface[4]);
-         if (colors[5])
-            surface[5] = SP_PIXEL | (BG_CLEAR(surface[5]) ? col_tbl[colors[5]] : surface[5]);
-         if (colors[6])
-            surface[6] = SP_PIXEL | (BG_CLEAR(surface[6]) ? col_tbl[colors[6]] : surface[6]);
-         if (colors[7])
-            surface[7] = SP_PIXEL | (BG_CLEAR(surface[7]) ? col_tbl[colors[7]] : surface[7]);
-      }
-      else
-      {
-         if (colors[0] && SP_CLEAR(surface[0]))
-            surface[0] = SP_PIXEL | col_tbl[colors[0]];
-         if (colors[1] && SP_CLEAR(surface[1]))
-            surface[1] = SP_PIXEL | col_tbl[colors[1]];
-         if (colors[2] && SP_CLEAR(surface[2]))
-            surface[2] = SP_PIXEL | col_tbl[colors[2]];
-         if (colors[3] && SP_CLEAR(surface[3]))
-            surface[3] = SP_PIXEL | col_tbl[colors[3]];
-         if (colors[4] && SP_CLEAR(surface[4]))
-            surface[4] = SP_PIXEL | col_tbl[colors[4]];
-         if (colors[5] && SP_CLEAR(surface[5]))
-            surface[5] = SP_PIXEL | col_tbl[colors[5]];
-         if (colors[6] && SP_CLEAR(surface[6]))
-            surface[6] = SP_PIXEL | col_tbl[colors[6]];
-         if (colors[7] && SP_CLEAR(surface[7]))
-            surface[7] = SP_PIXEL | col_tbl[colors[7]];
-      }
+#ifdef PPU_CHRCACHE_HFLIP
+   if (attrib & OAMF_HFLIP)
+   {
+      row = chr_getflip(address);
+      attrib &= ~OAMF_HFLIP;
    }
+#endif /* PPU_CHRCACHE_HFLIP */
 
-   return strike_pixel;
+   return kern_oamtile(surface, row, col_tbl, attrib, check_strike);
 }
 
-static void ppu_renderbg(uint8 *vidbuf)
+/* tiles left of the one pixel from_x is in aren't drawn */
+static void ppu_renderbg(uint8 *vidbuf, int from_x)
 {
-   uint8 *bmp_ptr, *data_ptr, *tile_ptr, *attrib_ptr;
+   uint8 *bmp_ptr, *tile_ptr, *attrib_ptr;
    uint32 refresh_vaddr, bg_offset, attrib_base;
-   int tile_count;
+   int tile_count, skip;
    uint8 tile_index, x_tile, y_tile;
    uint8 col_high, attrib, attrib_shift;
 
@@ -722,19 +986,28 @@ static void ppu_renderbg(uint8 *vidbuf)
    attrib_shift = (x_tile & 2) + ((y_tile & 2) << 1);
    col_high = ((attrib >> attrib_shift) & 3) << 2;
 
+   skip = (from_x + ppu.tile_xofs) >> 3;
+
    /* ppu fetches 33 tiles */
    tile_count = 33;
    while (tile_count--)
    {
       /* Tile number from nametable */
       tile_index = *tile_ptr++;
-      data_ptr = &PPU_MEM(bg_offset + (tile_index << 4));
 
-      /* Handle $FD/$FE tile VROM switching (PunchOut) */
-      if (ppu.latchfunc)
-         ppu.latchfunc(ppu.bg_base, tile_index);
+      if (skip)
+      {
+         skip--;
+      }
+      else
+      {
+         draw_bgtile(bmp_ptr, chr_getrow(bg_offset + (tile_index << 4)), ppu.palette + col_high);
+
+         /* Handle $FD/$FE tile VROM switching (PunchOut) */
+         if (ppu.latchfunc)
+            ppu.latchfunc(ppu.bg_base, tile_index);
+      }
 
-      draw_bgtile(bmp_ptr, data_ptr[0], data_ptr[8], ppu.palette + col_high);
       bmp_ptr += 8;
 
       x_tile++;
@@ -764,7 +1037,7 @@ static void ppu_renderbg(uint8 *vidbuf)
    }
 
    /* Blank left hand column if need be */
-   if (ppu.bg_mask)
+   if (ppu.bg_mask && from_x < 8)
    {
       uint32 *buf_ptr = (uint32 *) vidbuf;
       uint32 bg_clear = FULLBG | FULLBG << 8 | FULLBG << 16 | FULLBG << 24;
@@ -774,23 +1047,15 @@ static void ppu_renderbg(uint8 *vidbuf)
    }
 }
 
-/* OAM entry */
-typedef struct obj_s
-{
-   uint8 y_loc;
-   uint8 tile;
-   uint8 atr;
-   uint8 x_loc;
-} obj_t;
-
-/* TODO: fetch valid OAM a scanline before, like the Real Thing */
-static void ppu_renderoam(uint8 *vidbuf, int scanline)
+/* pixels left of from_x are drawn already: sprites that end there are
+** skipped, and sprite 0 strikes there have been checked for
+*/
+static void ppu_renderoam(uint8 *vidbuf, int scanline, int from_x)
 {
    uint8 *buf_ptr;
-   uint32 vram_offset, savecol[2];
-   int sprite_num, spritecount;
+   uint32 vram_offset, savecol[2] = { 0, 0 };
+   int sprite_num, spritecount, i;
    obj_t *sprite_ptr;
-   uint8 sprite_height;
 
    if (false == ppu.obj_on)
       return;
@@ -805,15 +1070,12 @@ static void ppu_renderoam(uint8 *vidbuf, int scanline)
       savecol[1] = ((uint32 *) buf_ptr)[1];
    }
 
-   sprite_height = ppu.obj_height;
    vram_offset = ppu.obj_base;
-   spritecount = 0;
-
-   sprite_ptr = (obj_t *) ppu.oam;
+   spritecount = oam_getline(scanline) & ~OAM_OVERFLOW;
 
-   for (sprite_num = 0; sprite_num < 64; sprite_num++, sprite_ptr++)
+   for (i = 0; i < spritecount; i++)
    {
-      uint8 *data_ptr, *bmp_ptr;
+      uint8 *bmp_ptr;
       uint32 vram_adr;
       int y_offset;
       uint8 tile_index, attrib, col_high;
@@ -821,17 +1083,16 @@ static void ppu_renderoam(uint8 *vidbuf, int scanline)
       bool check_strike;
       int strike_pixel;
 
+      sprite_num = oam_line[scanline][i];
+      sprite_ptr = (obj_t *) ppu.oam + sprite_num;
       sprite_y = sprite_ptr->y_loc + 1;
-
-      /* Check to see if sprite is out of range */
-      if ((sprite_y > scanline) || (sprite_y <= (scanline - sprite_height))
-          || (0 == sprite_y) || (sprite_y >= 240))
-         continue;
-
       sprite_x = sprite_ptr->x_loc;
       tile_index = sprite_ptr->tile;
       attrib = sprite_ptr->atr;
 
+      if (sprite_x + 8 <= from_x)
+         continue;
+
       bmp_ptr = buf_ptr + sprite_x;
 
       /* Handle $FD/$FE tile VROM switching (PunchOut) */
@@ -847,9 +1108,6 @@ static void ppu_renderoam(uint8 *vidbuf, int scanline)
       else
          vram_adr = vram_offset + (tile_index << 4);
 
-      /* Get the address of the tile */
-      data_ptr = &PPU_MEM(vram_adr);
-
       /* Calculate offset (line within the sprite) */
       y_offset = scanline - sprite_y;
       if (y_offset > 7)
@@ -863,27 +1121,30 @@ static void ppu_renderoam(uint8 *vidbuf, int scanline)
          else
             y_offset -= 7;
 
-         data_ptr -= y_offset;
+         vram_adr -= y_offset;
       }
       else
       {
-         data_ptr += y_offset;
+         vram_adr += y_offset;
       }
 
       /* if we're on sprite 0 and sprite 0 strike flag isn't set,
       ** check for a strike 
       */
       check_strike = (0 == sprite_num) && (false == ppu.strikeflag);
-      strike_pixel = draw_oamtile(bmp_ptr, attrib, data_ptr[0], data_ptr[8], ppu.palette + 16 + col_high, check_strike);
-      if (strike_pixel >= 0)
-         ppu_setstrike(strike_pixel);
 
-      /* maximum of 8 sprites per scanline */
-      if (++spritecount == PPU_MAXSPRITE)
+      /* left of from_x the buffer holds nothing of this line's new
+      ** background, so the kernel can't be asked about those pixels
+      */
+      if (check_strike && sprite_x < from_x)
       {
-         ppu.stat |= PPU_STATF_MAXSPRITE;
-         break;
+         check_strike = false;
+         ppu_checkstrike(scanline, from_x);
       }
+
+      strike_pixel = draw_oamtile(bmp_ptr, attrib, vram_adr, ppu.palette + 16 + col_high, check_strike);
+      if (strike_pixel >= 0)
+         ppu_setstrike(sprite_x + strike_pixel);
    }
 
    /* Restore lefthand column */
@@ -894,32 +1155,61 @@ static void ppu_renderoam(uint8 *vidbuf, int scanline)
    }
 }
 
-/* Fake rendering a line */
-/* This is needed for sprite 0 hits when we're skipping drawing a frame */
-static void ppu_fakeoam(int scanline)
+/* Lines that aren't drawn: is the background pixel at x solid?  The
+** same tile, attribute and palette lookup ppu_renderbg() would do for it.
+*/
+static bool ppu_bgsolid(int x)
+{
+   uint32 name_adr, attrib_adr;
+   int pos, x_tile, y_tile;
+   uint8 tile_index, pattern, col_high;
+
+   if (false == ppu.bg_on || (ppu.bg_mask && x < 8))
+      return false;
+
+   /* ppu_renderbg() fetches 33 tiles */
+   pos = x + ppu.tile_xofs;
+   if (pos >= 33 * 8)
+      return false;
+
+   name_adr = 0x2000 + (ppu.vaddr & 0x0FE0);
+   x_tile = (ppu.vaddr & 0x1F) + (pos >> 3);
+   y_tile = (ppu.vaddr >> 5) & 0x1F;
+   if (x_tile >= 32)
+   {
+      x_tile -= 32;
+      name_adr ^= (1 << 10);
+   }
+
+   tile_index = PPU_MEM(name_adr + x_tile);
+   pattern = chr_getrow(((ppu.vaddr >> 12) & 7) + ppu.bg_base + (tile_index << 4))[pos & 7];
+
+   attrib_adr = (name_adr & 0x2C00) + 0x3C0 + ((y_tile & 0x1C) << 1) + (x_tile >> 2);
+   col_high = ((PPU_MEM(attrib_adr) >> ((x_tile & 2) + ((y_tile & 2) << 1))) & 3) << 2;
+
+   return false == BG_CLEAR(ppu.palette[col_high + pattern]);
+}
+
+/* Sprite 0 strike on a line that isn't drawn, found the way
+** ppu_renderoam() would: the first solid sprite 0 pixel over a solid
+** background pixel at or right of strike_x.  Only the sprite 0 row and
+** the background pixels under it are looked at.
+*/
+static void ppu_checkstrike(int scanline, int strike_x)
 {
-   uint8 *data_ptr;
+   const uint8 *row;
    obj_t *sprite_ptr;
-   uint32 vram_adr, color;
-   int y_offset;
-   uint8 pat1, pat2;
+   uint32 vram_adr;
+   int y_offset, x;
    uint8 tile_index, attrib;
-   uint8 sprite_height, sprite_y, sprite_x;
+   uint8 sprite_y, sprite_x;
 
-   /* we don't need to be here if strike flag is set */
-
-   if (false == ppu.obj_on || ppu.strikeflag)
+   if (false == ppu.obj_on || false == ppu.bg_on || ppu.strikeflag)
       return;
 
-   sprite_height = ppu.obj_height;
    sprite_ptr = (obj_t *) ppu.oam;
    sprite_y = sprite_ptr->y_loc + 1;
 
-   /* Check to see if sprite is out of range */
-   if ((sprite_y > scanline) || (sprite_y <= (scanline - sprite_height)) 
-       || (0 == sprite_y) || (sprite_y > 240))
-      return;
-
    sprite_x = sprite_ptr->x_loc;
    tile_index = sprite_ptr->tile;
    attrib = sprite_ptr->atr;
@@ -930,8 +1220,6 @@ static void ppu_fakeoam(int scanline)
    else
       vram_adr = ppu.obj_base + (tile_index << 4);
 
-   data_ptr = &PPU_MEM(vram_adr);
-
    /* Calculate offset (line within the sprite) */
    y_offset = scanline - sprite_y;
    if (y_offset > 7)
@@ -944,74 +1232,120 @@ static void ppu_fakeoam(int scanline)
          y_offset -= 23;
       else
          y_offset -= 7;
-      data_ptr -= y_offset;
+      vram_adr -= y_offset;
    }
    else
    {
-      data_ptr += y_offset;
+      vram_adr += y_offset;
    }
 
-   /* check for a solid sprite 0 pixel */
-   pat1 = data_ptr[0];
-   pat2 = data_ptr[8];
-   color = ((pat2 & 0xAA) << 8) | ((pat2 & 0x55) << 1)
-                  | ((pat1 & 0xAA) << 7) | (pat1 & 0x55);
+   row = chr_getrow(vram_adr);
+   if (0 == (((uint32 *) row)[0] | ((uint32 *) row)[1]))
+      return;
 
-   if (color)
+   for (x = 0; x < 8; x++)
    {
-      uint8 colors[8];
+      /* left of strike_x was checked before the change */
+      if (sprite_x + x < strike_x)
+         continue;
 
-      /* buckle up, it's going to get ugly... */
-      if (0 == (attrib & OAMF_HFLIP))
+      if (row[(attrib & OAMF_HFLIP) ? 7 - x : x] && ppu_bgsolid(sprite_x + x))
       {
-         colors[0] = (color >> 14) & 3;
-         colors[1] = (color >> 6) & 3;
-         colors[2] = (color >> 12) & 3;
-         colors[3] = (color >> 4) & 3;
-         colors[4] = (color >> 10) & 3;
-         colors[5] = (color >> 2) & 3;
-         colors[6] = (color >> 8) & 3;
-         colors[7] = color & 3;
+         ppu_setstrike(sprite_x + x);
+         return;
       }
-      else
-      {
-         colors[7] = (color >> 14) & 3;
-         colors[6] = (color >> 6) & 3;
-         colors[5] = (color >> 12) & 3;
-         colors[4] = (color >> 4) & 3;
-         colors[3] = (color >> 10) & 3;
-         colors[2] = (color >> 2) & 3;
-         colors[1] = (color >> 8) & 3;
-         colors[0] = color & 3;
-      }
-
-      if (colors[0])
-         ppu_setstrike(sprite_x + 0);
-      else if (colors[1])
-         ppu_setstrike(sprite_x + 1);
-      else if (colors[2])
-         ppu_setstrike(sprite_x + 2);
-      else if (colors[3])
-         ppu_setstrike(sprite_x + 3);
-      else if (colors[4])
-         ppu_setstrike(sprite_x + 4);
-      else if (colors[5])
-         ppu_setstrike(sprite_x + 5);
-      else if (colors[6])
-         ppu_setstrike(sprite_x + 6);
-      else if (colors[7])
-         ppu_setstrike(sprite_x + 7);
    }
 }
 
+/* sprite 0 is first on a line if it's on it at all */
+INLINE bool ppu_sprite0line(int scanline)
+{
+   int sprite_y = ppu.oam[0] + 1;
+
+   return (scanline >= sprite_y && scanline < sprite_y + ppu.obj_height);
+}
+
 bool ppu_enabled(void)
 {
    return (ppu.bg_on || ppu.obj_on);
 }
 
+/* A write that changes what gets drawn landed in the visible part of
+** the line: the pixels up to the current CPU cycle stay as they were
+** drawn, the rest of the line is drawn again with the new state, from
+** the tile x is in.
+*/
+static void ppu_redrawline(int x)
+{
+   static THREAD_LOCAL uint8 redraw_buf[8 + NES_SCREEN_WIDTH + 8];
+   uint8 *buf = redraw_buf + 8; /* room for the fine x scroll overdraw */
+   uint8 *line_buf = ppu.line_buf;
+
+   /* mapper latch functions can page CHR in while we draw */
+   ppu.line_buf = NULL;
+
+   /* a sprite 0 strike predicted further down the line may be gone now */
+   if (ppu.strikeflag && (int32) (ppu.strike_cycle - nes6502_getcycles(false)) > 0)
+   {
+      ppu.strikeflag = false;
+      ppu.strike_cycle = (uint32) -1;
+   }
+
+   ppu_renderbg(buf, x);
+   if (true == ppu.drawsprites)
+      ppu_renderoam(buf, ppu.line_num, x);
+   else if (ppu_sprite0line(ppu.line_num))
+      ppu_checkstrike(ppu.line_num, x);
+
+   memcpy(line_buf + x, buf + x, NES_SCREEN_WIDTH - x);
+
+   ppu.line_buf = line_buf;
+}
+
+/* The same for a line that isn't drawn, only the strike can change. */
+static void ppu_restrike(int x)
+{
+   if (ppu.strikeflag && (int32) (ppu.strike_cycle - nes6502_getcycles(false)) > 0)
+   {
+      ppu.strikeflag = false;
+      ppu.strike_cycle = (uint32) -1;
+   }
+
+   ppu_checkstrike(ppu.line_num, x);
+}
+
+/* called after any state change that affects rendering */
+static void ppu_linechanged(void)
+{
+   int x;
+
+   if (NULL == ppu.line_buf && false == strike_line)
+      return;
+
+   x = NES_CYCLES_TO_DOTS((int) (nes6502_getcycles(false) - ppu.line_cycle));
+   if (x >= NES_SCREEN_WIDTH)
+   {
+      /* in hblank, the change is for the next line */
+      ppu.line_buf = NULL;
+      strike_line = false;
+      return;
+   }
+
+   if (ppu.line_buf)
+      ppu_redrawline(x);
+   else
+      ppu_restrike(x);
+}
+
 static void ppu_renderscanline(bitmap_t *bmp, int scanline, bool draw_flag)
 {
-   uint8 *buf = bmp->line[scanline];
+   uint8 *buf;
+
+   /* the output bitmap may be cropped to NES_VISIBLE_HEIGHT lines */
+   if (NULL == bmp || scanline >= bmp->height)
+      draw_flag = false;
+   else
+      buf = bmp->line[scanline];
 
    /* start scanline - transfer ppu latch into vaddr */
    if (ppu.bg_on || ppu.obj_on)
@@ -1027,19 +1361,40 @@ static void ppu_renderscanline(bitmap_t *bmp, int scanline, bool draw_flag)
       }
    }
 
-   if (draw_flag)
-      ppu_renderbg(buf);
+   ppu.line_num = scanline;
+   ppu.line_cycle = nes6502_getcycles(false);
+
+   /* sprite overflow, found while evaluating sprites for the line */
+   if ((ppu.bg_on || ppu.obj_on) && oam_overflow(scanline))
+      ppu.stat |= PPU_STATF_MAXSPRITE;
+
+   if (false == draw_flag)
+   {
+      /* no pixels at all, only where a sprite 0 strike would be */
+      strike_line = ppu_sprite0line(scanline);
+      if (strike_line)
+         ppu_checkstrike(scanline, 0);
+      return;
+   }
+
+   ppu_renderbg(buf, 0);
 
    /* TODO: fetch obj data 1 scanline before */
-   if (true == ppu.drawsprites && true == draw_flag)
-      ppu_renderoam(buf, scanline);
-   else
-      ppu_fakeoam(scanline);
+   if (true == ppu.drawsprites)
+      ppu_renderoam(buf, scanline, 0);
+   else if (ppu_sprite0line(scanline))
+      ppu_checkstrike(scanline, 0);
+
+   /* the line is drawn ahead of the CPU, writes during it redraw the rest */
+   ppu.line_buf = buf;
 }
 
 
 void ppu_endscanline(int scanline)
 {
+   ppu.line_buf = NULL;
+   strike_line = false;
+
    /* modify vram address at end of scanline */
    if (scanline < 240 && (ppu.bg_on || ppu.obj_on))
    {
@@ -1082,8 +1437,6 @@ void ppu_scanline(bitmap_t *bmp, int scanline, bool draw_flag)
 {
    if (scanline < 240)
    {
-      /* Lower the Max Sprite per scanline flag */
-      ppu.stat &= ~PPU_STATF_MAXSPRITE;
       ppu_renderscanline(bmp, scanline, draw_flag);
    }
    else if (241 == scanline)
@@ -1091,9 +1444,9 @@ void ppu_scanline(bitmap_t *bmp, int scanline, bool draw_flag)
       ppu.stat |= PPU_STATF_VBLANK;
       ppu.vram_accessible = true;
    }
-   else if (261 == scanline)
+   else if (NES_SCANLINES - 1 == scanline)
    {
-      ppu.stat &= ~PPU_STATF_VBLANK;
+      ppu.stat &= ~(PPU_STATF_VBLANK | PPU_STATF_MAXSPRITE);
       ppu.strikeflag = false;
       ppu.strike_cycle = (uint32) -1;
 
@@ -1167,7 +1520,7 @@ static void draw_sprite(bitmap_t *bmp, int x, int y, uint8 tile_num, uint8 attri
 {
    int line, height;
    int col_high, vram_adr;
-   uint8 *vid, *data_ptr;
+   uint8 *vid;
 
    vid = bmp->line[y] + x;
 
@@ -1182,17 +1535,15 @@ static void draw_sprite(bitmap_t *bmp, int x, int y, uint8 tile_num, uint8 attri
    else
       vram_adr = ppu.obj_base + (tile_num << 4);
 
-   data_ptr = &PPU_MEM(vram_adr);
-
    for (line = 0; line < height; line++)
    {
       if (line == 8)
-         data_ptr += 8;
+         vram_adr += 8;
 
-      draw_bgtile(vid, data_ptr[0], data_ptr[8], ppu.palette + 16 + col_high);
-      //draw_oamtile(vid, attrib, data_ptr[0], data_ptr[8], ppu.palette + 16 + col_high);
+      draw_bgtile(vid, chr_getrow(vram_adr), ppu.palette + 16 + col_high);
+      //draw_oamtile(vid, attrib, vram_adr, ppu.palette + 16 + col_high, false);
 
-      data_ptr++;
+      vram_adr++;
       vid += bmp->pitch;
    }
 }
@@ -1228,7 +1579,8 @@ void ppu_dumpoam(bitmap_t *bmp, int x_loc, int y_loc)
 void ppu_dumppattern(bitmap_t *bmp, int table_num, int x_loc, int y_loc, int col)
 {
    int x_tile, y_tile;
-   uint8 *bmp_ptr, *data_ptr, *ptr;
+   uint8 *bmp_ptr, *ptr;
+   uint32 address;
    int tile_num, line;
    uint8 col_high;
 
@@ -1242,13 +1594,12 @@ void ppu_dumppattern(bitmap_t *bmp, int table_num, int x_loc, int y_loc, int col
 
       for (x_tile = 0; x_tile < 16; x_tile++)
       {
-         data_ptr = &PPU_MEM((table_num << 12) + (tile_num << 4));
+         address = (table_num << 12) + (tile_num << 4);
          ptr = bmp_ptr;
 
          for (line = 0; line < 8; line ++)
          {
-            draw_bgtile(ptr, data_ptr[0], data_ptr[8], ppu.palette + col_high);
-            data_ptr++;
+            draw_bgtile(ptr, chr_getrow(address + line), ppu.palette + col_high);
             ptr += bmp->pitch;
          }
 
@@ -100,6 +100,11 @@ typedef struct ppu_s
    bool strikeflag;
    uint32 strike_cycle;
 
+   /* scanline being drawn, for writes that land mid-line */
+   uint8 *line_buf;     /* NULL once the visible part is over */
+   int line_num;
+   uint32 line_cycle;   /* CPU cycle the line started on */
+
    /* callbacks for naughty mappers */
    ppulatchfunc_t latchfunc;
    ppuvromswitch_t vromswitch;
@@ -129,6 +134,7 @@ extern void ppu_mirror(int nt1, int nt2, int nt3, int nt4);
 
 extern void ppu_setpage(int size, int page_num, uint8 *location);
 extern uint8 *ppu_getpage(int page);
+extern void ppu_vramchanged(void);
 
 
 /* control */
@@ -146,6 +152,7 @@ extern uint8 ppu_read(uint32 address);
 extern void ppu_write(uint32 address, uint8 value);
 extern uint8 ppu_readhigh(uint32 address);
 extern void ppu_writehigh(uint32 address, uint8 value);
+extern uint32 ppu_idlecycles(uint32 address);
 
 /* rendering */
 extern void ppu_setpal(ppu_t *src_ppu, rgb_t *pal);
@@ -397,7 +397,7 @@ static int rom_getheader(unsigned char **rom, rominfo_t *rominfo)
 /* Build the info string for ROM display */
 char *rom_getinfo(rominfo_t *rominfo)
 {
-   static char info[PATH_MAX + 1];
+   static THREAD_LOCAL char info[PATH_MAX + 1];
    char romname[PATH_MAX + 1], temp[PATH_MAX + 1];
 
    /* Look to see if we were given a path along with filename */
@@ -503,12 +503,9 @@ void rom_free(rominfo_t **rominfo)
 
    rom_savesram(*rominfo);
 
+   /* rom and vrom point straight into the image from osd_getromdata() */
    if ((*rominfo)->sram)
       free((*rominfo)->sram);
-   if ((*rominfo)->rom)
-      free((*rominfo)->rom);
-   if ((*rominfo)->vrom)
-      free((*rominfo)->vrom);
    if ((*rominfo)->vram)
       free((*rominfo)->vram);
 
@@ -31,11 +31,11 @@
 **       can be removed if need be
 */
 
-static nesinput_t *nes_input[MAX_CONTROLLERS];
-static int active_entries = 0;
+static THREAD_LOCAL nesinput_t *nes_input[MAX_CONTROLLERS];
+static THREAD_LOCAL int active_entries = 0;
 
 /* read counters */
-static int pad0_readcount, pad1_readcount, ppad_readcount, ark_readcount;
+static THREAD_LOCAL int pad0_readcount, pad1_readcount, ppad_readcount, ark_readcount;
 
 
 static int retrieve_type(int type)
@@ -0,0 +1,103 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** ppu_kern.c
+**
+** Self check of the selected compositing kernel against the scalar one
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <noftypes.h>
+#include <log.h>
+#include <ppu_kern.h>
+
+const char *ppu_kernname(void)
+{
+#if PPU_KERNEL == PPU_KERNEL_SWAR32
+   return "swar32";
+#elif PPU_KERNEL == PPU_KERNEL_SWAR64
+   return "swar64";
+#elif PPU_KERNEL == PPU_KERNEL_SSE2
+   return "sse2";
+#elif PPU_KERNEL == PPU_KERNEL_NEON
+   return "neon";
+#else
+   return "scalar";
+#endif
+}
+
+/* xorshift, so every run checks the same cases */
+static uint32 kern_random(uint32 *seed)
+{
+   *seed ^= *seed << 13;
+   *seed ^= *seed >> 17;
+   *seed ^= *seed << 5;
+   return *seed;
+}
+
+/* Runs both kernels on random rows, surfaces and palettes, at every
+** alignment of the surface.  Returns the number of mismatches.
+*/
+int ppu_kerncheck(int rounds)
+{
+   uint8 row[8], colors[4], attrib;
+   uint8 ref[16], out[16];
+   uint32 seed = 0x2C9277B5;
+   int i, j, align, ref_strike, out_strike;
+   bool check_strike;
+   int errors = 0;
+
+   for (i = 0; i < rounds; i++)
+   {
+      align = i & 7;
+
+      for (j = 0; j < 8; j++)
+         row[j] = kern_random(&seed) & 3;
+      for (j = 0; j < 4; j++)
+         colors[j] = kern_random(&seed);
+      for (j = 0; j < 16; j++)
+         ref[j] = kern_random(&seed);
+      attrib = kern_random(&seed);
+      check_strike = (kern_random(&seed) & 1) ? true : false;
+
+      memcpy(out, ref, sizeof(out));
+      scalar_bgtile(ref + align, row, colors);
+      kern_bgtile(out + align, row, colors);
+      if (memcmp(ref, out, sizeof(out)))
+      {
+         if (0 == errors++)
+            log_printf("%s bgtile mismatch, round %d\n", ppu_kernname(), i);
+      }
+
+      for (j = 0; j < 16; j++)
+         ref[j] = kern_random(&seed);
+
+      memcpy(out, ref, sizeof(out));
+      ref_strike = scalar_oamtile(ref + align, row, colors, attrib, check_strike);
+      out_strike = kern_oamtile(out + align, row, colors, attrib, check_strike);
+      if (ref_strike != out_strike || memcmp(ref, out, sizeof(out)))
+      {
+         if (0 == errors++)
+            log_printf("%s oamtile mismatch, round %d\n", ppu_kernname(), i);
+      }
+   }
+
+   return errors;
+}
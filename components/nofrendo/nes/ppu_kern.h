@@ -0,0 +1,448 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** ppu_kern.h
+**
+** 8-pixel tile compositing kernels for the PPU renderer
+**
+** Every kernel works on one decoded CHR row (8 bytes, color 0-3 per
+** pixel, see the CHR cache in nes_ppu.c) and a line of the frame buffer:
+**
+**    kern_bgtile()   palette lookup, 8 pixels straight to the surface
+**    kern_oamtile()  palette lookup, sprite/background priority merge
+**                    and sprite 0 strike detection
+**
+** The scalar versions are the reference; the others have to give
+** exactly the same bytes.  PPU_KERNEL picks one at build time, else the
+** best one for the target is used.  Only little-endian targets have
+** word kernels.
+*/
+
+#ifndef _PPU_KERN_H_
+#define _PPU_KERN_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <noftypes.h>
+#include <nes_ppu.h>
+
+/* Background (color 0) and solid sprite pixel flags */
+#define  BG_TRANS             0x80
+#define  SP_PIXEL             0x40
+#define  BG_CLEAR(V)          ((V) & BG_TRANS)
+#define  BG_SOLID(V)          (0 == BG_CLEAR(V))
+#define  SP_CLEAR(V)          (0 == ((V) & SP_PIXEL))
+
+#define  PPU_KERNEL_SCALAR    0     /* byte at a time, branchy */
+#define  PPU_KERNEL_SWAR32    1     /* two 32-bit words (ESP32) */
+#define  PPU_KERNEL_SWAR64    2     /* one 64-bit word */
+#define  PPU_KERNEL_SSE2      3
+#define  PPU_KERNEL_NEON      4
+
+#ifndef PPU_KERNEL
+#if !defined(HOST_LITTLE_ENDIAN)
+#define  PPU_KERNEL           PPU_KERNEL_SCALAR
+#elif defined(__SSE2__)
+#define  PPU_KERNEL           PPU_KERNEL_SSE2
+#elif defined(__ARM_NEON)
+#define  PPU_KERNEL           PPU_KERNEL_NEON
+#elif UINTPTR_MAX > 0xFFFFFFFF
+#define  PPU_KERNEL           PPU_KERNEL_SWAR64
+#else
+#define  PPU_KERNEL           PPU_KERNEL_SWAR32
+#endif
+#endif /* !PPU_KERNEL */
+
+#if PPU_KERNEL == PPU_KERNEL_SSE2
+#include <emmintrin.h>
+#elif PPU_KERNEL == PPU_KERNEL_NEON
+#include <arm_neon.h>
+#endif
+
+extern const char *ppu_kernname(void);
+extern int ppu_kerncheck(int rounds);
+
+/*
+** Scalar reference
+*/
+INLINE void scalar_bgtile(uint8 *surface, const uint8 *row, const uint8 *colors)
+{
+   /* all loads before any stores, surface might alias anything */
+   uint8 c0 = colors[row[0]], c1 = colors[row[1]], c2 = colors[row[2]], c3 = colors[row[3]];
+   uint8 c4 = colors[row[4]], c5 = colors[row[5]], c6 = colors[row[6]], c7 = colors[row[7]];
+
+   surface[0] = c0;
+   surface[1] = c1;
+   surface[2] = c2;
+   surface[3] = c3;
+   surface[4] = c4;
+   surface[5] = c5;
+   surface[6] = c6;
+   surface[7] = c7;
+}
+
+/* returns the first pixel of a sprite 0 strike, or -1 */
+INLINE int scalar_oamtile(uint8 *surface, const uint8 *row, const uint8 *col_tbl,
+                          uint8 attrib, bool check_strike)
+{
+   int strike_pixel = -1;
+   const uint8 *colors = row;
+   uint8 flipped[8];
+
+   /* swap pixels around if our tile is flipped */
+   if (attrib & OAMF_HFLIP)
+   {
+      flipped[0] = row[7];
+      flipped[1] = row[6];
+      flipped[2] = row[5];
+      flipped[3] = row[4];
+      flipped[4] = row[3];
+      flipped[5] = row[2];
+      flipped[6] = row[1];
+      flipped[7] = row[0];
+      colors = flipped;
+   }
+
+   /* check for solid sprite pixel overlapping solid bg pixel */
+   if (check_strike)
+   {
+      if (colors[0] && BG_SOLID(surface[0]))
+         strike_pixel = 0;
+      else if (colors[1] && BG_SOLID(surface[1]))
+         strike_pixel = 1;
+      else if (colors[2] && BG_SOLID(surface[2]))
+         strike_pixel = 2;
+      else if (colors[3] && BG_SOLID(surface[3]))
+         strike_pixel = 3;
+      else if (colors[4] && BG_SOLID(surface[4]))
+         strike_pixel = 4;
+      else if (colors[5] && BG_SOLID(surface[5]))
+         strike_pixel = 5;
+      else if (colors[6] && BG_SOLID(surface[6]))
+         strike_pixel = 6;
+      else if (colors[7] && BG_SOLID(surface[7]))
+         strike_pixel = 7;
+   }
+
+   /* draw the character */
+   if (attrib & OAMF_BEHIND)
+   {
+      if (colors[0])
+         surface[0] = SP_PIXEL | (BG_CLEAR(surface[0]) ? col_tbl[colors[0]] : surface[0]);
+      if (colors[1])
+         surface[1] = SP_PIXEL | (BG_CLEAR(surface[1]) ? col_tbl[colors[1]] : surface[1]);
+      if (colors[2])
+         surface[2] = SP_PIXEL | (BG_CLEAR(surface[2]) ? col_tbl[colors[2]] : surface[2]);
+      if (colors[3])
+         surface[3] = SP_PIXEL | (BG_CLEAR(surface[3]) ? col_tbl[colors[3]] : surface[3]);
+      if (colors[4])
+         surface[4] = SP_PIXEL | (BG_CLEAR(surface[4]) ? col_tbl[colors[4]] : surface[4]);
+      if (colors[5])
+         surface[5] = SP_PIXEL | (BG_CLEAR(surface[5]) ? col_tbl[colors[5]] : surface[5]);
+      if (colors[6])
+         surface[6] = SP_PIXEL | (BG_CLEAR(surface[6]) ? col_tbl[colors[6]] : surface[6]);
+      if (colors[7])
+         surface[7] = SP_PIXEL | (BG_CLEAR(surface[7]) ? col_tbl[colors[7]] : surface[7]);
+   }
+   else
+   {
+      if (colors[0] && SP_CLEAR(surface[0]))
+         surface[0] = SP_PIXEL | col_tbl[colors[0]];
+      if (colors[1] && SP_CLEAR(surface[1]))
+         surface[1] = SP_PIXEL | col_tbl[colors[1]];
+      if (colors[2] && SP_CLEAR(surface[2]))
+         surface[2] = SP_PIXEL | col_tbl[colors[2]];
+      if (colors[3] && SP_CLEAR(surface[3]))
+         surface[3] = SP_PIXEL | col_tbl[colors[3]];
+      if (colors[4] && SP_CLEAR(surface[4]))
+         surface[4] = SP_PIXEL | col_tbl[colors[4]];
+      if (colors[5] && SP_CLEAR(surface[5]))
+         surface[5] = SP_PIXEL | col_tbl[colors[5]];
+      if (colors[6] && SP_CLEAR(surface[6]))
+         surface[6] = SP_PIXEL | col_tbl[colors[6]];
+      if (colors[7] && SP_CLEAR(surface[7]))
+         surface[7] = SP_PIXEL | col_tbl[colors[7]];
+   }
+
+   return strike_pixel;
+}
+
+#if PPU_KERNEL == PPU_KERNEL_SWAR32 || PPU_KERNEL == PPU_KERNEL_SWAR64
+
+/*
+** SWAR: a machine word holds 4 or 8 pixels.  Pixel tests turn into
+** byte masks (0x00/0xFF): a flag bit is shifted down to bit 0 of each
+** byte and multiplied by 0xFF, which can't carry across bytes.
+*/
+#if PPU_KERNEL == PPU_KERNEL_SWAR64
+typedef uint64_t kword_t;
+#define  KERN_ONES            0x0101010101010101ULL
+#define  KERN_BSWAP(w)        __builtin_bswap64(w)
+#else /* PPU_KERNEL_SWAR32 */
+typedef uint32_t kword_t;
+#define  KERN_ONES            0x01010101U
+#define  KERN_BSWAP(w)        __builtin_bswap32(w)
+#endif
+
+#define  KERN_WORDS           (8 / sizeof(kword_t))
+#define  KERN_SPLAT(b)        ((kword_t) (uint8) (b) * KERN_ONES)
+#define  KERN_MASK(w, bit)    ((((w) >> (bit)) & KERN_ONES) * 0xFF)
+
+/* palette lookup of a word of colors 0-3:
+** c0 ^ (bit0 ? c0^c1) ^ (bit1 ? c0^c2) ^ (bit0 && bit1 ? c0^c1^c2^c3)
+*/
+typedef struct kpal_s
+{
+   kword_t base, lo, hi, both;
+} kpal_t;
+
+INLINE void kern_loadpal(kpal_t *pal, const uint8 *colors)
+{
+   pal->base = KERN_SPLAT(colors[0]);
+   pal->lo = KERN_SPLAT(colors[0] ^ colors[1]);
+   pal->hi = KERN_SPLAT(colors[0] ^ colors[2]);
+   pal->both = KERN_SPLAT(colors[0] ^ colors[1] ^ colors[2] ^ colors[3]);
+}
+
+INLINE kword_t kern_lookup(const kpal_t *pal, kword_t pixels)
+{
+   kword_t lo = KERN_MASK(pixels, 0);
+   kword_t hi = KERN_MASK(pixels, 1);
+
+   return pal->base ^ (lo & pal->lo) ^ (hi & pal->hi) ^ (lo & hi & pal->both);
+}
+
+INLINE void kern_bgtile(uint8 *surface, const uint8 *row, const uint8 *colors)
+{
+   kword_t pixels[KERN_WORDS];
+   kpal_t pal;
+   unsigned i;
+
+   kern_loadpal(&pal, colors);
+   memcpy(pixels, row, 8);
+   for (i = 0; i < KERN_WORDS; i++)
+      pixels[i] = kern_lookup(&pal, pixels[i]);
+   memcpy(surface, pixels, 8);
+}
+
+INLINE int kern_oamtile(uint8 *surface, const uint8 *row, const uint8 *col_tbl,
+                        uint8 attrib, bool check_strike)
+{
+   kword_t pixels[KERN_WORDS], dest[KERN_WORDS];
+   kword_t solid, bg_clear, sprite, draw;
+   kpal_t pal;
+   unsigned i;
+   int strike_pixel = -1;
+
+   kern_loadpal(&pal, col_tbl);
+   memcpy(pixels, row, 8);
+   memcpy(dest, surface, 8);
+
+   if (attrib & OAMF_HFLIP)
+   {
+#if PPU_KERNEL == PPU_KERNEL_SWAR64
+      pixels[0] = KERN_BSWAP(pixels[0]);
+#else /* PPU_KERNEL_SWAR32 */
+      kword_t left = pixels[0];
+      pixels[0] = KERN_BSWAP(pixels[1]);
+      pixels[1] = KERN_BSWAP(left);
+#endif
+   }
+
+   for (i = 0; i < KERN_WORDS; i++)
+   {
+      solid = KERN_MASK(pixels[i] | (pixels[i] >> 1), 0);
+      bg_clear = KERN_MASK(dest[i], 7);
+      sprite = kern_lookup(&pal, pixels[i]) | KERN_SPLAT(SP_PIXEL);
+
+      /* first solid sprite pixel over a solid bg pixel, lowest byte first */
+      if (check_strike && strike_pixel < 0 && (solid & ~bg_clear))
+         strike_pixel = i * sizeof(kword_t) + (__builtin_ctzll(solid & ~bg_clear) >> 3);
+
+      if (attrib & OAMF_BEHIND)
+      {
+         /* under a solid bg pixel, just mark the pixel taken */
+         dest[i] = (dest[i] & ~solid)
+                   | (solid & bg_clear & sprite)
+                   | (solid & ~bg_clear & (dest[i] | KERN_SPLAT(SP_PIXEL)));
+      }
+      else
+      {
+         draw = solid & ~KERN_MASK(dest[i], 6);
+         dest[i] = (dest[i] & ~draw) | (sprite & draw);
+      }
+   }
+
+   memcpy(surface, dest, 8);
+   return strike_pixel;
+}
+
+#elif PPU_KERNEL == PPU_KERNEL_SSE2
+
+/*
+** SSE2: the low 8 bytes of an xmm register.  No pshufb before SSSE3, so
+** the palette lookup is three compares and selects.
+*/
+typedef struct kpal_s
+{
+   __m128i base, c1, c2, c3;
+} kpal_t;
+
+INLINE void kern_loadpal(kpal_t *pal, const uint8 *colors)
+{
+   pal->base = _mm_set1_epi8(colors[0]);
+   pal->c1 = _mm_set1_epi8(colors[0] ^ colors[1]);
+   pal->c2 = _mm_set1_epi8(colors[0] ^ colors[2]);
+   pal->c3 = _mm_set1_epi8(colors[0] ^ colors[3]);
+}
+
+INLINE __m128i kern_lookup(const kpal_t *pal, __m128i pixels)
+{
+   __m128i out = pal->base;
+
+   out = _mm_xor_si128(out, _mm_and_si128(pal->c1, _mm_cmpeq_epi8(pixels, _mm_set1_epi8(1))));
+   out = _mm_xor_si128(out, _mm_and_si128(pal->c2, _mm_cmpeq_epi8(pixels, _mm_set1_epi8(2))));
+   out = _mm_xor_si128(out, _mm_and_si128(pal->c3, _mm_cmpeq_epi8(pixels, _mm_set1_epi8(3))));
+   return out;
+}
+
+INLINE void kern_bgtile(uint8 *surface, const uint8 *row, const uint8 *colors)
+{
+   kpal_t pal;
+
+   kern_loadpal(&pal, colors);
+   _mm_storel_epi64((__m128i *) surface,
+                    kern_lookup(&pal, _mm_loadl_epi64((const __m128i *) row)));
+}
+
+INLINE int kern_oamtile(uint8 *surface, const uint8 *row, const uint8 *col_tbl,
+                        uint8 attrib, bool check_strike)
+{
+   __m128i pixels, dest, solid, bg_clear, sprite, draw, sp_pixel;
+   kpal_t pal;
+   int hits;
+   int strike_pixel = -1;
+
+   pixels = _mm_loadl_epi64((const __m128i *) row);
+   if (attrib & OAMF_HFLIP)
+   {
+      /* swap the bytes of each word, then the words */
+      pixels = _mm_or_si128(_mm_slli_epi16(pixels, 8), _mm_srli_epi16(pixels, 8));
+      pixels = _mm_shufflelo_epi16(pixels, _MM_SHUFFLE(0, 1, 2, 3));
+   }
+
+   kern_loadpal(&pal, col_tbl);
+   dest = _mm_loadl_epi64((const __m128i *) surface);
+   sp_pixel = _mm_set1_epi8(SP_PIXEL);
+
+   /* all ones where the sprite pixel is not color 0 */
+   solid = _mm_xor_si128(_mm_cmpeq_epi8(pixels, _mm_setzero_si128()), _mm_set1_epi8(-1));
+   bg_clear = _mm_cmplt_epi8(dest, _mm_setzero_si128()); /* BG_TRANS is the sign bit */
+   sprite = _mm_or_si128(kern_lookup(&pal, pixels), sp_pixel);
+
+   if (check_strike)
+   {
+      hits = _mm_movemask_epi8(_mm_andnot_si128(bg_clear, solid)) & 0xFF;
+      if (hits)
+         strike_pixel = __builtin_ctz(hits);
+   }
+
+   if (attrib & OAMF_BEHIND)
+   {
+      /* under a solid bg pixel, just mark the pixel taken */
+      sprite = _mm_or_si128(_mm_and_si128(bg_clear, sprite),
+                            _mm_andnot_si128(bg_clear, _mm_or_si128(dest, sp_pixel)));
+      draw = solid;
+   }
+   else
+   {
+      draw = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_and_si128(dest, sp_pixel), sp_pixel), solid);
+   }
+
+   dest = _mm_or_si128(_mm_andnot_si128(draw, dest), _mm_and_si128(draw, sprite));
+   _mm_storel_epi64((__m128i *) surface, dest);
+   return strike_pixel;
+}
+
+#elif PPU_KERNEL == PPU_KERNEL_NEON
+
+/*
+** NEON: 64-bit D registers, vtbl does the palette lookup directly.
+*/
+INLINE uint8x8_t kern_loadpal(const uint8 *colors)
+{
+   uint32_t pal;
+
+   memcpy(&pal, colors, 4);
+   return vcreate_u8(pal);
+}
+
+INLINE void kern_bgtile(uint8 *surface, const uint8 *row, const uint8 *colors)
+{
+   vst1_u8(surface, vtbl1_u8(kern_loadpal(colors), vld1_u8(row)));
+}
+
+INLINE int kern_oamtile(uint8 *surface, const uint8 *row, const uint8 *col_tbl,
+                        uint8 attrib, bool check_strike)
+{
+   uint8x8_t pixels, dest, solid, bg_clear, sprite, draw, sp_pixel;
+   uint64_t hits;
+   int strike_pixel = -1;
+
+   pixels = vld1_u8(row);
+   if (attrib & OAMF_HFLIP)
+      pixels = vrev64_u8(pixels);
+
+   dest = vld1_u8(surface);
+   sp_pixel = vdup_n_u8(SP_PIXEL);
+
+   solid = vtst_u8(pixels, pixels);
+   bg_clear = vtst_u8(dest, vdup_n_u8(BG_TRANS));
+   sprite = vorr_u8(vtbl1_u8(kern_loadpal(col_tbl), pixels), sp_pixel);
+
+   if (check_strike)
+   {
+      hits = vget_lane_u64(vreinterpret_u64_u8(vbic_u8(solid, bg_clear)), 0);
+      if (hits)
+         strike_pixel = __builtin_ctzll(hits) >> 3;
+   }
+
+   if (attrib & OAMF_BEHIND)
+   {
+      /* under a solid bg pixel, just mark the pixel taken */
+      sprite = vbsl_u8(bg_clear, sprite, vorr_u8(dest, sp_pixel));
+      draw = solid;
+   }
+   else
+   {
+      draw = vbic_u8(solid, vtst_u8(dest, sp_pixel));
+   }
+
+   vst1_u8(surface, vbsl_u8(draw, sprite, dest));
+   return strike_pixel;
+}
+
+#else /* PPU_KERNEL_SCALAR */
+
+#define  kern_bgtile          scalar_bgtile
+#define  kern_oamtile         scalar_oamtile
+
+#endif /* PPU_KERNEL_SCALAR */
+
+#endif /* !_PPU_KERN_H_ */
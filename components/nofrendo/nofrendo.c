@@ -25,6 +25,7 @@
 */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <noftypes.h>
 #include <nofrendo.h>
@@ -137,7 +138,7 @@ static system_t detect_systemtype(const char *filename)
 static int install_timer(int hertz)
 {
    return osd_installtimer(hertz, (void *) timer_isr,
-                           (int) timer_isr_end - (int) timer_isr,
+                           (int) ((uintptr_t) timer_isr_end - (uintptr_t) timer_isr),
                            (void *) &nofrendo_ticks, 
                            sizeof(nofrendo_ticks));
 }
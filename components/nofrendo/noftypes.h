@@ -31,18 +31,35 @@
 
 #ifdef __GNUC__
 #define  INLINE      static inline
+#define  NOINLINE    static __attribute__((noinline))
 #define  ZERO_LENGTH 0
 #elif defined(WIN32)
 #define  INLINE      static __inline
+#define  NOINLINE    static __declspec(noinline)
 #define  ZERO_LENGTH 0
 #else /* crapintosh? */
 #define  INLINE      static
+#define  NOINLINE    static
 #define  ZERO_LENGTH 1
 #endif
 
 /* quell stupid compiler warnings */
 #define  UNUSED(x)   ((x) = (x))
 
+/* Define NOFRENDO_REENTRANT to give every thread its own copy of the
+** emulator's state, so that each thread can run a machine of its own.
+** Without it there is one of everything and THREAD_LOCAL is empty.
+*/
+#ifdef NOFRENDO_REENTRANT
+#ifdef __GNUC__
+#define  THREAD_LOCAL   __thread
+#else /* !__GNUC__ */
+#error NOFRENDO_REENTRANT needs a compiler with thread local storage
+#endif /* !__GNUC__ */
+#else /* !NOFRENDO_REENTRANT */
+#define  THREAD_LOCAL
+#endif /* !NOFRENDO_REENTRANT */
+
 typedef  signed char    int8;
 typedef  signed short   int16;
 typedef  signed int     int32;
@@ -67,7 +84,7 @@ typedef enum
 
 #ifdef NOFRENDO_DEBUG
 
-#define  ASSERT(expr)      log_assert((int) (expr), __LINE__, __FILE__, NULL)
+#define  ASSERT(expr)      log_assert((expr) ? 1 : 0, __LINE__, __FILE__, NULL)
 #define  ASSERT_MSG(msg)   log_assert(false, __LINE__, __FILE__, (msg))
 
 #else /* !NOFRENDO_DEBUG */
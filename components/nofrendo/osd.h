@@ -84,6 +84,9 @@ extern int osd_main(int argc, char *argv[]);
 extern int osd_installtimer(int frequency, void *func, int funcsize,
                             void *counter, int countersize);
 
+/* after every emulated frame, drawn or not, before it is blitted */
+extern void osd_endframe(void);
+
 /* filename manipulation */
 extern void osd_fullname(char *fullname, const char *shortname);
 extern char *osd_newextension(char *string, char *ext);
@@ -0,0 +1,336 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+**
+** pace.c
+**
+** Frame pacing: when to emulate the next frame, and whether to draw it
+**
+** Frame n is due at a fixed point on the OSD layer's clock, counted from
+** when pacing started, so rounding never builds up the way it does with
+** a periodic tick.  Being late doesn't move the later frames: they get
+** emulated without being drawn until the emulator has caught up, or,
+** once it is too far behind, the schedule starts over from the present.
+**
+** With autoframeskip on, frames can also be skipped ahead of time.  Each
+** frame is timed in three parts: emulating it, drawing it, and handing it
+** to the display, and the averages give the share of frames there is time
+** to draw.  That share is then either spread evenly (2 out of 3, rather
+** than 5 drawn and a burst of skips), or rounded down to a lower display
+** rate (every 2nd, every 3rd frame), which looks steadier.
+*/
+
+#include <string.h>
+#include <noftypes.h>
+#include <log.h>
+#include <pace.h>
+
+static int pace_policy = PACE_FREE;
+static pace_clock_t pace_clock;
+static int pace_refresh;
+
+/* frame n is due at pace_base + n frame periods */
+static uint32 pace_base, pace_frame;
+
+static pace_stats_t pace_stats;
+static long long jitter_sum, idle_sum;
+
+/* frame costs in us, averaged over about 8 frames */
+typedef struct pace_cost_s
+{
+   int32 avg;
+   bool valid;
+} pace_cost_t;
+
+static int pace_skip = PACE_SKIP_LATE;
+static pace_cost_t cost_emulate, cost_draw, cost_blit;
+static uint32 frame_start, frame_emulated;
+static bool frame_drawn;
+static uint32 draw_share, share_acc;
+static int divisor, divisor_phase;
+static int fixed_divisor;
+
+void pace_setclock(int policy, const pace_clock_t *clock)
+{
+   if (PACE_FREE != policy && NULL == clock)
+   {
+      log_printf("frame pacing needs a clock, running free\n");
+      policy = PACE_FREE;
+   }
+
+   pace_policy = policy;
+   if (clock)
+      pace_clock = *clock;
+}
+
+int pace_getpolicy(void)
+{
+   return pace_policy;
+}
+
+const char *pace_policyname(int policy)
+{
+   switch (policy)
+   {
+   case PACE_TIMER:
+      return "timer";
+
+   case PACE_AUDIO:
+      return "audio";
+
+   default:
+      return "free";
+   }
+}
+
+void pace_setskip(int mode)
+{
+   pace_skip = mode;
+}
+
+/* Draw one frame in divisor whatever the timing, even running free, to
+** test the skipped frame path.  0 goes back to adaptive frameskip.
+*/
+void pace_fixskip(int divisor)
+{
+   fixed_divisor = divisor;
+}
+
+const char *pace_skipname(int mode)
+{
+   switch (mode)
+   {
+   case PACE_SKIP_EVEN:
+      return "even";
+
+   case PACE_SKIP_REFRESH:
+      return "refresh";
+
+   default:
+      return "late";
+   }
+}
+
+void pace_start(int refresh_rate)
+{
+   memset(&pace_stats, 0, sizeof(pace_stats));
+   jitter_sum = idle_sum = 0;
+
+   memset(&cost_emulate, 0, sizeof(cost_emulate));
+   memset(&cost_draw, 0, sizeof(cost_draw));
+   memset(&cost_blit, 0, sizeof(cost_blit));
+   draw_share = 0x10000;
+   share_acc = 0;
+   divisor = fixed_divisor ? fixed_divisor : 1;
+   divisor_phase = 0;
+
+   pace_refresh = refresh_rate;
+   pace_frame = 0;
+   if (PACE_FREE != pace_policy)
+      pace_base = pace_clock.now(pace_clock.arg);
+}
+
+INLINE uint32 pace_tous(long long units)
+{
+   return (uint32) (units * 1000000 / pace_clock.rate);
+}
+
+/* the frames planned to be skipped, as opposed to late ones */
+static bool pace_scheduled(void)
+{
+   switch (fixed_divisor ? PACE_SKIP_REFRESH : pace_skip)
+   {
+   case PACE_SKIP_EVEN:
+      share_acc += draw_share;
+      if (share_acc < 0x10000)
+         return false;
+
+      share_acc -= 0x10000;
+      return true;
+
+   case PACE_SKIP_REFRESH:
+      if (++divisor_phase < divisor)
+         return false;
+
+      divisor_phase = 0;
+      return true;
+
+   default:
+      return true;
+   }
+}
+
+/* Waits until the next frame is due, returns false when it should be
+** emulated without drawing it (only if skip_ok).
+*/
+bool pace_nextframe(bool skip_ok)
+{
+   uint32 period, slot, start, now, behind, jitter;
+   bool draw = true;
+
+   pace_stats.frames++;
+
+   if (PACE_FREE != pace_policy)
+   {
+      period = pace_clock.rate / pace_refresh;
+      slot = pace_base + (uint32) ((long long) pace_frame * pace_clock.rate / pace_refresh);
+      start = slot - pace_clock.lead;
+      now = pace_clock.now(pace_clock.arg);
+
+      if ((int32) (now - start) < 0)
+      {
+         behind = now;
+         do
+         {
+            pace_clock.wait(pace_clock.arg, start);
+            now = pace_clock.now(pace_clock.arg);
+         }
+         while ((int32) (now - start) < 0);
+
+         idle_sum += now - behind;
+
+         /* how long it overslept */
+         behind = now - start;
+      }
+      else if ((int32) (now - slot) > 0)
+         behind = now - slot;
+      else
+         behind = 0;
+
+      jitter = pace_tous(behind);
+      jitter_sum += jitter;
+      if (jitter > pace_stats.jitter_max)
+         pace_stats.jitter_max = jitter;
+
+      pace_frame++;
+
+      if (behind >= PACE_MAXBEHIND * period)
+      {
+         /* no use skipping that many frames, carry on from here */
+         pace_base = now;
+         pace_frame = 1;
+         pace_stats.resyncs++;
+      }
+      else if (behind >= period)
+      {
+         pace_stats.late++;
+         draw = !skip_ok;
+      }
+      else if (skip_ok)
+         draw = pace_scheduled();
+   }
+   else if (skip_ok && fixed_divisor)
+      draw = pace_scheduled();
+
+   if (draw)
+      pace_stats.drawn++;
+   else
+      pace_stats.skipped++;
+
+   frame_drawn = draw;
+   if (pace_clock.usec)
+      frame_start = pace_clock.usec(pace_clock.arg);
+
+   return draw;
+}
+
+static void pace_average(pace_cost_t *cost, uint32 us)
+{
+   if (cost->valid)
+      cost->avg += ((int32) us - cost->avg) / 8;
+   else
+      cost->avg = us;
+
+   cost->valid = true;
+}
+
+/* how many frames there is time to draw */
+static void pace_adapt(void)
+{
+   int32 budget, drawn, skipped;
+
+   if (fixed_divisor || false == cost_draw.valid || false == cost_blit.valid)
+      return;
+
+   /* leave some headroom, the costs are only averages */
+   budget = 1000000 / pace_refresh * 15 / 16;
+   drawn = cost_draw.avg + cost_blit.avg;
+
+   /* until a frame has been skipped, guess */
+   skipped = cost_emulate.valid ? cost_emulate.avg : cost_draw.avg / 2;
+
+   if (drawn <= budget)
+   {
+      draw_share = 0x10000;
+      divisor = 1;
+   }
+   else if (skipped >= budget || drawn <= skipped)
+   {
+      draw_share = 0x10000 / PACE_MAXSKIP;
+      divisor = PACE_MAXSKIP;
+   }
+   else
+   {
+      /* share * drawn + (1 - share) * skipped = budget */
+      draw_share = (uint32) ((long long) (budget - skipped) * 0x10000 / (drawn - skipped));
+      if (draw_share < 0x10000 / PACE_MAXSKIP)
+         draw_share = 0x10000 / PACE_MAXSKIP;
+
+      divisor = (0x10000 + draw_share - 1) / draw_share;
+   }
+}
+
+/* the frame has been emulated, and drawn if it was going to be */
+void pace_emulated(void)
+{
+   if (NULL == pace_clock.usec)
+      return;
+
+   frame_emulated = pace_clock.usec(pace_clock.arg);
+   pace_average(frame_drawn ? &cost_draw : &cost_emulate, frame_emulated - frame_start);
+}
+
+/* the frame is on its way to the display, or was skipped */
+void pace_shown(void)
+{
+   if (NULL == pace_clock.usec)
+      return;
+
+   if (frame_drawn)
+      pace_average(&cost_blit, pace_clock.usec(pace_clock.arg) - frame_emulated);
+
+   pace_adapt();
+}
+
+void pace_getstats(pace_stats_t *stats)
+{
+   *stats = pace_stats;
+
+   if (PACE_FREE != pace_policy && pace_stats.frames)
+   {
+      stats->jitter_avg = (uint32) (jitter_sum / pace_stats.frames);
+      stats->idle = (uint32) (idle_sum * 1000 / pace_clock.rate);
+   }
+
+   stats->emulate_us = cost_emulate.valid ? cost_emulate.avg : 0;
+   stats->render_us = (cost_draw.valid && cost_draw.avg > stats->emulate_us) ? cost_draw.avg - stats->emulate_us : 0;
+   stats->blit_us = cost_blit.valid ? cost_blit.avg : 0;
+   stats->draw_share = draw_share;
+   stats->divisor = divisor;
+}
@@ -0,0 +1,102 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** pace.h
+**
+** Frame pacing: when to emulate the next frame, and whether to draw it
+*/
+
+
+#ifndef _PACE_H_
+#define _PACE_H_
+
+#include <noftypes.h>
+
+/* catching up on more frames than this starts over from the current time */
+#define  PACE_MAXBEHIND       8
+
+/* adaptive frameskip draws at least one frame in this many */
+#define  PACE_MAXSKIP         4
+
+enum
+{
+   PACE_FREE,                 /* as fast as possible, every frame drawn */
+   PACE_TIMER,                /* vsync-like: a fixed rate off a clock */
+   PACE_AUDIO                 /* follow the samples the audio output has used up */
+};
+
+/* which frames to skip drawing, when autoframeskip is on */
+enum
+{
+   PACE_SKIP_LATE,            /* only frames already a frame late */
+   PACE_SKIP_EVEN,            /* spread evenly, as many as the frame cost needs */
+   PACE_SKIP_REFRESH          /* lower the display rate: draw every 2nd, 3rd.. frame */
+};
+
+/* The clock, supplied by the OSD layer.  now() counts rate units a
+** second and may wrap.  wait() sleeps until now() reaches until, it may
+** return early.  Frames can be emulated up to lead units ahead of the
+** clock, for an audio clock that is how much the output buffers.
+** usec() is a microsecond timer to measure frames with, it can be NULL.
+*/
+typedef struct pace_clock_s
+{
+   void *arg;
+   uint32 (*now)(void *arg);
+   void (*wait)(void *arg, uint32 until);
+   uint32 rate;
+   uint32 lead;
+   uint32 (*usec)(void *arg);
+} pace_clock_t;
+
+typedef struct pace_stats_s
+{
+   uint32 frames;             /* frames paced */
+   uint32 late;               /* started a frame or more after they were due */
+   uint32 skipped;            /* emulated without drawing to catch up */
+   uint32 resyncs;            /* times it gave up catching up */
+   uint32 jitter_avg;         /* us between when frames were due and started */
+   uint32 jitter_max;
+   uint32 idle;               /* ms spent waiting for the clock */
+
+   /* adaptive frameskip, averages over the last few frames */
+   uint32 drawn;              /* frames drawn */
+   uint32 emulate_us;         /* emulating a frame */
+   uint32 render_us;          /* drawing it on top of that */
+   uint32 blit_us;            /* handing a drawn frame to the display */
+   uint32 draw_share;         /* frames it draws, in 1/65536 (PACE_SKIP_EVEN) */
+   uint32 divisor;            /* draws one in this many (PACE_SKIP_REFRESH) */
+} pace_stats_t;
+
+extern void pace_setclock(int policy, const pace_clock_t *clock);
+extern int pace_getpolicy(void);
+extern const char *pace_policyname(int policy);
+
+extern void pace_setskip(int mode);
+extern void pace_fixskip(int divisor);
+extern const char *pace_skipname(int mode);
+
+extern void pace_start(int refresh_rate);
+extern bool pace_nextframe(bool skip_ok);
+extern void pace_emulated(void);
+extern void pace_shown(void);
+
+extern void pace_getstats(pace_stats_t *stats);
+
+#endif /* _PACE_H_ */
@@ -0,0 +1,297 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** prof.c
+**
+** Zone profiler: where the time of a frame goes
+**
+** Every task has its own ring, it is the only one writing to it, and
+** whoever writes the trace out is the only one reading it, so nothing
+** takes a lock.  A zone is only recorded when it ends: one event with
+** its start and length, which is what the trace format calls a
+** complete event.  Zones left open across a prof_writeevents() simply
+** turn up in the next one.
+*/
+
+#ifdef NOFRENDO_PROFILE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <noftypes.h>
+#include <log.h>
+#include <prof.h>
+
+#ifdef __GNUC__
+#define  RING_LOAD(x)         __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define  RING_STORE(x, v)     __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#else /* !__GNUC__ */
+#define  RING_LOAD(x)         (x)
+#define  RING_STORE(x, v)     ((x) = (v))
+#endif /* !__GNUC__ */
+
+/* the zone shares a word with the length, which saturates */
+#define  PROF_ZONESHIFT       28
+#define  PROF_MAXTICKS        ((1 << PROF_ZONESHIFT) - 1)
+
+/* the display and audio tasks only record a few zones a frame */
+#define  PROF_SMALLRING       8
+
+typedef struct prof_event_s
+{
+   uint32 start;
+   uint32 info;               /* zone << PROF_ZONESHIFT | ticks */
+} prof_event_t;
+
+typedef struct prof_track_s
+{
+   prof_event_t *buf;
+   uint32 mask;
+
+   /* owning task */
+   volatile uint32 head;
+   uint32 open[PROF_MAXDEPTH];
+   int depth;
+   uint32 dropped;
+
+   /* trace writer */
+   volatile uint32 tail;
+} prof_track_t;
+
+static const struct
+{
+   const char *name;
+   int track;
+} zones[PROF_ZONES] =
+{
+   { "frame",  PROF_TRACK_EMU },
+   { "pace",   PROF_TRACK_EMU },
+   { "cpu",    PROF_TRACK_EMU },
+   { "ppu",    PROF_TRACK_EMU },
+   { "mapper", PROF_TRACK_EMU },
+   { "apu",    PROF_TRACK_EMU },
+   { "gui",    PROF_TRACK_EMU },
+   { "blit",   PROF_TRACK_EMU },
+   { "lcd",    PROF_TRACK_DISPLAY },
+   { "sound",  PROF_TRACK_AUDIO }
+};
+
+static const char *track_names[PROF_TRACKS] = { "emulator", "display", "audio" };
+
+static prof_track_t tracks[PROF_TRACKS];
+static uint32 (*prof_clock)(void) = NULL;
+static uint32 prof_ticks;
+
+/* the clock extended past 32 bits at every prof_writeevents() */
+static uint32 base_raw;
+static long long base_ticks;
+
+int prof_init(uint32 (*clock)(void), uint32 ticks_per_us, int events)
+{
+   int i, size;
+
+   if (events < PROF_SMALLRING * 2 || (events & (events - 1)) || 0 == ticks_per_us)
+   {
+      log_printf("profiler needs a power of 2 ring size\n");
+      return -1;
+   }
+
+   memset(tracks, 0, sizeof(tracks));
+
+   for (i = 0; i < PROF_TRACKS; i++)
+   {
+      size = (PROF_TRACK_EMU == i) ? events : events / PROF_SMALLRING;
+      tracks[i].buf = malloc(size * sizeof(prof_event_t));
+      if (NULL == tracks[i].buf)
+      {
+         prof_shutdown();
+         return -1;
+      }
+      tracks[i].mask = size - 1;
+   }
+
+   prof_ticks = ticks_per_us;
+   base_raw = clock();
+   base_ticks = 0;
+   prof_clock = clock;
+
+   return 0;
+}
+
+void prof_shutdown(void)
+{
+   int i;
+
+   prof_clock = NULL;
+
+   for (i = 0; i < PROF_TRACKS; i++)
+   {
+      free(tracks[i].buf);
+      tracks[i].buf = NULL;
+   }
+}
+
+void prof_begin(int zone)
+{
+   prof_track_t *track;
+
+   ASSERT(zone >= 0 && zone < PROF_ZONES);
+
+   if (NULL == prof_clock)
+      return;
+
+   track = &tracks[zones[zone].track];
+   if (track->depth < PROF_MAXDEPTH)
+      track->open[track->depth] = prof_clock();
+   track->depth++;
+}
+
+void prof_end(int zone)
+{
+   prof_track_t *track;
+   prof_event_t *event;
+   uint32 now, head, ticks;
+
+   ASSERT(zone >= 0 && zone < PROF_ZONES);
+
+   if (NULL == prof_clock)
+      return;
+
+   now = prof_clock();
+   track = &tracks[zones[zone].track];
+
+   /* ended before profiling started */
+   if (0 == track->depth)
+      return;
+
+   if (--track->depth >= PROF_MAXDEPTH)
+      return;
+
+   head = track->head;
+   if (head - RING_LOAD(track->tail) > track->mask)
+   {
+      track->dropped++;
+      return;
+   }
+
+   ticks = now - track->open[track->depth];
+   if (ticks > PROF_MAXTICKS)
+      ticks = PROF_MAXTICKS;
+
+   event = &track->buf[head & track->mask];
+   event->start = track->open[track->depth];
+   event->info = ((uint32) zone << PROF_ZONESHIFT) | ticks;
+
+   RING_STORE(track->head, head + 1);
+}
+
+void prof_discard(void)
+{
+   int i;
+
+   for (i = 0; i < PROF_TRACKS; i++)
+      RING_STORE(tracks[i].tail, RING_LOAD(tracks[i].head));
+
+   base_raw = prof_clock();
+   base_ticks = 0;
+}
+
+void prof_writeheader(prof_out_t out, void *arg)
+{
+   char text[128];
+   int i;
+
+   out(arg, "{\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"nofrendo\"}}");
+
+   for (i = 0; i < PROF_TRACKS; i++)
+   {
+      snprintf(text, sizeof(text), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+               "\"args\":{\"name\":\"%s\"}}", i, track_names[i]);
+      out(arg, text);
+   }
+}
+
+int prof_writeevents(prof_out_t out, void *arg)
+{
+   prof_track_t *track;
+   prof_event_t *event;
+   char text[128];
+   uint32 now, head[PROF_TRACKS], tail;
+   long long start;
+   int i, count = 0;
+
+   /* the other tasks keep going: only take what was there before now */
+   for (i = 0; i < PROF_TRACKS; i++)
+      head[i] = RING_LOAD(tracks[i].head);
+
+   now = prof_clock();
+   base_ticks += (uint32) (now - base_raw);
+   base_raw = now;
+
+   for (i = 0; i < PROF_TRACKS; i++)
+   {
+      track = &tracks[i];
+
+      for (tail = track->tail; tail != head[i]; tail++)
+      {
+         event = &track->buf[tail & track->mask];
+
+         /* everything in the rings happened less than 2^32 ticks ago */
+         start = base_ticks - (uint32) (now - event->start);
+
+         snprintf(text, sizeof(text), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                  "\"ts\":%.3f,\"dur\":%.3f}", zones[event->info >> PROF_ZONESHIFT].name, i,
+                  (double) start / prof_ticks, (double) (event->info & PROF_MAXTICKS) / prof_ticks);
+         out(arg, text);
+         count++;
+      }
+
+      RING_STORE(track->tail, head[i]);
+   }
+
+   return count;
+}
+
+void prof_writefooter(prof_out_t out, void *arg)
+{
+   char text[64];
+
+   snprintf(text, sizeof(text), "\n],\"otherData\":{\"dropped\":\"%u\"}}\n", prof_dropped());
+   out(arg, text);
+}
+
+const char *prof_zonename(int zone)
+{
+   return (zone >= 0 && zone < PROF_ZONES) ? zones[zone].name : "?";
+}
+
+/* zones that didn't fit in the ring */
+uint32 prof_dropped(void)
+{
+   uint32 dropped = 0;
+   int i;
+
+   for (i = 0; i < PROF_TRACKS; i++)
+      dropped += tracks[i].dropped;
+
+   return dropped;
+}
+
+#endif /* NOFRENDO_PROFILE */
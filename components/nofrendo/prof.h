@@ -0,0 +1,102 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** prof.h
+**
+** Zone profiler: where the time of a frame goes
+**
+** Compiled out unless NOFRENDO_PROFILE is defined.  Each zone is a
+** PROF_BEGIN()/PROF_END() pair around a call; zones on the same task
+** nest.  Finished zones go into a ring per task, stamped off a cycle
+** counter the OSD layer supplies, and can be written out as a Chrome
+** trace ("about:tracing", Perfetto).
+*/
+
+#ifndef _PROF_H_
+#define _PROF_H_
+
+#include <noftypes.h>
+
+/* which task a zone runs on, one ring each */
+enum
+{
+   PROF_TRACK_EMU,
+   PROF_TRACK_DISPLAY,
+   PROF_TRACK_AUDIO,
+   PROF_TRACKS
+};
+
+enum
+{
+   PROF_FRAME,                /* one trip round nes_emulate() */
+   PROF_PACE,                 /* waiting for the frame to be due */
+   PROF_CPU,                  /* nes6502_execute() */
+   PROF_PPU,                  /* ppu_scanline() */
+   PROF_MAPPER,               /* mapper hblank/vblank callbacks */
+   PROF_APU,                  /* apu_process() */
+   PROF_GUI,                  /* gui_frame() */
+   PROF_BLIT,                 /* vid_flush(), down to the video pipeline */
+   PROF_LCD,                  /* display task sending out a frame */
+   PROF_SOUND,                /* audio task feeding the DAC */
+   PROF_ZONES
+};
+
+/* zones open at once on one task, deeper ones aren't recorded */
+#define  PROF_MAXDEPTH        8
+
+#ifdef NOFRENDO_PROFILE
+
+#define  PROF_BEGIN(zone)     prof_begin(zone)
+#define  PROF_END(zone)       prof_end(zone)
+
+/* receives the trace a piece at a time */
+typedef void (*prof_out_t)(void *arg, const char *text);
+
+/* clock() is a free running 32-bit counter, ticks_per_us of it to a
+** microsecond, that reads the same on every task; events is the ring
+** size per task, a power of 2
+*/
+extern int prof_init(uint32 (*clock)(void), uint32 ticks_per_us, int events);
+extern void prof_shutdown(void);
+
+extern void prof_begin(int zone);
+extern void prof_end(int zone);
+
+/* forget everything recorded so far, trace times start over from here */
+extern void prof_discard(void);
+
+/* a trace is the header, any number of prof_writeevents(), then the
+** footer.  Each prof_writeevents() empties the rings, and has to come
+** less than 2^32 ticks after the previous one.
+*/
+extern void prof_writeheader(prof_out_t out, void *arg);
+extern int prof_writeevents(prof_out_t out, void *arg);
+extern void prof_writefooter(prof_out_t out, void *arg);
+
+extern const char *prof_zonename(int zone);
+extern uint32 prof_dropped(void);
+
+#else /* !NOFRENDO_PROFILE */
+
+#define  PROF_BEGIN(zone)
+#define  PROF_END(zone)
+
+#endif /* !NOFRENDO_PROFILE */
+
+#endif /* _PROF_H_ */
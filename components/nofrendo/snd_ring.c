@@ -0,0 +1,208 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** snd_ring.c
+**
+** Sample ring between the emulator and an audio output task
+**
+** One producer (the emulator, once a frame) and one consumer (the task
+** feeding the DAC), no locks: each side only ever moves its own index.
+** Neither side waits for the other.  The emulator runs off its own clock,
+** so instead of blocking it when the ring fills up, or letting the DAC
+** run dry, the samples going in are resampled very slightly: a bit
+** fewer when the ring is fuller than the target, a bit more when it is
+** emptier.  Whatever still doesn't fit is dropped, and the output task
+** repeats the last sample when it runs out.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <noftypes.h>
+#include <log.h>
+#include <snd_ring.h>
+
+/* each index is written by one side and read by the other */
+#ifdef __GNUC__
+#define  RING_LOAD(x)         __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define  RING_STORE(x, v)     __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#else /* !__GNUC__ */
+#define  RING_LOAD(x)         (x)
+#define  RING_STORE(x, v)     ((x) = (v))
+#endif /* !__GNUC__ */
+
+struct sndring_s
+{
+   int16 *buf;
+   uint32 size, mask;
+   int32 target;              /* fill level the rate control aims for */
+
+   /* producer */
+   volatile uint32 head;
+   uint32 phase;              /* resampling position, 16.16 */
+   int16 last;                /* last sample of the previous push */
+   int32 avg_fill;
+
+   /* consumer */
+   volatile uint32 tail;
+   int16 hold;                /* played again on an underrun */
+
+   sndring_stats_t stats;
+};
+
+sndring_t *sndring_create(int size, int target)
+{
+   sndring_t *ring;
+
+   if (size < 2 || (size & (size - 1)) || target <= 0 || target >= size)
+   {
+      log_printf("sample ring needs a power of 2 size and a target below it\n");
+      return NULL;
+   }
+
+   ring = malloc(sizeof(sndring_t));
+   if (NULL == ring)
+      return NULL;
+
+   memset(ring, 0, sizeof(sndring_t));
+
+   ring->buf = malloc(size * sizeof(int16));
+   if (NULL == ring->buf)
+   {
+      free(ring);
+      return NULL;
+   }
+
+   ring->size = size;
+   ring->mask = size - 1;
+   ring->target = target;
+   ring->avg_fill = target;
+   ring->stats.min_fill = size;
+
+   return ring;
+}
+
+void sndring_destroy(sndring_t **ring)
+{
+   if (NULL == *ring)
+      return;
+
+   free((*ring)->buf);
+   free(*ring);
+   *ring = NULL;
+}
+
+/* Resamples count samples into the ring, returns how many went in. */
+int sndring_push(sndring_t *ring, const int16 *samples, int count)
+{
+   uint32 head, space, pos, end;
+   int32 fill, adjust, a, b;
+   int i, written = 0;
+
+   if (count <= 0)
+      return 0;
+
+   head = ring->head;
+   fill = (int32) (head - RING_LOAD(ring->tail));
+   space = ring->size - fill;
+
+   /* the output task takes samples in chunks, look past that */
+   ring->avg_fill += (fill - ring->avg_fill) / 8;
+
+   adjust = (ring->avg_fill - ring->target) * SNDRING_MAXADJUST / ring->target;
+   if (adjust > SNDRING_MAXADJUST)
+      adjust = SNDRING_MAXADJUST;
+   else if (adjust < -SNDRING_MAXADJUST)
+      adjust = -SNDRING_MAXADJUST;
+
+   /* linear interpolation, position 0 is the last sample of the previous push */
+   end = (uint32) count << 16;
+   for (pos = ring->phase; pos < end; pos += 0x10000 + adjust)
+   {
+      i = pos >> 16;
+      a = i ? samples[i - 1] : ring->last;
+      b = samples[i];
+
+      if (0 == space)
+      {
+         ring->stats.overruns++;
+         continue;
+      }
+
+      ring->buf[head & ring->mask] = a + (((b - a) * (int32) ((pos & 0xFFFF) >> 1)) >> 15);
+      head++;
+      space--;
+      written++;
+   }
+
+   ring->phase = pos - end;
+   ring->last = samples[count - 1];
+
+   RING_STORE(ring->head, head);
+
+   ring->stats.pushed += count;
+   ring->stats.written += written;
+   ring->stats.adjust = adjust;
+
+   return written;
+}
+
+/* Fills all of samples, returns how many came out of the ring. */
+int sndring_read(sndring_t *ring, int16 *samples, int count)
+{
+   uint32 tail, fill;
+   int i, n;
+
+   tail = ring->tail;
+   fill = RING_LOAD(ring->head) - tail;
+
+   if (fill < ring->stats.min_fill)
+      ring->stats.min_fill = fill;
+   if (fill > ring->stats.max_fill)
+      ring->stats.max_fill = fill;
+
+   n = ((uint32) count < fill) ? count : (int) fill;
+   for (i = 0; i < n; i++)
+      samples[i] = ring->buf[(tail + i) & ring->mask];
+
+   RING_STORE(ring->tail, tail + n);
+
+   if (n)
+      ring->hold = samples[n - 1];
+
+   for (i = n; i < count; i++)
+      samples[i] = ring->hold;
+
+   ring->stats.read += n;
+   ring->stats.underruns += count - n;
+
+   return n;
+}
+
+int sndring_fill(sndring_t *ring)
+{
+   return (int) (RING_LOAD(ring->head) - RING_LOAD(ring->tail));
+}
+
+/* the counters are only updated by their own side, a copy may be a
+** little out of step
+*/
+void sndring_getstats(sndring_t *ring, sndring_stats_t *stats)
+{
+   *stats = ring->stats;
+}
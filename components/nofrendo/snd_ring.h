@@ -0,0 +1,58 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** snd_ring.h
+**
+** Sample ring between the emulator and an audio output task
+*/
+
+#ifndef _SND_RING_H_
+#define _SND_RING_H_
+
+#include <noftypes.h>
+
+/* largest rate adjustment, in 1/65536: about 0.5% */
+#define  SNDRING_MAXADJUST    328
+
+typedef struct sndring_stats_s
+{
+   uint32 pushed;             /* samples handed over by the emulator */
+   uint32 written;            /* samples that went into the ring after resampling */
+   uint32 read;               /* samples taken out by the output task */
+   uint32 overruns;           /* samples dropped, the ring was full */
+   uint32 underruns;          /* samples the output task had to make up */
+   uint32 min_fill, max_fill; /* seen by the output task before each read */
+   int32 adjust;              /* current rate adjustment, in 1/65536 */
+} sndring_stats_t;
+
+typedef struct sndring_s sndring_t;
+
+extern sndring_t *sndring_create(int size, int target);
+extern void sndring_destroy(sndring_t **ring);
+
+/* producer side, never waits */
+extern int sndring_push(sndring_t *ring, const int16 *samples, int count);
+
+/* consumer side, never waits */
+extern int sndring_read(sndring_t *ring, int16 *samples, int count);
+extern int sndring_fill(sndring_t *ring);
+
+extern void sndring_getstats(sndring_t *ring, sndring_stats_t *stats);
+
+#endif /* _SND_RING_H_ */
@@ -27,7 +27,7 @@
 #include <nes_apu.h>
 #include <fds_snd.h>
 
-static int32 fds_incsize = 0;
+static THREAD_LOCAL int32 fds_incsize = 0;
 
 /* mix sound channels together */
 static int32 fds_process(void)
@@ -48,11 +48,12 @@ static void fds_write(uint32 address, uint8 value)
 /* reset state of vrcvi sound channels */
 static void fds_reset(void)
 {
-   apu_t apu;
-
-   apu_getcontext(&apu);
-//   fds_incsize = apu.cycle_rate;
-   fds_incsize = (int32) (APU_BASEFREQ * 65536.0 / (float) apu.sample_rate);
+   /* 16.16 CPU cycles per sample */
+#ifdef APU_FIXEDPOINT
+   fds_incsize = apu_getcontextptr()->cycle_rate;
+#else /* !APU_FIXEDPOINT */
+   fds_incsize = (int32) (apu_getcontextptr()->cycle_rate * 65536.0);
+#endif /* !APU_FIXEDPOINT */
 }
 
 static apu_memwrite fds_memwrite[] =
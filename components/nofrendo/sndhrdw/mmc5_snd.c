@@ -34,8 +34,8 @@
 #define  APU_VOLUME_DECAY(x)  ((x) -= ((x) >> 7))
 
 /* look up table madness */
-static int32 decay_lut[16];
-static int vbl_lut[32];
+static THREAD_LOCAL int32 decay_lut[16];
+static THREAD_LOCAL int vbl_lut[32];
 
 /* various sound constants for sound emulation */
 /* vblank length table used for rectangles, triangle, noise */
@@ -71,7 +71,7 @@ typedef struct mmc5rectangle_s
 
    bool enabled;
    
-   float accum;
+   apuaccum_t accum;
    int32 freq;
    int32 output_vol;
    bool fixed_envelope;
@@ -94,9 +94,9 @@ typedef struct mmc5dac_s
 } mmc5dac_t;
 
 
-static struct
+static THREAD_LOCAL struct
 {
-   float incsize;
+   apuaccum_t incsize;
    uint8 mul[2];
    mmc5rectangle_t rect[2];
    mmc5dac_t dac;
@@ -158,7 +158,7 @@ static int32 mmc5_rectangle(mmc5rectangle_t *chan)
 
    while (chan->accum < 0)
    {
-      chan->accum += chan->freq;
+      chan->accum += APU_TO_FIXED(chan->freq);
       chan->adder = (chan->adder + 1) & 0x0F;
 
 #ifdef APU_OVERSAMPLE
@@ -322,12 +322,9 @@ static void mmc5_write(uint32 address, uint8 value)
 static void mmc5_reset(void)
 {
    int i;
-   apu_t apu;
-
 
    /* get the phase period from the apu */
-   apu_getcontext(&apu);
-   mmc5.incsize = apu.cycle_rate;
+   mmc5.incsize = apu_getcontextptr()->cycle_rate;
 
    for (i = 0x5000; i < 0x5008; i++)
       mmc5_write(i, 0);
@@ -339,10 +336,8 @@ static void mmc5_reset(void)
 static int mmc5_init(void)
 {
    int i, num_samples;
-   apu_t apu;
 
-   apu_getcontext(&apu);
-   num_samples = apu.num_samples;
+   num_samples = apu_getcontextptr()->num_samples;
 
    /* lut used for enveloping and frequency sweeps */
    for (i = 0; i < 16; i++)
@@ -24,9 +24,12 @@
 */
 
 #include <string.h>
+#include <stdint.h>
 #include <noftypes.h>
 #include <log.h>
+#include <nes_clock.h>
 #include <nes_apu.h>
+#include <prof.h>
 #include "nes6502.h"
  
 
@@ -42,17 +45,17 @@
 #define  APU_DMC_OUTPUT                ((apu.dmc.output_vol + apu.dmc.output_vol + apu.dmc.output_vol) >> 2)
 
 /* active APU */
-static apu_t apu;
+static THREAD_LOCAL apu_t apu;
 
 /* look up table madness */
-static int32 decay_lut[16];
-static int vbl_lut[32];
-static int trilength_lut[128];
+static THREAD_LOCAL int32 decay_lut[16];
+static THREAD_LOCAL int vbl_lut[32];
+static THREAD_LOCAL int trilength_lut[128];
 
 /* noise lookups for both modes */
 #ifndef REALTIME_NOISE
-static int8 noise_long_lut[APU_NOISE_32K];
-static int8 noise_short_lut[APU_NOISE_93];
+static THREAD_LOCAL int8 noise_long_lut[APU_NOISE_32K];
+static THREAD_LOCAL int8 noise_short_lut[APU_NOISE_93];
 #endif /* !REALTIME_NOISE */
 
 
@@ -111,6 +114,11 @@ void apu_getcontext(apu_t *dest_apu)
    *dest_apu = apu;
 }
 
+apu_t *apu_getcontextptr(void)
+{
+   return &apu;
+}
+
 void apu_setchan(int chan, bool enabled)
 {
    if (enabled)
@@ -123,10 +131,11 @@ void apu_setchan(int chan, bool enabled)
 ** NES uses to generate pseudo-random series
 ** for the white noise channel
 */
+static THREAD_LOCAL int sreg = 0x4000;
+
 #ifdef REALTIME_NOISE
 INLINE int8 shift_register15(uint8 xor_tap)
 {
-   static int sreg = 0x4000;
    int bit0, tap, bit14;
 
    bit0 = sreg & 1;
@@ -139,7 +148,6 @@ INLINE int8 shift_register15(uint8 xor_tap)
 #else /* !REALTIME_NOISE */
 static void shift_register15(int8 *buf, int count)
 {
-   static int sreg = 0x4000;
    int bit0, bit1, bit6, bit14;
 
    if (count == APU_NOISE_93)
@@ -246,7 +254,7 @@ static int32 apu_rectangle_##ch(void) \
 \
    while (apu.rectangle[ch].accum < 0) \
    { \
-      apu.rectangle[ch].accum += apu.rectangle[ch].freq + 1; \
+      apu.rectangle[ch].accum += APU_TO_FIXED(apu.rectangle[ch].freq + 1); \
       apu.rectangle[ch].adder = (apu.rectangle[ch].adder + 1) & 0x0F; \
 \
       if (apu.rectangle[ch].adder < apu.rectangle[ch].duty_flip) \
@@ -320,7 +328,7 @@ static int32 apu_rectangle_##ch(void) \
 \
    while (apu.rectangle[ch].accum < 0) \
    { \
-      apu.rectangle[ch].accum += (apu.rectangle[ch].freq + 1); \
+      apu.rectangle[ch].accum += APU_TO_FIXED(apu.rectangle[ch].freq + 1); \
       apu.rectangle[ch].adder = (apu.rectangle[ch].adder + 1) & 0x0F; \
    } \
 \
@@ -376,7 +384,7 @@ static int32 apu_triangle(void)
    apu.triangle.accum -= apu.cycle_rate; \
    while (apu.triangle.accum < 0)
    {
-      apu.triangle.accum += apu.triangle.freq;
+      apu.triangle.accum += APU_TO_FIXED(apu.triangle.freq);
       apu.triangle.adder = (apu.triangle.adder + 1) & 0x1F;
 
       if (apu.triangle.adder & 0x10)
@@ -445,7 +453,7 @@ static int32 apu_noise(void)
 
    while (apu.noise.accum < 0)
    {
-      apu.noise.accum += apu.noise.freq;
+      apu.noise.accum += APU_TO_FIXED(apu.noise.freq);
 
 #ifdef REALTIME_NOISE
 
@@ -529,10 +537,74 @@ INLINE void apu_dmcreload(void)
 ** reg2: 8 bits of 64-byte aligned address offset : $C000 + (value * 64)
 ** reg3: length, (value * 16) + 1
 */
-static int32 apu_dmc(void)
+/* one output bit, false once a sample that doesn't loop has ended */
+INLINE bool apu_dmcclock(void)
 {
    int delta_bit;
 
+   delta_bit = (apu.dmc.dma_length & 7) ^ 7;
+   
+   if (7 == delta_bit)
+   {
+      apu.dmc.cur_byte = nes6502_getbyte(apu.dmc.address);
+      
+      /* steal a cycle from CPU*/
+      nes6502_burn(1);
+
+      /* prevent wraparound */
+      if (0xFFFF == apu.dmc.address)
+         apu.dmc.address = 0x8000;
+      else
+         apu.dmc.address++;
+   }
+
+   if (--apu.dmc.dma_length == 0)
+   {
+      /* if loop bit set, we're cool to retrigger sample */
+      if (apu.dmc.looping)
+      {
+         apu_dmcreload();
+      }
+      else
+      {
+         /* check to see if we should generate an irq */
+         if (apu.dmc.irq_gen)
+         {
+            apu.dmc.irq_occurred = true;
+            if (apu.irq_callback)
+               apu.irq_callback();
+         }
+
+         /* bodge for timestamp queue */
+         apu.dmc.enabled = false;
+         return false;
+      }
+   }
+
+   /* positive delta */
+   if (apu.dmc.cur_byte & (1 << delta_bit))
+   {
+      if (apu.dmc.regs[1] < 0x7D)
+      {
+         apu.dmc.regs[1] += 2;
+         apu.dmc.output_vol += (2 << 8);
+      }
+   }
+   /* negative delta */
+   else            
+   {
+      if (apu.dmc.regs[1] > 1)
+      {
+         apu.dmc.regs[1] -= 2;
+         apu.dmc.output_vol -= (2 << 8);
+      }
+   }
+
+   return true;
+}
+
+static int32 apu_dmc(void)
+{
    APU_VOLUME_DECAY(apu.dmc.output_vol);
 
    /* only process when channel is alive */
@@ -542,65 +614,10 @@ static int32 apu_dmc(void)
       
       while (apu.dmc.accum < 0)
       {
-         apu.dmc.accum += apu.dmc.freq;
-         
-         delta_bit = (apu.dmc.dma_length & 7) ^ 7;
+         apu.dmc.accum += APU_TO_FIXED(apu.dmc.freq);
          
-         if (7 == delta_bit)
-         {
-            apu.dmc.cur_byte = nes6502_getbyte(apu.dmc.address);
-            
-            /* steal a cycle from CPU*/
-            nes6502_burn(1);
-
-            /* prevent wraparound */
-            if (0xFFFF == apu.dmc.address)
-               apu.dmc.address = 0x8000;
-            else
-               apu.dmc.address++;
-         }
-
-         if (--apu.dmc.dma_length == 0)
-         {
-            /* if loop bit set, we're cool to retrigger sample */
-            if (apu.dmc.looping)
-            {
-               apu_dmcreload();
-            }
-            else
-            {
-               /* check to see if we should generate an irq */
-               if (apu.dmc.irq_gen)
-               {
-                  apu.dmc.irq_occurred = true;
-                  if (apu.irq_callback)
-                     apu.irq_callback();
-               }
-
-               /* bodge for timestamp queue */
-               apu.dmc.enabled = false;
-               break;
-            }
-         }
-
-         /* positive delta */
-         if (apu.dmc.cur_byte & (1 << delta_bit))
-         {
-            if (apu.dmc.regs[1] < 0x7D)
-            {
-               apu.dmc.regs[1] += 2;
-               apu.dmc.output_vol += (2 << 8);
-            }
-         }
-         /* negative delta */
-         else            
-         {
-            if (apu.dmc.regs[1] > 1)
-            {
-               apu.dmc.regs[1] -= 2;
-               apu.dmc.output_vol -= (2 << 8);
-            }
-         }
+         if (false == apu_dmcclock())
+            break;
       }
    }
 
@@ -608,7 +625,8 @@ static int32 apu_dmc(void)
 }
 
 
-void apu_write(uint32 address, uint8 value)
+/* apply a register write to the channels */
+static void apu_regwrite(uint32 address, uint8 value)
 {  
    int chan;
 
@@ -684,7 +702,7 @@ void apu_write(uint32 address, uint8 value)
       ** for the 6502 code to do a couple of table dereferences and load up 
       ** the other triregs
       */
-      apu.triangle.write_latency = (int) (228 / apu.cycle_rate);
+      apu.triangle.write_latency = (int) (APU_TO_FIXED(228) / apu.cycle_rate);
       apu.triangle.freq = (((value & 7) << 8) + apu.triangle.regs[1]) + 1;
       apu.triangle.vbl_length = vbl_lut[value >> 3];
       apu.triangle.counter_started = false;
@@ -824,6 +842,139 @@ void apu_write(uint32 address, uint8 value)
    }
 }
 
+/*
+** write queue
+*/
+INLINE bool apu_qempty(void)
+{
+   return (apu.q_head == apu.q_tail);
+}
+
+static void apu_dequeue(void)
+{
+   apudata_t *d = &apu.queue[apu.q_tail];
+
+   apu.q_tail = (apu.q_tail + 1) & APUQUEUE_MASK;
+   apu_regwrite(d->address, d->value);
+}
+
+static void apu_flushqueue(void)
+{
+   while (false == apu_qempty())
+      apu_dequeue();
+}
+
+/* take the $4015 status over from the channels, once every queued
+** write has reached them
+*/
+static void apu_syncstatus(void)
+{
+   if (false == apu_qempty())
+      return;
+
+   apu.status_enable = (apu.rectangle[0].enabled ? 0x01 : 0)
+                       | (apu.rectangle[1].enabled ? 0x02 : 0)
+                       | (apu.triangle.enabled ? 0x04 : 0)
+                       | (apu.noise.enabled ? 0x08 : 0)
+                       | (apu.dmc.enabled ? 0x10 : 0);
+   apu.status_length = (apu.rectangle[0].vbl_length ? 0x01 : 0)
+                       | (apu.rectangle[1].vbl_length ? 0x02 : 0)
+                       | (apu.triangle.vbl_length ? 0x04 : 0)
+                       | (apu.noise.vbl_length ? 0x08 : 0)
+                       | 0x10;
+   apu.status_irq = apu.dmc.irq_occurred;
+}
+
+/* the part of a write $4015 reads can see, applied as it happens */
+static void apu_writestatus(uint32 address, uint8 value)
+{
+   switch (address)
+   {
+   case APU_WRA3:
+   case APU_WRB3:
+   case APU_WRC3:
+   case APU_WRD3:
+      /* length counter loaded, never with 0 */
+      apu.status_length |= 1 << ((address >> 2) & 3);
+      break;
+
+   case APU_WRE0:
+      if (0 == (value & 0x80))
+         apu.status_irq = false;
+      break;
+
+   case APU_SMASK:
+      apu.status_enable = value & 0x1F;
+      /* disabling a channel clears its length counter */
+      apu.status_length &= (value | 0x10);
+      apu.status_irq = false;
+      break;
+
+   default:
+      break;
+   }
+}
+
+/* Writes from the CPU are only stamped and queued here, apu_process()
+** applies them once it renders the sample they fall on.
+*/
+void apu_write(uint32 address, uint8 value)
+{
+   apudata_t *d;
+
+   /* these don't change anything, but get hit in some mem-clear loops */
+   if (0x4009 == address || 0x400D == address)
+      return;
+
+   apu_writestatus(address, value);
+
+   /* full: the oldest write can't wait any longer */
+   if (((apu.q_head + 1) & APUQUEUE_MASK) == apu.q_tail)
+      apu_dequeue();
+
+   d = &apu.queue[apu.q_head];
+   d->timestamp = nes6502_getcycles(false);
+   d->address = (uint16) address;
+   d->value = value;
+   apu.q_head = (apu.q_head + 1) & APUQUEUE_MASK;
+}
+
+/* The CPU has run on since the last call: its cycles get spread over
+** the next frame's worth of samples.  Anything still queued from before
+** is overdue and goes out with the first sample.
+*/
+static void apu_startspan(uint32 now)
+{
+   uint32 span = now - apu.span_end;
+
+   apu.elapsed_cycles = apu.span_end;
+   apu.span_end = now;
+   apu.span_step = span / apu.num_samples;
+   apu.span_rem = span % apu.num_samples;
+   apu.span_err = 0;
+   apu.span_pos = 0;
+}
+
+/* apply the writes up to the end of the next sample */
+INLINE void apu_replay(void)
+{
+   apu.elapsed_cycles += apu.span_step;
+   apu.span_err += apu.span_rem;
+   if (apu.span_err >= (uint32) apu.num_samples)
+   {
+      apu.span_err -= apu.num_samples;
+      apu.elapsed_cycles++;
+   }
+
+   /* asked for more than a frame: hold at the end */
+   if ((int32) (apu.elapsed_cycles - apu.span_end) > 0)
+      apu.elapsed_cycles = apu.span_end;
+
+   while (false == apu_qempty()
+          && (int32) (apu.queue[apu.q_tail].timestamp - apu.elapsed_cycles) <= 0)
+      apu_dequeue();
+}
+
 /* Read from $4000-$4017 */
 uint8 apu_read(uint32 address)
 {
@@ -832,22 +983,10 @@ uint8 apu_read(uint32 address)
    switch (address)
    {
    case APU_SMASK:
-      value = 0;
       /* Return 1 in 0-5 bit pos if a channel is playing */
-      if (apu.rectangle[0].enabled && apu.rectangle[0].vbl_length)
-         value |= 0x01;
-      if (apu.rectangle[1].enabled && apu.rectangle[1].vbl_length)
-         value |= 0x02;
-      if (apu.triangle.enabled && apu.triangle.vbl_length)
-         value |= 0x04;
-      if (apu.noise.enabled && apu.noise.vbl_length)
-         value |= 0x08;
-
-      /* bodge for timestamp queue */
-      if (apu.dmc.enabled)
-         value |= 0x10;
+      value = apu.status_enable & apu.status_length;
 
-      if (apu.dmc.irq_occurred)
+      if (apu.status_irq)
          value |= 0x80;
 
       if (apu.irqclear_callback)
@@ -863,6 +1002,473 @@ uint8 apu_read(uint32 address)
    return value;
 }
 
+/*
+** Band-limited step synthesis
+**
+** Instead of stepping every channel once per output sample, each channel
+** is run from one event (register write, quarter frame tick) to the next
+** and only puts the changes of its output level into a buffer, at the
+** time they happen.  A change lands as a short band-limited step, so
+** there is no aliasing, and all of them are summed up in one pass when
+** the samples are read out.  Channels that don't change cost nothing.
+**
+** Times are in samples with BLEP_FRACBITS bits of fraction, counted from
+** the start of the stretch being rendered.
+*/
+#define  BLEP_FRACBITS     20
+#define  BLEP_PHASEBITS    5
+#define  BLEP_PHASES       (1 << BLEP_PHASEBITS)
+#define  BLEP_TAPS         8
+#define  BLEP_KERNELBITS   12          /* every kernel row adds up to this */
+#define  BLEP_MAXSAMPLES   1024        /* longest stretch rendered at once */
+
+/* level steps of the triangle, as APU_TRIANGLE_OUTPUT scales them */
+#define  BLEP_TRIANGLE_STEP   ((2 << 8) + ((2 << 8) >> 2))
+#define  BLEP_DMC_LEVEL       ((((int32) apu.dmc.regs[1] << 8) * 3) >> 2)
+
+/* Blackman windowed sinc, cut off at 0.9 of nyquist, one row per
+** fraction of a sample the step lands on
+*/
+static const int16 blep_kernel[BLEP_PHASES][BLEP_TAPS] =
+{
+   {    -2,    63,  -430,  2417,  2417,  -430,    63,    -2 },
+   {    -3,    65,  -427,  2279,  2551,  -428,    61,    -2 },
+   {    -2,    65,  -420,  2138,  2681,  -422,    58,    -2 },
+   {    -2,    64,  -410,  1996,  2806,  -410,    54,    -2 },
+   {    -2,    63,  -397,  1852,  2926,  -393,    48,    -1 },
+   {    -2,    61,  -381,  1708,  3040,  -371,    41,     0 },
+   {    -2,    59,  -363,  1565,  3146,  -342,    32,     1 },
+   {    -1,    56,  -343,  1424,  3243,  -308,    23,     2 },
+   {    -1,    53,  -321,  1284,  3333,  -266,    11,     3 },
+   {    -1,    49,  -298,  1147,  3413,  -218,    -1,     5 },
+   {    -1,    46,  -275,  1013,  3485,  -163,   -16,     7 },
+   {     0,    42,  -250,   884,  3545,  -102,   -32,     9 },
+   {     0,    38,  -226,   758,  3597,   -33,   -49,    11 },
+   {     0,    34,  -201,   638,  3635,    43,   -67,    14 },
+   {     0,    31,  -177,   523,  3663,   126,   -87,    17 },
+   {     0,    27,  -153,   414,  3681,   215,  -108,    20 },
+   {     0,    23,  -130,   312,  3686,   312,  -130,    23 },
+   {     0,    20,  -108,   215,  3681,   414,  -153,    27 },
+   {     0,    17,   -87,   126,  3663,   523,  -177,    31 },
+   {     0,    14,   -67,    43,  3635,   638,  -201,    34 },
+   {     0,    11,   -49,   -33,  3597,   758,  -226,    38 },
+   {     0,     9,   -32,  -102,  3546,   883,  -250,    42 },
+   {     0,     7,   -16,  -163,  3484,  1013,  -275,    46 },
+   {     0,     5,    -1,  -218,  3412,  1147,  -298,    49 },
+   {     0,     3,    11,  -266,  3332,  1284,  -321,    53 },
+   {     0,     2,    23,  -307,  3242,  1423,  -343,    56 },
+   {     0,     1,    32,  -342,  3144,  1565,  -363,    59 },
+   {     0,     0,    41,  -371,  3038,  1708,  -381,    61 },
+   {     0,    -1,    48,  -393,  2925,  1851,  -397,    63 },
+   {     0,    -2,    54,  -410,  2806,  1994,  -410,    64 },
+   {     0,    -2,    58,  -421,  2679,  2137,  -420,    65 },
+   {     0,    -2,    61,  -428,  2550,  2277,  -427,    65 },
+};
+
+typedef struct blepchan_s
+{
+   int32 level;               /* output level last put into the buffer */
+   uint32 timer;              /* time to the next step of the channel */
+   bool high;                 /* noise output bit */
+} blepchan_t;
+
+typedef struct blep_s
+{
+   int32 buf[BLEP_MAXSAMPLES + BLEP_TAPS];
+   int32 accum;               /* sum of everything read out so far */
+   uint32 cycle;              /* length of a CPU cycle */
+   blepchan_t chan[5];
+   int tick_left;             /* samples to the next quarter frame */
+   int tick_err;
+} blep_t;
+
+static THREAD_LOCAL blep_t blep;
+
+static void blep_reset(void)
+{
+   uint32 cycle = blep.cycle;
+
+   memset(&blep, 0, sizeof(blep));
+   blep.cycle = cycle;
+}
+
+INLINE void blep_delta(uint32 time, int32 delta)
+{
+   const int16 *kernel = blep_kernel[(time >> (BLEP_FRACBITS - BLEP_PHASEBITS)) & (BLEP_PHASES - 1)];
+   int32 *out = &blep.buf[time >> BLEP_FRACBITS];
+   int i;
+
+   for (i = 0; i < BLEP_TAPS; i++)
+      out[i] += kernel[i] * delta;
+}
+
+INLINE void blep_level(blepchan_t *chan, uint32 time, int32 level)
+{
+   if (level != chan->level)
+   {
+      blep_delta(time, level - chan->level);
+      chan->level = level;
+   }
+}
+
+/* Length counters, envelopes and sweeps are counted in samples, just as
+** the per-sample engine counts them.  Here they are stepped four times a
+** frame, by the samples since the last time.
+*/
+static void blep_tick(int samples)
+{
+   rectangle_t *rect;
+   int ch;
+
+   for (ch = 0; ch < 2; ch++)
+   {
+      rect = &apu.rectangle[ch];
+      if (false == rect->enabled || 0 == rect->vbl_length)
+         continue;
+
+      if (false == rect->holdnote)
+      {
+         rect->vbl_length -= samples;
+         if (rect->vbl_length < 0)
+            rect->vbl_length = 0;
+      }
+
+      rect->env_phase -= 4 * samples;
+      while (rect->env_phase < 0)
+      {
+         rect->env_phase += rect->env_delay;
+
+         if (rect->holdnote)
+            rect->env_vol = (rect->env_vol + 1) & 0x0F;
+         else if (rect->env_vol < 0x0F)
+            rect->env_vol++;
+      }
+
+      if (rect->freq < 8 || (false == rect->sweep_inc && rect->freq > rect->freq_limit))
+         continue;
+
+      if (rect->sweep_on && rect->sweep_shifts)
+      {
+         rect->sweep_phase -= 2 * samples;
+         while (rect->sweep_phase < 0)
+         {
+            rect->sweep_phase += rect->sweep_delay;
+
+            if (rect->sweep_inc) /* ramp up */
+            {
+               if (0 == ch)
+                  rect->freq += ~(rect->freq >> rect->sweep_shifts);
+               else
+                  rect->freq -= (rect->freq >> rect->sweep_shifts);
+            }
+            else /* ramp down */
+            {
+               rect->freq += (rect->freq >> rect->sweep_shifts);
+            }
+         }
+      }
+   }
+
+   if (apu.triangle.enabled && apu.triangle.vbl_length)
+   {
+      if (apu.triangle.counter_started)
+      {
+         apu.triangle.linear_length -= samples;
+         if (apu.triangle.linear_length < 0)
+            apu.triangle.linear_length = 0;
+
+         if (false == apu.triangle.holdnote)
+         {
+            apu.triangle.vbl_length -= samples;
+            if (apu.triangle.vbl_length < 0)
+               apu.triangle.vbl_length = 0;
+         }
+      }
+      else if (false == apu.triangle.holdnote && apu.triangle.write_latency)
+      {
+         apu.triangle.write_latency -= samples;
+         if (apu.triangle.write_latency <= 0)
+         {
+            apu.triangle.write_latency = 0;
+            apu.triangle.counter_started = true;
+         }
+      }
+   }
+
+   if (apu.noise.enabled && apu.noise.vbl_length)
+   {
+      if (false == apu.noise.holdnote)
+      {
+         apu.noise.vbl_length -= samples;
+         if (apu.noise.vbl_length < 0)
+            apu.noise.vbl_length = 0;
+      }
+
+      apu.noise.env_phase -= 4 * samples;
+      while (apu.noise.env_phase < 0)
+      {
+         apu.noise.env_phase += apu.noise.env_delay;
+
+         if (apu.noise.holdnote)
+            apu.noise.env_vol = (apu.noise.env_vol + 1) & 0x0F;
+         else if (apu.noise.env_vol < 0x0F)
+            apu.noise.env_vol++;
+      }
+   }
+}
+
+static void blep_rectangle(int ch, uint32 start, uint32 end)
+{
+   rectangle_t *rect = &apu.rectangle[ch];
+   blepchan_t *chan = &blep.chan[ch];
+   uint32 time, period;
+   int32 volume;
+   int steps;
+
+   if (false == rect->enabled || 0 == rect->vbl_length || rect->freq < 8
+       || (false == rect->sweep_inc && rect->freq > rect->freq_limit))
+   {
+      blep_level(chan, start, 0);
+      return;
+   }
+
+   if (rect->fixed_envelope)
+      volume = rect->volume << 8; /* fixed volume */
+   else
+      volume = (rect->env_vol ^ 0x0F) << 8;
+
+   blep_level(chan, start, (rect->adder < rect->duty_flip) ? volume : -volume);
+
+   period = (rect->freq + 1) * blep.cycle;
+   time = start + chan->timer;
+
+   /* skip straight to the steps where the duty cycle flips */
+   for (;;)
+   {
+      if (rect->adder < rect->duty_flip)
+         steps = rect->duty_flip - rect->adder;
+      else
+         steps = 16 - rect->adder;
+
+      if (time + (steps - 1) * period >= end)
+         break;
+
+      time += (steps - 1) * period;
+      rect->adder = (rect->adder + steps) & 0x0F;
+      blep_level(chan, time, (rect->adder < rect->duty_flip) ? volume : -volume);
+      time += period;
+   }
+
+   /* steps that don't get to a flip */
+   if (time < end)
+   {
+      steps = (end - time - 1) / period + 1;
+      rect->adder = (rect->adder + steps) & 0x0F;
+      time += steps * period;
+   }
+
+   chan->timer = time - end;
+}
+
+static void blep_triangle(uint32 start, uint32 end)
+{
+   blepchan_t *chan = &blep.chan[2];
+   uint32 time, period;
+
+   /* holds its level while silent, like the real one */
+   if (false == apu.triangle.enabled || 0 == apu.triangle.vbl_length
+       || 0 == apu.triangle.linear_length || apu.triangle.freq < 4)
+      return;
+
+   period = apu.triangle.freq * blep.cycle;
+
+   for (time = start + chan->timer; time < end; time += period)
+   {
+      apu.triangle.adder = (apu.triangle.adder + 1) & 0x1F;
+
+      if (apu.triangle.adder & 0x10)
+         blep_delta(time, -BLEP_TRIANGLE_STEP);
+      else
+         blep_delta(time, BLEP_TRIANGLE_STEP);
+   }
+
+   chan->timer = time - end;
+}
+
+static void blep_noise(uint32 start, uint32 end)
+{
+   blepchan_t *chan = &blep.chan[3];
+   uint32 time, period;
+   int32 volume;
+
+   if (false == apu.noise.enabled || 0 == apu.noise.vbl_length)
+   {
+      blep_level(chan, start, 0);
+      return;
+   }
+
+   if (apu.noise.fixed_envelope)
+      volume = apu.noise.volume << 8; /* fixed volume */
+   else
+      volume = (apu.noise.env_vol ^ 0x0F) << 8;
+
+   blep_level(chan, start, chan->high ? volume : -volume);
+
+   period = apu.noise.freq * blep.cycle;
+
+   for (time = start + chan->timer; time < end; time += period)
+   {
+#ifdef REALTIME_NOISE
+      chan->high = shift_register15(apu.noise.xor_tap) ? true : false;
+#else /* !REALTIME_NOISE */
+      apu.noise.cur_pos++;
+
+      if (apu.noise.short_sample)
+      {
+         if (APU_NOISE_93 == apu.noise.cur_pos)
+            apu.noise.cur_pos = 0;
+         chan->high = noise_short_lut[apu.noise.cur_pos] ? true : false;
+      }
+      else
+      {
+         if (APU_NOISE_32K == apu.noise.cur_pos)
+            apu.noise.cur_pos = 0;
+         chan->high = noise_long_lut[apu.noise.cur_pos] ? true : false;
+      }
+#endif /* !REALTIME_NOISE */
+
+      blep_level(chan, time, chan->high ? volume : -volume);
+   }
+
+   chan->timer = time - end;
+}
+
+static void blep_dmc(uint32 start, uint32 end)
+{
+   blepchan_t *chan = &blep.chan[4];
+   uint32 time, period;
+
+   /* picks up $4011 writes too */
+   blep_level(chan, start, BLEP_DMC_LEVEL);
+
+   if (0 == apu.dmc.dma_length)
+      return;
+
+   period = apu.dmc.freq * blep.cycle;
+
+   for (time = start + chan->timer; time < end; time += period)
+   {
+      if (false == apu_dmcclock())
+      {
+         time = end;
+         break;
+      }
+
+      blep_level(chan, time, BLEP_DMC_LEVEL);
+   }
+
+   chan->timer = time - end;
+}
+
+static void blep_run(uint32 start, uint32 end)
+{
+   int ch;
+
+   for (ch = 0; ch < 2; ch++)
+   {
+      if (apu.mix_enable & (1 << ch))
+         blep_rectangle(ch, start, end);
+      else
+         blep_level(&blep.chan[ch], start, 0);
+   }
+
+   if (apu.mix_enable & 0x04)
+      blep_triangle(start, end);
+
+   if (apu.mix_enable & 0x08)
+      blep_noise(start, end);
+   else
+      blep_level(&blep.chan[3], start, 0);
+
+   if (apu.mix_enable & 0x10)
+      blep_dmc(start, end);
+   else
+      blep_level(&blep.chan[4], start, 0);
+}
+
+/* time in the stretch starting at span_pos that a queued write fell on */
+static uint32 blep_writetime(apudata_t *d)
+{
+   uint32 span = apu.span_step * apu.num_samples + apu.span_rem;
+   int32 cycles = (int32) (d->timestamp - (apu.span_end - span));
+   long long time;
+
+   if (0 == span || cycles <= 0)
+      return 0;
+
+   if ((uint32) cycles > span)
+      cycles = span;
+
+   time = ((long long) cycles * apu.num_samples << BLEP_FRACBITS) / span;
+   time -= (long long) apu.span_pos << BLEP_FRACBITS;
+
+   if (time < 0)
+      return 0;
+   if (time > 0x7FFFFFFF)
+      return 0x7FFFFFFF;
+
+   return (uint32) time;
+}
+
+/* run the channels and replay the writes over num_samples samples */
+static void blep_render(int num_samples)
+{
+   uint32 time, next, tick, write;
+   uint32 end = (uint32) num_samples << BLEP_FRACBITS;
+
+   time = 0;
+   while (time < end)
+   {
+      /* writes that are due */
+      write = end;
+      while (false == apu_qempty())
+      {
+         write = blep_writetime(&apu.queue[apu.q_tail]);
+         if (write > time)
+            break;
+
+         apu_dequeue();
+         write = end;
+      }
+
+      tick = (uint32) blep.tick_left << BLEP_FRACBITS;
+
+      next = end;
+      if (write < next)
+         next = write;
+      if (tick < next)
+         next = tick;
+
+      blep_run(time, next);
+      time = next;
+
+      /* quarter frame */
+      if (time == tick)
+      {
+         blep.tick_err += apu.num_samples;
+         blep_tick(blep.tick_err >> 2);
+         blep.tick_left += blep.tick_err >> 2;
+         blep.tick_err &= 3;
+      }
+   }
+
+   blep.tick_left -= num_samples;
+}
+
+/*
+** Output
+*/
+
 #define CLIP_OUTPUT16(out) \
 { \
    /*out <<= 1;*/ \
@@ -872,64 +1478,141 @@ uint8 apu_read(uint32 address)
       out = -0x8000; \
 }
 
-void apu_process(void *buffer, int num_samples)
+/* last sample into the filter */
+static THREAD_LOCAL int32 prev_sample = 0;
+
+/* filter, clip and store a sample, returns where the next one goes */
+INLINE void *apu_output(void *buffer, int32 accum)
 {
-   static int32 prev_sample = 0;
+   int32 next_sample;
 
-   int16 *buf16;
-   uint8 *buf8;
+   /* do any filtering */
+   if (APU_FILTER_NONE != apu.filter_type)
+   {
+      next_sample = accum;
 
-   if (NULL != buffer)
+      if (APU_FILTER_LOWPASS == apu.filter_type)
+      {
+         accum += prev_sample;
+         accum >>= 1;
+      }
+      else
+         accum = (accum + accum + accum + prev_sample) >> 2;
+
+      prev_sample = next_sample;
+   }
+
+   /* do clipping */
+   CLIP_OUTPUT16(accum);
+
+   /* signed 16-bit output, unsigned 8-bit */
+   if (16 == apu.sample_bits)
    {
-      /* bleh */
-      apu.buffer = buffer;
+      *(int16 *) buffer = (int16) accum;
+      return (int16 *) buffer + 1;
+   }
 
-      buf16 = (int16 *) buffer;
-      buf8 = (uint8 *) buffer;
+   *(uint8 *) buffer = (accum >> 8) ^ 0x80;
+   return (uint8 *) buffer + 1;
+}
 
-      while (num_samples--)
+static void *apu_sample_process(void *buffer, int num_samples)
+{
+   while (num_samples--)
+   {
+      int32 accum = 0;
+
+      apu_replay();
+
+      if (apu.mix_enable & 0x01)
+         accum += apu_rectangle_0();
+      if (apu.mix_enable & 0x02)
+         accum += apu_rectangle_1();
+      if (apu.mix_enable & 0x04)
+         accum += apu_triangle();
+      if (apu.mix_enable & 0x08)
+         accum += apu_noise();
+      if (apu.mix_enable & 0x10)
+         accum += apu_dmc();
+      if (apu.ext && (apu.mix_enable & 0x20))
+         accum += apu.ext->process();
+
+      buffer = apu_output(buffer, accum);
+      apu.span_pos++;
+   }
+
+   return buffer;
+}
+
+static void *apu_blep_process(void *buffer, int num_samples)
+{
+   int32 accum;
+   int i, n;
+
+   while (num_samples)
+   {
+      n = num_samples;
+      if (n > BLEP_MAXSAMPLES)
+         n = BLEP_MAXSAMPLES;
+
+      blep_render(n);
+
+      for (i = 0; i < n; i++)
       {
-         int32 next_sample, accum = 0;
-
-         if (apu.mix_enable & 0x01)
-            accum += apu_rectangle_0();
-         if (apu.mix_enable & 0x02)
-            accum += apu_rectangle_1();
-         if (apu.mix_enable & 0x04)
-            accum += apu_triangle();
-         if (apu.mix_enable & 0x08)
-            accum += apu_noise();
-         if (apu.mix_enable & 0x10)
-            accum += apu_dmc();
+         blep.accum += blep.buf[i];
+         accum = blep.accum >> BLEP_KERNELBITS;
+
+         /* same fade towards zero as APU_VOLUME_DECAY */
+         blep.accum -= blep.accum >> 7;
+
+         /* expansion chips aren't band-limited */
          if (apu.ext && (apu.mix_enable & 0x20))
             accum += apu.ext->process();
 
-         /* do any filtering */
-         if (APU_FILTER_NONE != apu.filter_type)
-         {
-            next_sample = accum;
+         buffer = apu_output(buffer, accum);
+      }
 
-            if (APU_FILTER_LOWPASS == apu.filter_type)
-            {
-               accum += prev_sample;
-               accum >>= 1;
-            }
-            else
-               accum = (accum + accum + accum + prev_sample) >> 2;
+      /* the tails of the last steps go to the front */
+      memmove(blep.buf, blep.buf + n, BLEP_TAPS * sizeof(int32));
+      memset(blep.buf + BLEP_TAPS, 0, n * sizeof(int32));
 
-            prev_sample = next_sample;
-         }
+      apu.span_pos += n;
+      num_samples -= n;
+   }
 
-         /* do clipping */
-         CLIP_OUTPUT16(accum);
+   return buffer;
+}
 
-         /* signed 16-bit output, unsigned 8-bit */
-         if (16 == apu.sample_bits)
-            *buf16++ = (int16) accum;
-         else
-            *buf8++ = (accum >> 8) ^ 0x80;
-      }
+void apu_process(void *buffer, int num_samples)
+{
+   uint32 now;
+
+   PROF_BEGIN(PROF_APU);
+
+   /* the ESP32 asks for a frame in several pieces, all at the same cycle */
+   now = nes6502_getcycles(false);
+   if (now != apu.span_end)
+      apu_startspan(now);
+
+   if (NULL != buffer)
+   {
+      /* bleh */
+      apu.buffer = buffer;
+
+      if (APU_SYNTH_BLEP == apu.synth)
+         apu_blep_process(buffer, num_samples);
+      else
+         apu_sample_process(buffer, num_samples);
+   }
+   else
+   {
+      /* nothing to render, don't let the writes pile up */
+      apu_flushqueue();
    }
+
+   apu_syncstatus();
+
+   PROF_END(PROF_APU);
 }
 
 /* set the filter type */
@@ -938,15 +1621,34 @@ void apu_setfilter(int filter_type)
    apu.filter_type = filter_type;
 }
 
+/* switch synthesis engines, the band-limited one starts from silence */
+void apu_setsynth(int synth)
+{
+   if (synth == apu.synth)
+      return;
+
+   apu.synth = synth;
+   blep_reset();
+}
+
 void apu_reset(void)
 {
    uint32 address;
 
+   /* whatever was still queued belongs to the old run */
+   apu.q_head = apu.q_tail = 0;
+   apu.span_end = apu.elapsed_cycles = nes6502_getcycles(false);
+   apu.span_step = apu.span_rem = apu.span_err = 0;
+   apu.span_pos = 0;
+   prev_sample = 0;
+   blep_reset();
+
    /* initialize all channel members */
    for (address = 0x4000; address <= 0x4013; address++)
-      apu_write(address, 0);
+      apu_regwrite(address, 0);
 
-   apu_write(0x4015, 0);
+   apu_regwrite(0x4015, 0);
+   apu_syncstatus();
 
    if (apu.ext && NULL != apu.ext->reset)
       apu.ext->reset();
@@ -975,17 +1677,26 @@ void apu_build_luts(int num_samples)
 #endif /* !REALTIME_NOISE */
 }
 
-void apu_setparams(double base_freq, int sample_rate, int refresh_rate, int sample_bits)
+void apu_setparams(int sample_rate, int refresh_rate, int sample_bits)
 {
+   /* CPU cycles a second, clock / rate; not a whole number */
+   uint64_t clock = NES_MASTER_CLOCK_NUM;
+   uint64_t rate = (uint64_t) sample_rate * NES_MASTER_CLOCK_DEN * NES_CPU_DIVIDER;
+
    apu.sample_rate = sample_rate;
    apu.refresh_rate = refresh_rate;
    apu.sample_bits = sample_bits;
    apu.num_samples = sample_rate / refresh_rate;
-   if (0 == base_freq)
-      apu.base_freq = APU_BASEFREQ;
-   else
-      apu.base_freq = base_freq;
-   apu.cycle_rate = (float) (apu.base_freq / sample_rate);
+#ifdef APU_FIXEDPOINT
+   /* Truncated to 16.16, the oscillators run under 1 ppm slow at
+   ** 22 kHz.  That is all it costs: register writes are placed by
+   ** their CPU cycle stamps, so the two clocks can't drift apart.
+   */
+   apu.cycle_rate = (int32) ((clock << 16) / rate);
+#else /* !APU_FIXEDPOINT */
+   apu.cycle_rate = (float) ((double) clock / rate);
+#endif /* !APU_FIXEDPOINT */
+   blep.cycle = (uint32) (((rate << BLEP_FRACBITS) + clock / 2) / clock);
 
    /* build various lookup tables for apu */
    apu_build_luts(apu.num_samples);
@@ -994,7 +1705,7 @@ void apu_setparams(double base_freq, int sample_rate, int refresh_rate, int samp
 }
 
 /* Initializes emulated sound hardware, creates waveforms/voices */
-apu_t *apu_create(double base_freq, int sample_rate, int refresh_rate, int sample_bits)
+apu_t *apu_create(int sample_rate, int refresh_rate, int sample_bits)
 {
    apu_t *temp_apu;
    int channel;
@@ -1013,9 +1724,14 @@ apu_t *apu_create(double base_freq, int sample_rate, int refresh_rate, int sampl
    temp_apu->irq_callback = NULL;
    temp_apu->irqclear_callback = NULL;
 
+   /* the noise tables get built from here, whatever ran on this
+   ** thread before
+   */
+   sreg = 0x4000;
+
    apu_setcontext(temp_apu);
 
-   apu_setparams(base_freq, sample_rate, refresh_rate, sample_bits);
+   apu_setparams(sample_rate, refresh_rate, sample_bits);
 
    for (channel = 0; channel < 6; channel++)
       apu_setchan(channel, true);
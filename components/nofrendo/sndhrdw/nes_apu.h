@@ -30,6 +30,22 @@
 /* define this for realtime generated noise */
 #define  REALTIME_NOISE
 
+/* Channel accumulators are 16.16 fixed point, so the same register
+** writes give the same samples on every host.  Build with APU_FLOAT
+** for float accumulators instead.
+*/
+#ifndef APU_FLOAT
+#define  APU_FIXEDPOINT
+#endif /* !APU_FLOAT */
+
+#ifdef APU_FIXEDPOINT
+typedef int32 apuaccum_t;
+#define  APU_TO_FIXED(x)   ((x) << 16)
+#else /* !APU_FIXEDPOINT */
+typedef float apuaccum_t;
+#define  APU_TO_FIXED(x)   (x)
+#endif /* !APU_FIXEDPOINT */
+
 #define  APU_WRA0       0x4000
 #define  APU_WRA1       0x4001
 #define  APU_WRA2       0x4002
@@ -55,7 +71,11 @@
 #define  APU_NOISE_32K  0x7FFF
 #define  APU_NOISE_93   93
 
-#define  APU_BASEFREQ   1789772.7272727272727272
+/* register writes held back until the sample they land on is rendered,
+** must be a power of 2
+*/
+#define  APUQUEUE_SIZE  256
+#define  APUQUEUE_MASK  (APUQUEUE_SIZE - 1)
 
 
 /* channel structures */
@@ -69,7 +89,7 @@ typedef struct rectangle_s
 
    bool enabled;
    
-   float accum;
+   apuaccum_t accum;
    int32 freq;
    int32 output_vol;
    bool fixed_envelope;
@@ -100,7 +120,7 @@ typedef struct triangle_s
 
    bool enabled;
 
-   float accum;
+   apuaccum_t accum;
    int32 freq;
    int32 output_vol;
 
@@ -122,7 +142,7 @@ typedef struct noise_s
 
    bool enabled;
 
-   float accum;
+   apuaccum_t accum;
    int32 freq;
    int32 output_vol;
 
@@ -151,7 +171,7 @@ typedef struct dmc_s
    /* bodge for timestamp queue */
    bool enabled;
    
-   float accum;
+   apuaccum_t accum;
    int32 freq;
    int32 output_vol;
 
@@ -174,6 +194,21 @@ enum
    APU_FILTER_WEIGHTED
 };
 
+/* synthesis engines */
+enum
+{
+   APU_SYNTH_SAMPLE,          /* channels stepped once per output sample */
+   APU_SYNTH_BLEP             /* band-limited steps at the waveform edges */
+};
+
+/* a register write, stamped with the CPU cycle it happened on */
+typedef struct apudata_s
+{
+   uint32 timestamp;
+   uint16 address;
+   uint8 value;
+} apudata_t;
+
 typedef struct
 {
    uint32 min_range, max_range;
@@ -211,14 +246,33 @@ typedef struct apu_s
 
    uint8 mix_enable;
    int filter_type;
+   int synth;
 
-   double base_freq;
-   float cycle_rate;
+   apuaccum_t cycle_rate;   /* CPU cycles per sample */
 
    int sample_rate;
    int sample_bits;
    int refresh_rate;
 
+   /* write queue, replayed by apu_process() */
+   apudata_t queue[APUQUEUE_SIZE];
+   int q_head, q_tail;
+
+   /* the CPU cycles run since the last apu_process() are spread evenly
+   ** over a frame's worth of samples
+   */
+   uint32 elapsed_cycles;  /* writes up to here have been applied */
+   uint32 span_end;        /* CPU cycle count at the last apu_process() */
+   uint32 span_step, span_rem, span_err;
+   int span_pos;           /* samples rendered in this span */
+
+   /* what $4015 reads see: writes show up here right away, in the
+   ** channels only once apu_process() gets to them
+   */
+   uint8 status_enable;    /* channels enabled in $4015 */
+   uint8 status_length;    /* channels with a length counter running */
+   bool status_irq;        /* DMC irq pending */
+
    void (*process)(void *buffer, int num_samples);
    void (*irq_callback)(void);
    uint8 (*irqclear_callback)(void);
@@ -235,9 +289,10 @@ extern "C" {
 /* Function prototypes */
 extern void apu_setcontext(apu_t *src_apu);
 extern void apu_getcontext(apu_t *dest_apu);
+extern apu_t *apu_getcontextptr(void);
 
-extern void apu_setparams(double base_freq, int sample_rate, int refresh_rate, int sample_bits);
-extern apu_t *apu_create(double base_freq, int sample_rate, int refresh_rate, int sample_bits);
+extern void apu_setparams(int sample_rate, int refresh_rate, int sample_bits);
+extern apu_t *apu_create(int sample_rate, int refresh_rate, int sample_bits);
 extern void apu_destroy(apu_t **apu);
 
 extern void apu_process(void *buffer, int num_samples);
@@ -245,6 +300,7 @@ extern void apu_reset(void);
 
 extern void apu_setext(apu_t *apu, apuext_t *ext);
 extern void apu_setfilter(int filter_type);
+extern void apu_setsynth(int synth);
 extern void apu_setchan(int chan, bool enabled);
 
 extern uint8 apu_read(uint32 address);
@@ -33,7 +33,7 @@ typedef struct vrcvirectangle_s
 
    uint8 reg[3];
    
-   float accum;
+   apuaccum_t accum;
    uint8 adder;
 
    int32 freq;
@@ -47,7 +47,7 @@ typedef struct vrcvisawtooth_s
    
    uint8 reg[3];
    
-   float accum;
+   apuaccum_t accum;
    uint8 adder;
    uint8 output_acc;
 
@@ -59,11 +59,11 @@ typedef struct vrcvisnd_s
 {
    vrcvirectangle_t rectangle[2];
    vrcvisawtooth_t saw;
-   float incsize;
+   apuaccum_t incsize;
 } vrcvisnd_t;
 
 
-static vrcvisnd_t vrcvi;
+static THREAD_LOCAL vrcvisnd_t vrcvi;
 
 /* VRCVI rectangle wave generation */
 static int32 vrcvi_rectangle(vrcvirectangle_t *chan)
@@ -76,7 +76,7 @@ static int32 vrcvi_rectangle(vrcvirectangle_t *chan)
    chan->accum -= vrcvi.incsize; /* # of clocks per wave cycle */
    while (chan->accum < 0)
    {
-      chan->accum += chan->freq;
+      chan->accum += APU_TO_FIXED(chan->freq);
       chan->adder = (chan->adder + 1) & 0x0F;
    }
 
@@ -101,7 +101,7 @@ static int32 vrcvi_sawtooth(vrcvisawtooth_t *chan)
    chan->accum -= vrcvi.incsize; /* # of clocks per wav cycle */
    while (chan->accum < 0)
    {
-      chan->accum += chan->freq;
+      chan->accum += APU_TO_FIXED(chan->freq);
       chan->output_acc += chan->volume;
       
       chan->adder++;
@@ -183,11 +183,9 @@ static void vrcvi_write(uint32 address, uint8 value)
 static void vrcvi_reset(void)
 {
    int i;
-   apu_t apu;
 
    /* get the phase period from the apu */
-   apu_getcontext(&apu);
-   vrcvi.incsize = apu.cycle_rate;
+   vrcvi.incsize = apu_getcontextptr()->cycle_rate;
 
    /* preload regs */
    for (i = 0; i < 3; i++)
@@ -23,6 +23,7 @@
 ** $Id: vid_drv.c,v 1.2 2001/04/27 14:37:11 neil Exp $
 */
 
+#include <stdint.h>
 #include <string.h>
 #include <noftypes.h>
 #include <log.h>
@@ -30,6 +31,7 @@
 #include <vid_drv.h>
 #include <gui.h>
 #include <osd.h>
+#include <vid_pipe.h>
 
 /* hardware surface */
 static bitmap_t *screen = NULL;
@@ -39,6 +41,9 @@ static bitmap_t *primary_buffer = NULL; //, *back_buffer = NULL;
 
 static viddriver_t *driver = NULL;
 
+/* frame buffers handed to a display task, if the OSD layer has one */
+static vidpipe_t *pipeline = NULL;
+
 /* fast automagic loop unrolling */
 #define  DUFFS_DEVICE(transfer, count) \
 { \
@@ -61,7 +66,7 @@ static viddriver_t *driver = NULL;
 INLINE int vid_memcmp(const void *p1, const void *p2, int len)
 {
    /* check for 32-bit aligned data */
-   if (0 == (((uint32) p1 & 3) | ((uint32) p2 & 3)))
+   if (0 == (((uintptr_t) p1 & 3) | ((uintptr_t) p2 & 3)))
    {
       uint32 *dw1 = (uint32 *) p1;
       uint32 *dw2 = (uint32 *) p2;
@@ -109,7 +114,7 @@ INLINE void vid_memcpy(void *dest, const void *src, int len)
    uint32 *s = (uint32 *) src;
    uint32 *d = (uint32 *) dest;
 
-   ASSERT(0 == ((len & 3) | ((uint32) src & 3) | ((uint32) dest & 3)));
+   ASSERT(0 == ((len & 3) | ((uintptr_t) src & 3) | ((uintptr_t) dest & 3)));
    len >>= 2;
 
    DUFFS_DEVICE(*d++ = *s++, len);
@@ -125,9 +130,12 @@ bitmap_t *vid_getbuffer(void)
 
 void vid_setpalette(rgb_t *p)
 {
-   ASSERT(driver);
    ASSERT(p);
 
+   /* machines run without a display (nes_runframe) */
+   if (NULL == driver)
+      return;
+
    driver->set_palette(p);
 }
 
@@ -356,21 +364,50 @@ void vid_flush(void)
    else
       vid_blitscreen(num_dirties, dirty_rects);
 
+   /* the display owns this frame now, draw the next one elsewhere */
+   if (pipeline)
+      primary_buffer = vidpipe_submit(pipeline, primary_buffer);
+
    /* Swap pointers to the main/back buffers */
 //   temp = back_buffer;
 //   back_buffer = primary_buffer;
 //   primary_buffer = temp;
 }
 
+/* render into the buffers of a frame pipeline instead of our own, has
+** to be set before vid_setmode()
+*/
+void vid_setpipeline(vidpipe_t *pipe)
+{
+   pipeline = pipe;
+}
+
 /* emulated machine tells us which resolution it wants */
 int vid_setmode(int width, int height)
 {
+   if (pipeline)
+   {
+      primary_buffer = vidpipe_getbuffer(pipeline);
+      if (primary_buffer->width != width || primary_buffer->height != height)
+      {
+         log_printf("video pipeline is %dx%d, not %dx%d\n", primary_buffer->width,
+                    primary_buffer->height, width, height);
+         primary_buffer = NULL;
+         return -1;
+      }
+
+      return 0;
+   }
+
    if (NULL != primary_buffer)
       bmp_destroy(&primary_buffer);
 //   if (NULL != back_buffer)
 //      bmp_destroy(&back_buffer);
 
-   primary_buffer = bmp_create(width, height, 0); /* no overdraw */
+   /* 8 pixel overdraw: the PPU renders straight into this buffer, and
+   ** fine x scrolling spills up to 8 pixels past either edge of a line
+   */
+   primary_buffer = bmp_create(width, height, 8);
    if (NULL == primary_buffer)
       return -1;
 
@@ -438,7 +475,9 @@ void vid_shutdown(void)
    if (NULL == driver)
       return;
 
-   if (NULL != primary_buffer)
+   if (pipeline)
+      primary_buffer = NULL;
+   else if (NULL != primary_buffer)
       bmp_destroy(&primary_buffer);
 #if 0
    if (NULL != back_buffer)
@@ -27,6 +27,7 @@
 #define _VID_DRV_H_
 
 #include <bitmap.h>
+#include <vid_pipe.h>
 
 typedef struct viddriver_s
 {
@@ -65,6 +66,7 @@ extern void vid_setpalette(rgb_t *pal);
 extern void vid_blit(bitmap_t *bitmap, int src_x, int src_y, int dest_x, 
                      int dest_y, int blit_width, int blit_height);
 extern void vid_flush(void);
+extern void vid_setpipeline(vidpipe_t *pipe);
 
 #endif /* _VID_DRV_H_ */
 
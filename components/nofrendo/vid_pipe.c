@@ -0,0 +1,304 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** vid_pipe.c
+**
+** Frame buffer pipeline between the emulator and a display task
+**
+** Every buffer belongs to exactly one side at a time: the emulator draws
+** into one, finished frames queue up oldest first, and the display owns
+** the one it is sending out.  When the emulator finishes a frame and no
+** buffer is free, the oldest frame that hasn't been displayed yet is
+** dropped and drawn over.  Only with two buffers, while the display
+** still has the other one, does the emulator have to wait.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <noftypes.h>
+#include <bitmap.h>
+#include <log.h>
+#include <vid_pipe.h>
+
+enum
+{
+   BUF_FREE,
+   BUF_DRAWING,               /* owned by the emulator */
+   BUF_READY,                 /* finished, waiting for the display */
+   BUF_SHOWING                /* owned by the display */
+};
+
+struct vidpipe_s
+{
+   int count;
+   bitmap_t *buf[VIDPIPE_MAXBUFFERS];
+   int state[VIDPIPE_MAXBUFFERS];
+   uint32 serial[VIDPIPE_MAXBUFFERS];  /* frame order of ready buffers */
+   uint32 next_serial;
+   bool closed;
+   vidpipe_sync_t sync;
+   vidpipe_stats_t stats;
+};
+
+/* for a pipeline that is only used from one thread */
+static void nosync_lock(void *arg)
+{
+   UNUSED(arg);
+}
+
+static void nosync_wait(void *arg, int side)
+{
+   UNUSED(arg);
+   UNUSED(side);
+
+   /* nobody else could change anything */
+   ASSERT_MSG("video pipeline would wait forever");
+}
+
+static void nosync_signal(void *arg, int side)
+{
+   UNUSED(arg);
+   UNUSED(side);
+}
+
+static const vidpipe_sync_t nosync =
+{
+   NULL, nosync_lock, nosync_lock, nosync_wait, nosync_signal, NULL
+};
+
+INLINE uint32 pipe_now(vidpipe_t *pipe)
+{
+   return pipe->sync.now ? pipe->sync.now(pipe->sync.arg) : 0;
+}
+
+static int pipe_find(vidpipe_t *pipe, bitmap_t *frame)
+{
+   int i;
+
+   for (i = 0; i < pipe->count; i++)
+   {
+      if (frame == pipe->buf[i])
+         return i;
+   }
+
+   ASSERT_MSG("frame is not in the video pipeline");
+   return 0;
+}
+
+/* oldest ready frame, or -1 */
+static int pipe_oldest(vidpipe_t *pipe)
+{
+   int i, oldest = -1;
+
+   for (i = 0; i < pipe->count; i++)
+   {
+      if (BUF_READY == pipe->state[i]
+          && (oldest < 0 || (int32) (pipe->serial[i] - pipe->serial[oldest]) < 0))
+         oldest = i;
+   }
+
+   return oldest;
+}
+
+vidpipe_t *vidpipe_create(int width, int height, int count, const vidpipe_sync_t *sync)
+{
+   vidpipe_t *pipe;
+   int i;
+
+   if (count < 2 || count > VIDPIPE_MAXBUFFERS)
+   {
+      log_printf("video pipeline needs 2-%d buffers, not %d\n", VIDPIPE_MAXBUFFERS, count);
+      return NULL;
+   }
+
+   pipe = malloc(sizeof(vidpipe_t));
+   if (NULL == pipe)
+      return NULL;
+
+   memset(pipe, 0, sizeof(vidpipe_t));
+   pipe->count = count;
+   pipe->sync = sync ? *sync : nosync;
+
+   for (i = 0; i < count; i++)
+   {
+      /* same 8 pixel overdraw as vid_setmode() */
+      pipe->buf[i] = bmp_create(width, height, 8);
+      if (NULL == pipe->buf[i])
+      {
+         vidpipe_destroy(&pipe);
+         return NULL;
+      }
+
+      bmp_clear(pipe->buf[i], 0);
+      pipe->state[i] = BUF_FREE;
+   }
+
+   /* the emulator starts out with the first one */
+   pipe->state[0] = BUF_DRAWING;
+
+   return pipe;
+}
+
+void vidpipe_destroy(vidpipe_t **pipe)
+{
+   int i;
+
+   if (NULL == *pipe)
+      return;
+
+   for (i = 0; i < (*pipe)->count; i++)
+      bmp_destroy(&(*pipe)->buf[i]);
+
+   free(*pipe);
+   *pipe = NULL;
+}
+
+/* no more frames: wakes up both sides, vidpipe_acquire() returns NULL */
+void vidpipe_close(vidpipe_t *pipe)
+{
+   pipe->sync.lock(pipe->sync.arg);
+   pipe->closed = true;
+   pipe->sync.signal(pipe->sync.arg, VIDPIPE_CONSUMER);
+   pipe->sync.signal(pipe->sync.arg, VIDPIPE_PRODUCER);
+   pipe->sync.unlock(pipe->sync.arg);
+}
+
+/* the buffer the emulator is drawing into */
+bitmap_t *vidpipe_getbuffer(vidpipe_t *pipe)
+{
+   bitmap_t *frame = NULL;
+   int i;
+
+   pipe->sync.lock(pipe->sync.arg);
+   for (i = 0; i < pipe->count; i++)
+   {
+      if (BUF_DRAWING == pipe->state[i])
+         frame = pipe->buf[i];
+   }
+   pipe->sync.unlock(pipe->sync.arg);
+
+   return frame;
+}
+
+/* hand a finished frame to the display, returns the buffer to draw the
+** next one into
+*/
+bitmap_t *vidpipe_submit(vidpipe_t *pipe, bitmap_t *frame)
+{
+   int submitted, next, i;
+   uint32 start;
+
+   pipe->sync.lock(pipe->sync.arg);
+
+   submitted = pipe_find(pipe, frame);
+   ASSERT(BUF_DRAWING == pipe->state[submitted]);
+
+   pipe->state[submitted] = BUF_READY;
+   pipe->serial[submitted] = pipe->next_serial++;
+   pipe->stats.produced++;
+   pipe->sync.signal(pipe->sync.arg, VIDPIPE_CONSUMER);
+
+   for (;;)
+   {
+      next = -1;
+      for (i = 0; i < pipe->count; i++)
+      {
+         if (BUF_FREE == pipe->state[i])
+            next = i;
+      }
+
+      if (next >= 0)
+         break;
+
+      /* drop the oldest frame still waiting, as long as it's not this one */
+      next = pipe_oldest(pipe);
+      if (next != submitted)
+      {
+         pipe->stats.dropped++;
+         break;
+      }
+
+      /* nobody is going to display it */
+      if (pipe->closed)
+         break;
+
+      start = pipe_now(pipe);
+      pipe->sync.wait(pipe->sync.arg, VIDPIPE_PRODUCER);
+      pipe->stats.producer_stall += pipe_now(pipe) - start;
+   }
+
+   pipe->state[next] = BUF_DRAWING;
+   pipe->sync.unlock(pipe->sync.arg);
+
+   return pipe->buf[next];
+}
+
+/* oldest frame not displayed yet, waits for one; NULL once closed */
+bitmap_t *vidpipe_acquire(vidpipe_t *pipe)
+{
+   bitmap_t *frame = NULL;
+   uint32 start;
+   int oldest;
+
+   pipe->sync.lock(pipe->sync.arg);
+
+   for (;;)
+   {
+      oldest = pipe_oldest(pipe);
+      if (oldest >= 0 || pipe->closed)
+         break;
+
+      start = pipe_now(pipe);
+      pipe->sync.wait(pipe->sync.arg, VIDPIPE_CONSUMER);
+      pipe->stats.consumer_stall += pipe_now(pipe) - start;
+   }
+
+   if (oldest >= 0 && false == pipe->closed)
+   {
+      pipe->state[oldest] = BUF_SHOWING;
+      pipe->stats.displayed++;
+      frame = pipe->buf[oldest];
+   }
+
+   pipe->sync.unlock(pipe->sync.arg);
+
+   return frame;
+}
+
+/* the display is done with a frame */
+void vidpipe_release(vidpipe_t *pipe, bitmap_t *frame)
+{
+   int i;
+
+   pipe->sync.lock(pipe->sync.arg);
+
+   i = pipe_find(pipe, frame);
+   ASSERT(BUF_SHOWING == pipe->state[i]);
+   pipe->state[i] = BUF_FREE;
+   pipe->sync.signal(pipe->sync.arg, VIDPIPE_PRODUCER);
+
+   pipe->sync.unlock(pipe->sync.arg);
+}
+
+void vidpipe_getstats(vidpipe_t *pipe, vidpipe_stats_t *stats)
+{
+   pipe->sync.lock(pipe->sync.arg);
+   *stats = pipe->stats;
+   pipe->sync.unlock(pipe->sync.arg);
+}
@@ -0,0 +1,76 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** vid_pipe.h
+**
+** Frame buffer pipeline between the emulator and a display task
+*/
+
+#ifndef _VID_PIPE_H_
+#define _VID_PIPE_H_
+
+#include <bitmap.h>
+
+#define  VIDPIPE_MAXBUFFERS   4
+
+/* which side of the pipeline is waiting / being woken up */
+#define  VIDPIPE_PRODUCER     0
+#define  VIDPIPE_CONSUMER     1
+
+/* Locking, supplied by the OSD layer: a mutex and one event per side.
+** wait() is called with the lock held and has to release it while it
+** sleeps, it may return early.  now() is a microsecond clock for the
+** stall times, it can be NULL.
+*/
+typedef struct vidpipe_sync_s
+{
+   void *arg;
+   void (*lock)(void *arg);
+   void (*unlock)(void *arg);
+   void (*wait)(void *arg, int side);
+   void (*signal)(void *arg, int side);
+   uint32 (*now)(void *arg);
+} vidpipe_sync_t;
+
+typedef struct vidpipe_stats_s
+{
+   uint32 produced;           /* frames handed to the pipeline */
+   uint32 displayed;          /* frames taken by the display */
+   uint32 dropped;            /* frames replaced by newer ones before display */
+   uint32 producer_stall;     /* us the emulator waited for a free buffer */
+   uint32 consumer_stall;     /* us the display waited for a frame */
+} vidpipe_stats_t;
+
+typedef struct vidpipe_s vidpipe_t;
+
+extern vidpipe_t *vidpipe_create(int width, int height, int count, const vidpipe_sync_t *sync);
+extern void vidpipe_destroy(vidpipe_t **pipe);
+extern void vidpipe_close(vidpipe_t *pipe);
+
+/* producer side */
+extern bitmap_t *vidpipe_getbuffer(vidpipe_t *pipe);
+extern bitmap_t *vidpipe_submit(vidpipe_t *pipe, bitmap_t *frame);
+
+/* consumer side */
+extern bitmap_t *vidpipe_acquire(vidpipe_t *pipe);
+extern void vidpipe_release(vidpipe_t *pipe, bitmap_t *frame);
+
+extern void vidpipe_getstats(vidpipe_t *pipe, vidpipe_stats_t *stats);
+
+#endif /* _VID_PIPE_H_ */
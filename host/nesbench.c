@@ -0,0 +1,562 @@
+/* vim: set tabstop=3 expandtab:
+**
+** This file is in the public domain.
+**
+** nesbench.c
+**
+** Deterministic headless benchmark runner for the nofrendo core
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <noftypes.h>
+#include <nofrendo.h>
+#include <memguard.h>
+#include <nes.h>
+#include <nes_apu.h>
+#include <pace.h>
+#include <ppu_kern.h>
+#include <vid_pipe.h>
+
+#include "osd_host.h"
+#include "pal_conv.h"
+
+#define  DEFAULT_FRAMES    600
+#define  KERNEL_ROUNDS     1000000
+#define  PALCONV_FRAMES    2000
+#define  PALCONV_WIDTH     256
+#define  PALCONV_HEIGHT    224
+#define  APU_FRAMES        3000
+#define  MAX_THREADS       64
+
+static void usage(const char *argv0)
+{
+   fprintf(stderr, "usage: %s [-f frames] [-M] [-S synth] [-b buffers [-d us]] [-a] [-p pacing [-s skip]] [-k n] [-I] [-T trace.json] [-H hist.txt] rom.nes\n", argv0);
+   fprintf(stderr, "       %s -j threads [-f frames] [-S synth] rom.nes\n", argv0);
+   fprintf(stderr, "       %s -K | -P | -A\n", argv0);
+   fprintf(stderr, "  -f frames  number of frames to emulate (default %d)\n", DEFAULT_FRAMES);
+   fprintf(stderr, "  -M         no memguard block guarding (debug profile)\n");
+   fprintf(stderr, "  -S synth   APU synthesis, sample (default) or blep\n");
+   fprintf(stderr, "  -b buffers frame pipeline with 2-%d buffers to a fake display thread\n", VIDPIPE_MAXBUFFERS);
+   fprintf(stderr, "  -d us      time the fake display takes per frame (default 0)\n");
+   fprintf(stderr, "  -a         real time audio sink behind a sample ring\n");
+   fprintf(stderr, "  -p pacing  free (default), timer at %d fps, or audio (default with -a)\n", NES_REFRESH_RATE);
+   fprintf(stderr, "  -s skip    frameskip: late, even or refresh (default none)\n");
+   fprintf(stderr, "  -k n       draw only every nth frame, the rest take the no-render path\n");
+   fprintf(stderr, "  -I         no idle loop skipping in the 6502 core\n");
+   fprintf(stderr, "  -T file    write a Chrome trace of the profiler zones (make PROF=1)\n");
+   fprintf(stderr, "  -H file    write the 6502 opcode, handler and address histogram (make HIST=1)\n");
+   fprintf(stderr, "  -j n       run a machine per thread, 1 up to n threads, and compare (make MT=1)\n");
+   fprintf(stderr, "  -K         check the PPU kernel against the scalar one and exit\n");
+   fprintf(stderr, "  -P         benchmark the LCD palette conversion and exit\n");
+   fprintf(stderr, "  -A         benchmark the APU synthesis engines and exit\n");
+   exit(2);
+}
+
+static void report(void)
+{
+   double secs = (hostrun.ns_end - hostrun.ns_start) / 1e9;
+   double host_cycles = (double) (hostrun.host_end - hostrun.host_start);
+   double fetches = (double) hostrun.decode_hits + hostrun.decode_misses + hostrun.decode_uncached;
+   pace_stats_t pace;
+
+   printf("rom:              %s\n", hostrun.rom_path);
+#ifdef NOFRENDO_DEBUG
+   printf("profile:          debug, memguard %s\n", mem_debug ? "on" : "off");
+#else /* !NOFRENDO_DEBUG */
+   printf("profile:          release\n");
+#endif /* !NOFRENDO_DEBUG */
+   printf("ppu kernel:       %s\n", ppu_kernname());
+#ifdef APU_FIXEDPOINT
+   printf("apu synth:        %s, fixed point\n", APU_SYNTH_BLEP == hostrun.synth ? "blep" : "sample");
+#else /* !APU_FIXEDPOINT */
+   printf("apu synth:        %s, float\n", APU_SYNTH_BLEP == hostrun.synth ? "blep" : "sample");
+#endif /* !APU_FIXEDPOINT */
+   printf("frames:           %d\n", hostrun.frames_done);
+   printf("pacing:           %s\n", pace_policyname(hostrun.pace));
+   printf("time:             %.3f s\n", secs);
+   printf("fps:              %.1f\n", secs > 0 ? hostrun.frames_done / secs : 0.0);
+   printf("6502 cycles:      %llu\n", (unsigned long long) hostrun.cpu_cycles);
+   printf("host/6502 cycle:  %.2f\n",
+          hostrun.cpu_cycles ? host_cycles / hostrun.cpu_cycles : 0.0);
+   printf("decode cache:     %d entries, %.1f%% hits (%u/%u/%u hit/miss/uncached)\n",
+          NES6502_DECODEBITS ? 1 << NES6502_DECODEBITS : 0, fetches ? hostrun.decode_hits * 100.0 / fetches : 0.0,
+          hostrun.decode_hits, hostrun.decode_misses, hostrun.decode_uncached);
+#if NES6502_IDLESKIP
+   printf("idle skipping:    %s, %u loops, %u times round, %.1f%% of 6502 cycles\n",
+          hostrun.idle_off ? "off" : "on", hostrun.idle_skips, hostrun.idle_iterations,
+          hostrun.cpu_cycles ? hostrun.idle_cycles * 100.0 / hostrun.cpu_cycles : 0.0);
+#endif /* NES6502_IDLESKIP */
+   printf("audio samples:    %ld\n", hostrun.audio_samples);
+   printf("frame hash:       %08x\n", hostrun.frame_hash);
+   printf("audio hash:       %08x\n", hostrun.audio_hash);
+
+   if (hostrun.buffers)
+   {
+      printf("pipeline:         %d buffers, display %d us/frame\n", hostrun.buffers, hostrun.display_us);
+      printf("frames produced:  %u\n", hostrun.produced);
+      printf("frames displayed: %u\n", hostrun.displayed);
+      printf("frames dropped:   %u\n", hostrun.dropped);
+      printf("producer stall:   %.3f ms\n", hostrun.producer_stall_us / 1000.0);
+      printf("consumer stall:   %.3f ms\n", hostrun.consumer_stall_us / 1000.0);
+   }
+
+   if (PACE_FREE != hostrun.pace)
+   {
+      pace_getstats(&pace);
+      printf("frames late:      %u\n", pace.late);
+      printf("frames skipped:   %u\n", pace.skipped);
+      printf("pacing resyncs:   %u\n", pace.resyncs);
+      printf("pacing jitter:    %.3f / %.3f ms (avg/max)\n", pace.jitter_avg / 1000.0, pace.jitter_max / 1000.0);
+      printf("pacing idle:      %u ms\n", pace.idle);
+   }
+
+   pace_getstats(&pace);
+   printf("frames drawn:     %u\n", pace.drawn);
+   printf("frame cost:       emulate %u us, render %u us, blit %u us\n", pace.emulate_us, pace.render_us, pace.blit_us);
+   if (hostrun.skip >= 0)
+   {
+      printf("frameskip:        %s, drawing %.1f%% of frames, or 1 in %u\n", pace_skipname(hostrun.skip),
+             pace.draw_share * 100.0 / 65536, pace.divisor);
+   }
+
+   if (hostrun.trace_path)
+      printf("trace:            %s, %u zones, %u dropped\n", hostrun.trace_path, hostrun.trace_events, hostrun.trace_dropped);
+
+   if (hostrun.audio_sink)
+   {
+      printf("sink samples:     %u\n", hostrun.sink_read);
+      printf("sink underruns:   %u samples\n", hostrun.sink_underruns);
+      printf("sink overruns:    %u samples\n", hostrun.sink_overruns);
+      printf("ring fill:        %u-%u samples\n", hostrun.sink_min_fill, hostrun.sink_max_fill);
+      printf("rate adjust:      %+.3f%%\n", hostrun.sink_adjust * 100.0 / 65536);
+      printf("audio latency:    %.1f / %.1f / %.1f ms (min/avg/max)\n", hostrun.latency_min_us / 1000.0,
+             hostrun.latency_avg_us / 1000.0, hostrun.latency_max_us / 1000.0);
+   }
+}
+
+static int check_kernel(void)
+{
+   int errors = ppu_kerncheck(KERNEL_ROUNDS);
+
+   printf("ppu kernel %s: %d rounds, %d mismatches\n", ppu_kernname(), KERNEL_ROUNDS, errors);
+   return errors ? 1 : 0;
+}
+
+/* LCD palette conversion (pal_conv.c) against the one pixel at a time
+** version, on a frame of random pixels
+*/
+static void bench_palconv(void (*conv)(uint16_t *, const uint8_t *, int, const uint16_t *),
+                          uint8_t frame[][PALCONV_WIDTH], const uint16_t *table,
+                          uint16_t out[][PALCONV_WIDTH], double *ns_line)
+{
+   uint64_t start;
+   int i, y;
+
+   start = host_nanos();
+   for (i = 0; i < PALCONV_FRAMES; i++)
+   {
+      for (y = 0; y < PALCONV_HEIGHT; y++)
+         conv(out[y], frame[y], PALCONV_WIDTH, table);
+   }
+
+   *ns_line = (double) (host_nanos() - start) / ((double) PALCONV_FRAMES * PALCONV_HEIGHT);
+}
+
+static int check_palconv(void)
+{
+   static uint8_t frame[PALCONV_HEIGHT][PALCONV_WIDTH] __attribute__ ((aligned (4)));
+   static uint16_t ref[PALCONV_HEIGHT][PALCONV_WIDTH], out[PALCONV_HEIGHT][PALCONV_WIDTH];
+   static uint16_t table[PALCONV_ENTRIES];
+   rgb_t pal[PALCONV_ENTRIES];
+   double ref_ns, out_ns;
+   uint32_t seed = 1;
+   int i, y;
+
+   for (i = 0; i < PALCONV_ENTRIES; i++)
+   {
+      pal[i].r = (i * 37) & 0xFF;
+      pal[i].g = (i * 91) & 0xFF;
+      pal[i].b = (i * 13) & 0xFF;
+   }
+   palconv_settable(table, pal);
+
+   for (y = 0; y < PALCONV_HEIGHT; y++)
+   {
+      for (i = 0; i < PALCONV_WIDTH; i++)
+      {
+         seed = seed * 1103515245 + 12345;
+         frame[y][i] = seed >> 24;
+      }
+   }
+
+   bench_palconv(palconv_line_ref, frame, table, ref, &ref_ns);
+   bench_palconv(palconv_line, frame, table, out, &out_ns);
+
+   printf("palette conversion, %dx%d, %d frames\n", PALCONV_WIDTH, PALCONV_HEIGHT, PALCONV_FRAMES);
+   printf("  per pixel:      %.1f ns/line\n", ref_ns);
+   printf("  palconv_line:   %.1f ns/line\n", out_ns);
+
+   if (memcmp(ref, out, sizeof(out)))
+   {
+      printf("  output differs from the per pixel version\n");
+      return 1;
+   }
+
+   return 0;
+}
+
+/* The APU on its own, without a CPU: every write lands on the first
+** sample.  Four tone channels held at a fixed volume, or all of them off.
+*/
+static void bench_apu(int synth, bool playing, double *cycles_sample, uint32_t *hash)
+{
+   static const uint8 regs[][2] =
+   {
+      { 0x15, 0x0F },
+      { 0x00, 0xBF }, { 0x02, 0xFD }, { 0x03, 0x00 },  /* 50% duty, ~440 Hz */
+      { 0x04, 0x7F }, { 0x06, 0xA9 }, { 0x07, 0x01 },  /* 25% duty, ~262 Hz */
+      { 0x08, 0xFF }, { 0x0A, 0x52 }, { 0x0B, 0x01 },  /* ~164 Hz */
+      { 0x0C, 0x3F }, { 0x0E, 0x04 }, { 0x0F, 0x00 }   /* 64 cycle noise */
+   };
+   static int16 buffer[HOST_SAMPLERATE / NES_REFRESH_RATE];
+   int n = HOST_SAMPLERATE / NES_REFRESH_RATE;
+   uint64_t start;
+   apu_t *apu;
+   int i;
+
+   apu = apu_create(HOST_SAMPLERATE, NES_REFRESH_RATE, 16);
+   apu_setsynth(synth);
+
+   if (playing)
+   {
+      for (i = 0; i < (int) (sizeof(regs) / sizeof(regs[0])); i++)
+         apu_write(0x4000 + regs[i][0], regs[i][1]);
+   }
+
+   *hash = 0x811C9DC5;
+   start = host_cycles();
+   for (i = 0; i < APU_FRAMES; i++)
+   {
+      apu_process(buffer, n);
+      *hash = (*hash ^ (uint16) buffer[n / 2]) * 0x01000193;
+   }
+
+   *cycles_sample = (double) (host_cycles() - start) / ((double) APU_FRAMES * n);
+
+   apu_destroy(&apu);
+}
+
+static int check_apu(void)
+{
+   double cycles_sample[2];
+   uint32_t hash[2];
+   int playing;
+
+#ifdef APU_FIXEDPOINT
+   printf("apu synthesis, %d Hz, %d frames, fixed point\n", HOST_SAMPLERATE, APU_FRAMES);
+#else /* !APU_FIXEDPOINT */
+   printf("apu synthesis, %d Hz, %d frames, float\n", HOST_SAMPLERATE, APU_FRAMES);
+#endif /* !APU_FIXEDPOINT */
+
+   for (playing = 1; playing >= 0; playing--)
+   {
+      bench_apu(APU_SYNTH_SAMPLE, playing, &cycles_sample[0], &hash[0]);
+      bench_apu(APU_SYNTH_BLEP, playing, &cycles_sample[1], &hash[1]);
+
+      printf("  %s:\n", playing ? "four channels" : "silence");
+      printf("    sample:       %.1f host cycles/sample (%08x)\n", cycles_sample[0], hash[0]);
+      printf("    blep:         %.1f host cycles/sample (%08x)\n", cycles_sample[1], hash[1]);
+   }
+
+   return 0;
+}
+
+/*
+** Scaling: every thread runs a machine of its own through nes_runframe(),
+** drawing every frame, and has to end up with the same hashes as the
+** others.  With NOFRENDO_REENTRANT the core's state is per thread.
+*/
+#ifdef NOFRENDO_REENTRANT
+
+typedef struct
+{
+   pthread_t thread;
+   int frames;
+   bool failed;
+   uint32_t frame_hash, audio_hash;
+} machine_run_t;
+
+static void *run_machine(void *arg)
+{
+   machine_run_t *run = arg;
+   int16 samples[HOST_SAMPLERATE / NES_REFRESH_RATE];
+   nes_t *machine;
+   bitmap_t *bmp;
+   int i;
+
+   run->failed = true;
+
+   /* same as the display driver's frame buffer */
+   bmp = bmp_create(NES_SCREEN_WIDTH, NES_VISIBLE_HEIGHT, 8);
+   if (NULL == bmp)
+      return NULL;
+
+   /* nes_insertcart() cleans up after itself */
+   machine = nes_create();
+   if (NULL == machine || nes_insertcart(hostrun.rom_path, machine))
+   {
+      bmp_destroy(&bmp);
+      return NULL;
+   }
+
+   apu_setsynth(hostrun.synth);
+   nes6502_setidleskip(false == hostrun.idle_off);
+
+   run->audio_hash = FNV_OFFSET;
+   for (i = 0; i < run->frames; i++)
+   {
+      nes_runframe(bmp);
+      machine->apu->process(samples, HOST_SAMPLERATE / NES_REFRESH_RATE);
+      run->audio_hash = fnv_hash(run->audio_hash, (uint8 *) samples, sizeof(samples));
+   }
+
+   run->frame_hash = FNV_OFFSET;
+   for (i = 0; i < bmp->height; i++)
+      run->frame_hash = fnv_hash(run->frame_hash, bmp->line[i], bmp->width);
+
+   nes_destroy(&machine);
+   bmp_destroy(&bmp);
+   run->failed = false;
+
+   return NULL;
+}
+
+/* frames per second of all threads together, 0 if any run failed or
+** came out different from the first
+*/
+static double run_machines(machine_run_t *runs, int threads)
+{
+   uint64_t start, elapsed;
+   int i;
+
+   start = host_nanos();
+
+   for (i = 0; i < threads; i++)
+   {
+      runs[i].frames = hostrun.frames;
+      if (pthread_create(&runs[i].thread, NULL, run_machine, &runs[i]))
+      {
+         fprintf(stderr, "couldn't start thread %d\n", i);
+         exit(1);
+      }
+   }
+
+   for (i = 0; i < threads; i++)
+      pthread_join(runs[i].thread, NULL);
+
+   elapsed = host_nanos() - start;
+
+   for (i = 0; i < threads; i++)
+   {
+      if (runs[i].failed || runs[i].frame_hash != runs[0].frame_hash
+          || runs[i].audio_hash != runs[0].audio_hash)
+         return 0.0;
+   }
+
+   return (double) threads * hostrun.frames * 1e9 / elapsed;
+}
+
+static int check_threads(int max_threads)
+{
+   static machine_run_t runs[MAX_THREADS];
+   double fps, single = 0.0;
+   int threads;
+
+   printf("rom:              %s\n", hostrun.rom_path);
+   printf("frames:           %d per machine\n", hostrun.frames);
+   printf("host cpus:        %ld\n", sysconf(_SC_NPROCESSORS_ONLN));
+   printf("threads   fps total  per thread  scaling\n");
+
+   /* doubling up to max_threads */
+   for (threads = 1; ; threads = (threads * 2 < max_threads) ? threads * 2 : max_threads)
+   {
+      fps = run_machines(runs, threads);
+      if (0.0 == fps)
+      {
+         printf("%7d   machines failed or disagree\n", threads);
+         return 1;
+      }
+
+      if (1 == threads)
+         single = fps;
+
+      printf("%7d %12.1f %11.1f %7.2fx\n", threads, fps, fps / threads, fps / single);
+
+      if (threads == max_threads)
+         break;
+   }
+
+   printf("frame hash:       %08x\n", runs[0].frame_hash);
+   printf("audio hash:       %08x\n", runs[0].audio_hash);
+
+   return 0;
+}
+
+#endif /* NOFRENDO_REENTRANT */
+
+int main(int argc, char *argv[])
+{
+   int opt;
+#ifdef NOFRENDO_REENTRANT
+   int threads = 0;
+#endif /* NOFRENDO_REENTRANT */
+
+   memset(&hostrun, 0, sizeof(hostrun));
+   hostrun.frames = DEFAULT_FRAMES;
+   hostrun.pace = -1;
+   hostrun.skip = -1;
+
+   while ((opt = getopt(argc, argv, "f:MKPAS:b:d:ap:s:k:IT:H:j:")) != -1)
+   {
+      switch (opt)
+      {
+      case 'f':
+         hostrun.frames = atoi(optarg);
+         break;
+
+      case 'M':
+         mem_debug = false;
+         break;
+
+      case 'b':
+         hostrun.buffers = atoi(optarg);
+         break;
+
+      case 'd':
+         hostrun.display_us = atoi(optarg);
+         break;
+
+      case 'a':
+         hostrun.audio_sink = true;
+         break;
+
+      case 'p':
+         if (0 == strcmp(optarg, "free"))
+            hostrun.pace = PACE_FREE;
+         else if (0 == strcmp(optarg, "timer"))
+            hostrun.pace = PACE_TIMER;
+         else if (0 == strcmp(optarg, "audio"))
+            hostrun.pace = PACE_AUDIO;
+         else
+            usage(argv[0]);
+         break;
+
+      case 's':
+         if (0 == strcmp(optarg, "late"))
+            hostrun.skip = PACE_SKIP_LATE;
+         else if (0 == strcmp(optarg, "even"))
+            hostrun.skip = PACE_SKIP_EVEN;
+         else if (0 == strcmp(optarg, "refresh"))
+            hostrun.skip = PACE_SKIP_REFRESH;
+         else
+            usage(argv[0]);
+         break;
+
+      case 'k':
+         hostrun.fixskip = atoi(optarg);
+         break;
+
+      case 'I':
+         hostrun.idle_off = true;
+         nes6502_setidleskip(false);
+         break;
+
+      case 'T':
+#ifdef NOFRENDO_PROFILE
+         hostrun.trace_path = optarg;
+#else /* !NOFRENDO_PROFILE */
+         fprintf(stderr, "%s: built without the profiler, make PROF=1\n", argv[0]);
+         exit(2);
+#endif /* !NOFRENDO_PROFILE */
+         break;
+
+      case 'H':
+#ifdef NES6502_HISTOGRAM
+         hostrun.hist_path = optarg;
+#else /* !NES6502_HISTOGRAM */
+         fprintf(stderr, "%s: built without the 6502 histogram, make HIST=1\n", argv[0]);
+         exit(2);
+#endif /* !NES6502_HISTOGRAM */
+         break;
+
+      case 'j':
+#ifdef NOFRENDO_REENTRANT
+         threads = atoi(optarg);
+#else /* !NOFRENDO_REENTRANT */
+         fprintf(stderr, "%s: built with a single machine per process, make MT=1\n", argv[0]);
+         exit(2);
+#endif /* !NOFRENDO_REENTRANT */
+         break;
+
+      case 'K':
+         return check_kernel();
+
+      case 'P':
+         return check_palconv();
+
+      case 'A':
+         return check_apu();
+
+      case 'S':
+         if (0 == strcmp(optarg, "blep"))
+            hostrun.synth = APU_SYNTH_BLEP;
+         else if (0 == strcmp(optarg, "sample"))
+            hostrun.synth = APU_SYNTH_SAMPLE;
+         else
+            usage(argv[0]);
+         break;
+
+      default:
+         usage(argv[0]);
+      }
+   }
+
+   if (hostrun.pace < 0)
+      hostrun.pace = hostrun.audio_sink ? PACE_AUDIO : PACE_FREE;
+
+   if (optind != argc - 1 || hostrun.frames <= 0
+       || (PACE_AUDIO == hostrun.pace && false == hostrun.audio_sink)
+       || (hostrun.skip >= 0 && PACE_FREE == hostrun.pace) || hostrun.fixskip < 0)
+      usage(argv[0]);
+
+   hostrun.rom_path = argv[optind];
+
+#ifdef NOFRENDO_REENTRANT
+   if (threads)
+   {
+#ifdef NOFRENDO_DEBUG
+      /* memguard keeps one block list for the whole process */
+      fprintf(stderr, "%s: -j needs the release profile\n", argv[0]);
+      return 2;
+#else /* !NOFRENDO_DEBUG */
+      if (threads > MAX_THREADS)
+         usage(argv[0]);
+      return check_threads(threads);
+#endif /* !NOFRENDO_DEBUG */
+   }
+#endif /* NOFRENDO_REENTRANT */
+
+   if (nofrendo_main(0, NULL) || hostrun.frames_done < hostrun.frames)
+   {
+      fprintf(stderr, "emulation stopped after %d frames\n", hostrun.frames_done);
+      return 1;
+   }
+
+   report();
+   return 0;
+}
@@ -0,0 +1,572 @@
+/* vim: set tabstop=3 expandtab:
+**
+** This file is in the public domain.
+**
+** nesfarm.c
+**
+** Batch runner: many ROMs over many worker processes, one report
+**
+** The ROMs are mapped once, before any worker is forked, so every
+** process shares the same pages, and osd_getromdata() hands the mapped
+** image out as it does on the ESP32.  ROM n goes to worker n % workers.
+** A worker runs its ROMs one after the other, each with a machine of its
+** own from nes_create(); the core starts its state over for every new
+** machine, so the hashes are the same as a nesbench run of that ROM.
+** With -c every ROM gets a child process of its own instead, and one
+** that crashes only takes its child with it; without it, a crash takes
+** the worker and that worker's remaining ROMs go unrun.  Results go into
+** a table shared by all processes.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <noftypes.h>
+#include <bitmap.h>
+#include <nes.h>
+#include <nes_apu.h>
+#include <nesinput.h>
+
+#include "osd_host.h"
+
+#define  DEFAULT_FRAMES    600
+#define  MAX_WORKERS       256
+#define  LINE_LENGTH       1024
+
+enum
+{
+   FARM_PENDING,              /* not run, its worker died first */
+   FARM_DONE,
+   FARM_FAILED,               /* couldn't load, or stopped early */
+   FARM_CRASHED               /* killed by a signal */
+};
+
+/* controller 1 holds buttons from frame on */
+typedef struct
+{
+   int frame;
+   uint8 buttons;
+} farm_input_t;
+
+typedef struct
+{
+   int count;
+   farm_input_t *input;
+} farm_script_t;
+
+typedef struct
+{
+   char path[LINE_LENGTH];
+   char *data;                /* mapped image */
+   size_t size;
+   farm_script_t *script;
+} farm_rom_t;
+
+/* written by the worker, or the child running the ROM */
+typedef struct
+{
+   int status;
+   int code;                  /* exit status or signal */
+   int worker;
+   int frames;
+   uint64_t ns;               /* emulation only, not loading */
+   uint32_t frame_hash, audio_hash;
+} farm_result_t;
+
+static farm_rom_t *roms;
+static int rom_count;
+static farm_result_t *results;
+static pid_t worker_pids[MAX_WORKERS];
+
+/* controller 1, registered once per worker */
+static nesinput_t pad = { INP_JOYPAD0, 0 };
+
+static const struct
+{
+   const char *name;
+   uint8 mask;
+} button_names[] =
+{
+   { "a", INP_PAD_A }, { "b", INP_PAD_B }, { "select", INP_PAD_SELECT }, { "start", INP_PAD_START },
+   { "up", INP_PAD_UP }, { "down", INP_PAD_DOWN }, { "left", INP_PAD_LEFT }, { "right", INP_PAD_RIGHT }
+};
+
+static void usage(const char *argv0)
+{
+   fprintf(stderr, "usage: %s [-w workers] [-f frames] [-i input.txt] [-S synth] [-c] [-l list.txt] [rom.nes ...]\n", argv0);
+   fprintf(stderr, "  -w workers worker processes (default one per cpu, up to %d)\n", MAX_WORKERS);
+   fprintf(stderr, "  -f frames  frames to run each ROM for (default %d)\n", DEFAULT_FRAMES);
+   fprintf(stderr, "  -i file    controller input for ROMs that don't name their own\n");
+   fprintf(stderr, "  -S synth   APU synthesis, sample (default) or blep\n");
+   fprintf(stderr, "  -c         run every ROM in a child process, so a crash only loses that ROM\n");
+   fprintf(stderr, "  -l file    ROMs to run, one \"rom.nes [input.txt]\" per line\n");
+   fprintf(stderr, "input: one \"frame buttons\" per line, buttons held from that frame on,\n");
+   fprintf(stderr, "       a b select start up down left right joined with +, or - for none\n");
+   exit(2);
+}
+
+/*
+** Input scripts
+*/
+static int parse_buttons(char *text, uint8 *buttons)
+{
+   char *name;
+   int i;
+
+   *buttons = 0;
+   if (0 == strcmp(text, "-"))
+      return 0;
+
+   for (name = strtok(text, "+"); name; name = strtok(NULL, "+"))
+   {
+      for (i = 0; i < (int) (sizeof(button_names) / sizeof(button_names[0])); i++)
+      {
+         if (0 == strcmp(name, button_names[i].name))
+            break;
+      }
+
+      if (i == (int) (sizeof(button_names) / sizeof(button_names[0])))
+         return -1;
+
+      *buttons |= button_names[i].mask;
+   }
+
+   return 0;
+}
+
+static farm_script_t *load_script(const char *path)
+{
+   char line[LINE_LENGTH], buttons[LINE_LENGTH];
+   farm_script_t *script;
+   int frame, line_no = 0;
+   FILE *fp;
+
+   fp = fopen(path, "r");
+   if (NULL == fp)
+   {
+      fprintf(stderr, "Couldn't open %s\n", path);
+      exit(1);
+   }
+
+   script = calloc(1, sizeof(farm_script_t));
+   if (NULL == script)
+      exit(1);
+
+   while (fgets(line, sizeof(line), fp))
+   {
+      line_no++;
+      if ('#' == line[strspn(line, " \t")] || 0 == line[strspn(line, " \t\r\n")])
+         continue;
+
+      if (2 != sscanf(line, "%d %s", &frame, buttons)
+          || frame < 0 || (script->count && frame < script->input[script->count - 1].frame))
+      {
+         fprintf(stderr, "%s:%d: expected \"frame buttons\", frames in order\n", path, line_no);
+         exit(1);
+      }
+
+      script->input = realloc(script->input, (script->count + 1) * sizeof(farm_input_t));
+      if (NULL == script->input)
+         exit(1);
+
+      script->input[script->count].frame = frame;
+      if (parse_buttons(buttons, &script->input[script->count].buttons))
+      {
+         fprintf(stderr, "%s:%d: unknown button in \"%s\"\n", path, line_no, buttons);
+         exit(1);
+      }
+
+      script->count++;
+   }
+
+   fclose(fp);
+   return script;
+}
+
+/*
+** ROM list
+*/
+static void add_rom(const char *path, farm_script_t *script)
+{
+   if (strlen(path) >= LINE_LENGTH)
+   {
+      fprintf(stderr, "ROM path too long: %s\n", path);
+      exit(1);
+   }
+
+   /* not the core's malloc(), memguard would log every one */
+   roms = realloc(roms, (rom_count + 1) * sizeof(farm_rom_t));
+   if (NULL == roms)
+      exit(1);
+
+   memset(&roms[rom_count], 0, sizeof(farm_rom_t));
+   strcpy(roms[rom_count].path, path);
+   roms[rom_count].script = script;
+   rom_count++;
+}
+
+static void load_list(const char *path, farm_script_t *default_script)
+{
+   char line[LINE_LENGTH], rom[LINE_LENGTH], script[LINE_LENGTH];
+   FILE *fp;
+   int n;
+
+   fp = fopen(path, "r");
+   if (NULL == fp)
+   {
+      fprintf(stderr, "Couldn't open %s\n", path);
+      exit(1);
+   }
+
+   while (fgets(line, sizeof(line), fp))
+   {
+      if ('#' == line[strspn(line, " \t")])
+         continue;
+
+      n = sscanf(line, "%s %s", rom, script);
+      if (n >= 1)
+         add_rom(rom, (2 == n) ? load_script(script) : default_script);
+   }
+
+   fclose(fp);
+}
+
+/* shared with every worker through fork() */
+static void map_roms(void)
+{
+   struct stat st;
+   void *data;
+   int i, fd;
+
+   for (i = 0; i < rom_count; i++)
+   {
+      fd = open(roms[i].path, O_RDONLY);
+      if (fd < 0 || fstat(fd, &st) || 0 == st.st_size)
+      {
+         fprintf(stderr, "Couldn't open %s\n", roms[i].path);
+         exit(1);
+      }
+
+      data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (MAP_FAILED == data)
+      {
+         fprintf(stderr, "Couldn't map %s\n", roms[i].path);
+         exit(1);
+      }
+
+      roms[i].data = data;
+      roms[i].size = st.st_size;
+   }
+}
+
+/*
+** Running
+*/
+
+/* headless through nes_runframe(), in the worker or a child of its own */
+static int run_rom(farm_rom_t *rom, farm_result_t *result, int frames, int synth)
+{
+   int16 samples[HOST_SAMPLERATE / NES_REFRESH_RATE];
+   farm_script_t *script = rom->script;
+   uint64_t start;
+   nes_t *machine;
+   bitmap_t *bmp;
+   int i, next = 0;
+
+   hostrun.rom_path = rom->path;
+   hostrun.rom_data = rom->data;
+
+   /* same as the display driver's frame buffer */
+   bmp = bmp_create(NES_SCREEN_WIDTH, NES_VISIBLE_HEIGHT, 8);
+   if (NULL == bmp)
+      return 1;
+
+   /* nes_insertcart() cleans up after itself */
+   machine = nes_create();
+   if (NULL == machine || nes_insertcart(rom->path, machine))
+   {
+      bmp_destroy(&bmp);
+      return 1;
+   }
+
+   apu_setsynth(synth);
+   pad.data = 0;
+
+   result->audio_hash = FNV_OFFSET;
+   start = host_nanos();
+   for (i = 0; i < frames; i++)
+   {
+      while (script && next < script->count && script->input[next].frame <= i)
+         pad.data = script->input[next++].buttons;
+
+      nes_runframe(bmp);
+      machine->apu->process(samples, HOST_SAMPLERATE / NES_REFRESH_RATE);
+      result->audio_hash = fnv_hash(result->audio_hash, (uint8 *) samples, sizeof(samples));
+      result->frames++;
+   }
+   result->ns = host_nanos() - start;
+
+   result->frame_hash = FNV_OFFSET;
+   for (i = 0; i < bmp->height; i++)
+      result->frame_hash = fnv_hash(result->frame_hash, bmp->line[i], bmp->width);
+
+   nes_destroy(&machine);
+   bmp_destroy(&bmp);
+
+   result->status = FARM_DONE;
+   return 0;
+}
+
+/* the ROM runs in a child, which exits with run_rom()'s result */
+static void run_child(farm_rom_t *rom, farm_result_t *result, int frames, int synth)
+{
+   int status;
+   pid_t pid;
+
+   pid = fork();
+   if (0 == pid)
+      _exit(run_rom(rom, result, frames, synth));
+
+   if (pid < 0)
+   {
+      result->status = FARM_FAILED;
+      result->code = errno;
+      return;
+   }
+
+   while (waitpid(pid, &status, 0) < 0 && EINTR == errno)
+      ;
+
+   if (WIFSIGNALED(status))
+   {
+      result->status = FARM_CRASHED;
+      result->code = WTERMSIG(status);
+   }
+   else if (FARM_DONE != result->status)
+   {
+      result->status = FARM_FAILED;
+      result->code = WEXITSTATUS(status);
+   }
+}
+
+static void run_worker(int worker, int workers, int frames, int synth, bool isolate)
+{
+   farm_result_t *result;
+   int i, devnull;
+
+   /* the core's chatter would end up in the middle of the report */
+   devnull = open("/dev/null", O_WRONLY);
+   if (devnull >= 0)
+      dup2(devnull, STDOUT_FILENO);
+
+   input_register(&pad);
+
+   for (i = worker; i < rom_count; i += workers)
+   {
+      result = &results[i];
+
+      if (isolate)
+      {
+         run_child(&roms[i], result, frames, synth);
+      }
+      else if (run_rom(&roms[i], result, frames, synth))
+      {
+         result->status = FARM_FAILED;
+         result->code = 1;
+      }
+   }
+}
+
+/* a worker was killed: the first of its ROMs that isn't finished is
+** the one it was running
+*/
+static void worker_died(pid_t pid, int workers, int sig)
+{
+   int worker, i;
+
+   for (worker = 0; worker < workers; worker++)
+   {
+      if (pid == worker_pids[worker])
+         break;
+   }
+
+   for (i = worker; i < rom_count; i += workers)
+   {
+      if (FARM_PENDING == results[i].status)
+      {
+         results[i].status = FARM_CRASHED;
+         results[i].code = sig;
+         break;
+      }
+   }
+}
+
+static void report(int workers, int frames, uint64_t ns)
+{
+   double secs = ns / 1e9;
+   long total_frames = 0;
+   int i, failed = 0;
+   farm_result_t *result;
+
+   printf("status       fps  frame    audio    worker  rom\n");
+   for (i = 0; i < rom_count; i++)
+   {
+      result = &results[i];
+      total_frames += result->frames;
+
+      switch (result->status)
+      {
+      case FARM_DONE:
+         printf("ok    %9.1f  %08x %08x %6d  %s\n", result->ns ? result->frames * 1e9 / result->ns : 0.0,
+                result->frame_hash, result->audio_hash, result->worker, roms[i].path);
+         break;
+
+      case FARM_CRASHED:
+         printf("crash %9s  %-17s %6d  %s (%s)\n", "-", "-", result->worker, roms[i].path,
+                strsignal(result->code));
+         failed++;
+         break;
+
+      case FARM_PENDING:
+         printf("skip  %9s  %-17s %6d  %s (worker died before it)\n", "-", "-", result->worker,
+                roms[i].path);
+         failed++;
+         break;
+
+      default:
+         printf("fail  %9s  %-17s %6d  %s (after %d frames, exit %d)\n", "-", "-", result->worker,
+                roms[i].path, result->frames, result->code);
+         failed++;
+         break;
+      }
+   }
+
+   printf("roms:             %d, %d failed\n", rom_count, failed);
+   printf("workers:          %d\n", workers);
+   printf("frames:           %d per rom, %ld in all\n", frames, total_frames);
+   printf("time:             %.3f s\n", secs);
+   printf("fps:              %.1f\n", secs > 0 ? total_frames / secs : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+   farm_script_t *default_script = NULL;
+   const char *list_path = NULL;
+   int workers, frames = DEFAULT_FRAMES, synth = APU_SYNTH_SAMPLE;
+   int opt, i, status;
+   bool isolate = false;
+   uint64_t start;
+   pid_t pid;
+
+   memset(&hostrun, 0, sizeof(hostrun));
+   workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+   while ((opt = getopt(argc, argv, "w:f:i:S:cl:")) != -1)
+   {
+      switch (opt)
+      {
+      case 'w':
+         workers = atoi(optarg);
+         break;
+
+      case 'f':
+         frames = atoi(optarg);
+         break;
+
+      case 'i':
+         default_script = load_script(optarg);
+         break;
+
+      case 'S':
+         if (0 == strcmp(optarg, "blep"))
+            synth = APU_SYNTH_BLEP;
+         else if (0 == strcmp(optarg, "sample"))
+            synth = APU_SYNTH_SAMPLE;
+         else
+            usage(argv[0]);
+         break;
+
+      case 'c':
+         isolate = true;
+         break;
+
+      case 'l':
+         list_path = optarg;
+         break;
+
+      default:
+         usage(argv[0]);
+      }
+   }
+
+   if (list_path)
+      load_list(list_path, default_script);
+   for (i = optind; i < argc; i++)
+      add_rom(argv[i], default_script);
+
+   if (0 == rom_count || frames <= 0 || workers <= 0 || workers > MAX_WORKERS)
+      usage(argv[0]);
+
+   if (workers > rom_count)
+      workers = rom_count;
+
+   map_roms();
+
+   results = mmap(NULL, rom_count * sizeof(farm_result_t), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (MAP_FAILED == results)
+   {
+      fprintf(stderr, "Couldn't map the result table\n");
+      return 1;
+   }
+   /* anonymous pages come zeroed, every result FARM_PENDING */
+   for (i = 0; i < rom_count; i++)
+      results[i].worker = i % workers;
+
+   fflush(stdout);
+   start = host_nanos();
+
+   for (i = 0; i < workers; i++)
+   {
+      pid = fork();
+      if (0 == pid)
+      {
+         run_worker(i, workers, frames, synth, isolate);
+         _exit(0);
+      }
+
+      worker_pids[i] = pid;
+
+      /* its ROMs are reported as not run */
+      if (pid < 0)
+      {
+         fprintf(stderr, "Couldn't start worker %d\n", i);
+         break;
+      }
+   }
+
+   while ((pid = wait(&status)) > 0 || EINTR == errno)
+   {
+      if (pid > 0 && WIFSIGNALED(status))
+         worker_died(pid, workers, WTERMSIG(status));
+   }
+
+   report(workers, frames, host_nanos() - start);
+
+   for (i = 0; i < rom_count; i++)
+   {
+      if (FARM_DONE != results[i].status)
+         return 1;
+   }
+
+   return 0;
+}
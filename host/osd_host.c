@@ -0,0 +1,967 @@
+/* vim: set tabstop=3 expandtab:
+**
+** This file is in the public domain.
+**
+** osd_host.c
+**
+** Headless host OSD layer, replaces osd.c and video_audio.c so the
+** core can be driven as fast as the host allows for benchmarking.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <noftypes.h>
+#include <bitmap.h>
+#include <nofconfig.h>
+#include <event.h>
+#include <log.h>
+#include <nes.h>
+#include <nes_apu.h>
+#include <nesinput.h>
+#include <osd.h>
+#include <nofrendo.h>
+#include <pace.h>
+#include <prof.h>
+#include <snd_ring.h>
+#include <vid_drv.h>
+#include <vid_pipe.h>
+
+#include "osd_host.h"
+#include "pal_conv.h"
+
+#define  DEFAULT_WIDTH        256
+#define  DEFAULT_HEIGHT       NES_VISIBLE_HEIGHT
+
+#define  FNV_PRIME            0x01000193
+
+/* audio sink: two frames of samples buffered, taken out 256 at a time */
+#define  SINK_RINGSIZE        2048
+#define  SINK_TARGET          (2 * HOST_SAMPLERATE / NES_REFRESH_RATE)
+#define  SINK_FRAGSIZE        256
+
+/* 6502 histogram report: hottest instructions listed per bank */
+#define  HIST_BANKPCS         16
+
+/* profiler zones, the trace is written out every frame */
+#define  TRACE_EVENTS         16384
+
+hostrun_t hostrun;
+
+/*
+** Timing
+*/
+uint64_t host_nanos(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void host_sleepuntil(uint64_t ns)
+{
+   struct timespec ts;
+
+   ts.tv_sec = ns / 1000000000;
+   ts.tv_nsec = ns % 1000000000;
+   while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+      ;
+}
+
+/* falls back to nanoseconds where there is no usable cycle counter */
+uint64_t host_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   return __rdtsc();
+#else
+   return host_nanos();
+#endif
+}
+
+uint32_t fnv_hash(uint32_t hash, const uint8 *data, int len)
+{
+   while (len--)
+   {
+      hash ^= *data++;
+      hash *= FNV_PRIME;
+   }
+
+   return hash;
+}
+
+/*
+** ROM image
+*/
+
+/* map the ROM read-only, just like the flash partition on the ESP32 */
+char *osd_getromdata(void)
+{
+   struct stat st;
+   void *romdata;
+   int fd;
+
+   if (hostrun.rom_data)
+      return hostrun.rom_data;
+
+   fd = open(hostrun.rom_path, O_RDONLY);
+   if (fd < 0)
+   {
+      fprintf(stderr, "Couldn't open %s\n", hostrun.rom_path);
+      exit(1);
+   }
+
+   if (fstat(fd, &st) || 0 == st.st_size)
+   {
+      fprintf(stderr, "Couldn't stat %s\n", hostrun.rom_path);
+      exit(1);
+   }
+
+   romdata = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (MAP_FAILED == romdata)
+   {
+      fprintf(stderr, "Couldn't map %s\n", hostrun.rom_path);
+      exit(1);
+   }
+
+   return (char *) romdata;
+}
+
+/*
+** Timer
+*/
+
+/* There is no timer interrupt: frames are paced (pace.h) off the
+** monotonic clock, off the audio sink, or not at all.
+*/
+static uint32 last_cpu_cycles;
+
+static uint32 timer_now(void *arg)
+{
+   UNUSED(arg);
+
+   return (uint32) (host_nanos() / 1000);
+}
+
+static void timer_wait(void *arg, uint32 until)
+{
+   uint64_t now = host_nanos();
+   int32 left = (int32) (until - (uint32) (now / 1000));
+
+   UNUSED(arg);
+
+   if (left > 0)
+      host_sleepuntil(now + (uint64_t) left * 1000);
+}
+
+static uint32 sink_now(void *arg);
+static void sink_wait(void *arg, uint32 until);
+
+int osd_installtimer(int frequency, void *func, int funcsize, void *counter, int countersize)
+{
+   pace_clock_t clock;
+
+   UNUSED(frequency);
+   UNUSED(func);
+   UNUSED(funcsize);
+   UNUSED(counter);
+   UNUSED(countersize);
+
+   /* every frame gets emulated and drawn, unless asked for frameskip */
+   nes_getcontextptr()->autoframeskip = hostrun.skip >= 0 || hostrun.fixskip;
+   if (hostrun.skip >= 0)
+      pace_setskip(hostrun.skip);
+   pace_fixskip(hostrun.fixskip);
+
+   clock.arg = NULL;
+   if (PACE_AUDIO == hostrun.pace)
+   {
+      clock.now = sink_now;
+      clock.wait = sink_wait;
+      clock.rate = HOST_SAMPLERATE;
+      clock.lead = SINK_TARGET;
+   }
+   else
+   {
+      clock.now = timer_now;
+      clock.wait = timer_wait;
+      clock.rate = 1000000;
+      clock.lead = 0;
+   }
+   clock.usec = timer_now;
+   pace_setclock(hostrun.pace, &clock);
+
+   apu_setsynth(hostrun.synth);
+
+   last_cpu_cycles = nes6502_getcycles(false);
+   hostrun.ns_start = host_nanos();
+   hostrun.host_start = host_cycles();
+
+   return 0;
+}
+
+/*
+** Audio
+*/
+static void (*audio_callback)(void *buffer, int length) = NULL;
+static int16 audio_frame[HOST_SAMPLERATE / NES_REFRESH_RATE];
+
+static sndring_t *ring;
+
+static void do_audio_frame(void)
+{
+   int n = HOST_SAMPLERATE / NES_REFRESH_RATE;
+
+   if (NULL == audio_callback)
+      return;
+
+   audio_callback(audio_frame, n);
+   hostrun.audio_hash = fnv_hash(hostrun.audio_hash, (uint8 *) audio_frame, n * sizeof(int16));
+   hostrun.audio_samples += n;
+
+   if (ring)
+      sndring_push(ring, audio_frame, n);
+}
+
+void osd_setsound(void (*playfunc)(void *buffer, int length))
+{
+   audio_callback = playfunc;
+}
+
+void osd_getsoundinfo(sndinfo_t *info)
+{
+   info->sample_rate = HOST_SAMPLERATE;
+   info->bps = 16;
+}
+
+/*
+** Fake audio output: a thread taking fragments out of the sample ring at
+** the real sample rate, like the ESP32 audio task feeding i2s.  It starts
+** once the ring has filled up to its target, the way a DAC would.  The
+** samples it has played so far are the clock for PACE_AUDIO.
+*/
+static pthread_t sink_thread;
+static volatile bool sink_running;
+static volatile uint32 sink_clock;
+static pthread_mutex_t sink_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sink_played = PTHREAD_COND_INITIALIZER;
+
+static uint32 sink_now(void *arg)
+{
+   UNUSED(arg);
+
+   return sink_clock;
+}
+
+static void sink_wait(void *arg, uint32 until)
+{
+   UNUSED(arg);
+
+   pthread_mutex_lock(&sink_mutex);
+   while (sink_running && (int32) (sink_clock - until) < 0)
+      pthread_cond_wait(&sink_played, &sink_mutex);
+   pthread_mutex_unlock(&sink_mutex);
+}
+
+static void *sink_task(void *arg)
+{
+   static int16 frag[SINK_FRAGSIZE];
+   uint64_t start, latency_sum = 0;
+   uint32 latency, reads = 0;
+
+   UNUSED(arg);
+
+   while (sink_running && sndring_fill(ring) < SINK_TARGET)
+      usleep(1000);
+
+   hostrun.latency_min_us = UINT32_MAX;
+   start = host_nanos();
+
+   while (sink_running)
+   {
+      /* the newest sample comes out after the ring and this fragment */
+      latency = (uint32) ((uint64_t) (sndring_fill(ring) + SINK_FRAGSIZE) * 1000000 / HOST_SAMPLERATE);
+      if (latency < hostrun.latency_min_us)
+         hostrun.latency_min_us = latency;
+      if (latency > hostrun.latency_max_us)
+         hostrun.latency_max_us = latency;
+      latency_sum += latency;
+
+      PROF_BEGIN(PROF_SOUND);
+      sndring_read(ring, frag, SINK_FRAGSIZE);
+      PROF_END(PROF_SOUND);
+      reads++;
+
+      pthread_mutex_lock(&sink_mutex);
+      sink_clock += SINK_FRAGSIZE;
+      pthread_cond_broadcast(&sink_played);
+      pthread_mutex_unlock(&sink_mutex);
+
+      /* absolute deadlines, so the sink doesn't drift off the sample rate */
+      host_sleepuntil(start + (uint64_t) reads * SINK_FRAGSIZE * 1000000000 / HOST_SAMPLERATE);
+   }
+
+   if (reads)
+      hostrun.latency_avg_us = (uint32) (latency_sum / reads);
+   else
+      hostrun.latency_min_us = 0;
+
+   return NULL;
+}
+
+static int sink_start(void)
+{
+   ring = sndring_create(SINK_RINGSIZE, SINK_TARGET);
+   if (NULL == ring)
+      return -1;
+
+   sink_running = true;
+   if (pthread_create(&sink_thread, NULL, sink_task, NULL))
+   {
+      sndring_destroy(&ring);
+      return -1;
+   }
+
+   return 0;
+}
+
+static void sink_stop(void)
+{
+   sndring_stats_t stats;
+
+   if (NULL == ring)
+      return;
+
+   pthread_mutex_lock(&sink_mutex);
+   sink_running = false;
+   pthread_cond_broadcast(&sink_played);
+   pthread_mutex_unlock(&sink_mutex);
+   pthread_join(sink_thread, NULL);
+
+   sndring_getstats(ring, &stats);
+   hostrun.sink_read = stats.read;
+   hostrun.sink_underruns = stats.underruns;
+   hostrun.sink_overruns = stats.overruns;
+   hostrun.sink_min_fill = stats.min_fill;
+   hostrun.sink_max_fill = stats.max_fill;
+   hostrun.sink_adjust = stats.adjust;
+
+   sndring_destroy(&ring);
+}
+
+/*
+** Video
+*/
+
+static int init(int width, int height);
+static void shutdown(void);
+static int set_mode(int width, int height);
+static void set_palette(rgb_t *pal);
+static void clear(uint8 color);
+static bitmap_t *lock_write(void);
+static void free_write(int num_dirties, rect_t *dirty_rects);
+static void custom_blit(bitmap_t *bmp, int num_dirties, rect_t *dirty_rects);
+static uint8 fb[DEFAULT_WIDTH * DEFAULT_HEIGHT];
+static bitmap_t *myBitmap;
+
+viddriver_t hostDriver =
+{
+   "Headless host",  /* name */
+   init,             /* init */
+   shutdown,         /* shutdown */
+   set_mode,         /* set_mode */
+   set_palette,      /* set_palette */
+   clear,            /* clear */
+   lock_write,       /* lock_write */
+   free_write,       /* free_write */
+   custom_blit,      /* custom_blit */
+   false             /* invalidate flag */
+};
+
+void osd_getvideoinfo(vidinfo_t *info)
+{
+   info->default_width = DEFAULT_WIDTH;
+   info->default_height = DEFAULT_HEIGHT;
+   info->driver = &hostDriver;
+}
+
+void osd_togglefullscreen(int code)
+{
+   UNUSED(code);
+}
+
+static int init(int width, int height)
+{
+   UNUSED(width);
+   UNUSED(height);
+
+   /* one persistent surface: vid_findmode() still reads it after free_write */
+   myBitmap = bmp_createhw(fb, DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_WIDTH);
+   if (NULL == myBitmap)
+      return -1;
+
+   return 0;
+}
+
+static void shutdown(void)
+{
+   bmp_destroy(&myBitmap);
+}
+
+static int set_mode(int width, int height)
+{
+   UNUSED(width);
+   UNUSED(height);
+
+   return 0;
+}
+
+uint16_t host_palette[PALCONV_ENTRIES];
+
+static void set_palette(rgb_t *pal)
+{
+   palconv_settable(host_palette, pal);
+}
+
+static void clear(uint8 color)
+{
+   memset(fb, color, sizeof(fb));
+}
+
+static bitmap_t *lock_write(void)
+{
+   return myBitmap;
+}
+
+static void free_write(int num_dirties, rect_t *dirty_rects)
+{
+   UNUSED(num_dirties);
+   UNUSED(dirty_rects);
+}
+
+/*
+** Fake display: a thread taking frames out of the video pipeline the way
+** the ESP32 LCD task does, converting them to RGB565 like it does, and
+** holding each one for hostrun.display_us.
+*/
+static vidpipe_t *pipeline;
+static pthread_t display_thread;
+static pthread_mutex_t pipe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipe_event[2] = { PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void pipe_lock(void *arg)
+{
+   UNUSED(arg);
+   pthread_mutex_lock(&pipe_mutex);
+}
+
+static void pipe_unlock(void *arg)
+{
+   UNUSED(arg);
+   pthread_mutex_unlock(&pipe_mutex);
+}
+
+static void pipe_wait(void *arg, int side)
+{
+   UNUSED(arg);
+   pthread_cond_wait(&pipe_event[side], &pipe_mutex);
+}
+
+static void pipe_signal(void *arg, int side)
+{
+   UNUSED(arg);
+   pthread_cond_signal(&pipe_event[side]);
+}
+
+static const vidpipe_sync_t pipe_sync =
+{
+   NULL, pipe_lock, pipe_unlock, pipe_wait, pipe_signal, timer_now
+};
+
+static void *display_task(void *arg)
+{
+   static uint16_t line[DEFAULT_WIDTH];
+   struct timespec ts;
+   bitmap_t *frame;
+   int y;
+
+   UNUSED(arg);
+
+   while (NULL != (frame = vidpipe_acquire(pipeline)))
+   {
+      PROF_BEGIN(PROF_LCD);
+      for (y = 0; y < frame->height; y++)
+         palconv_line(line, frame->line[y], frame->width, host_palette);
+
+      if (hostrun.display_us)
+      {
+         ts.tv_sec = hostrun.display_us / 1000000;
+         ts.tv_nsec = (hostrun.display_us % 1000000) * 1000;
+         nanosleep(&ts, NULL);
+      }
+      PROF_END(PROF_LCD);
+
+      vidpipe_release(pipeline, frame);
+   }
+
+   return NULL;
+}
+
+static int display_start(void)
+{
+   pipeline = vidpipe_create(DEFAULT_WIDTH, DEFAULT_HEIGHT, hostrun.buffers, &pipe_sync);
+   if (NULL == pipeline)
+      return -1;
+
+   if (pthread_create(&display_thread, NULL, display_task, NULL))
+   {
+      vidpipe_destroy(&pipeline);
+      return -1;
+   }
+
+   vid_setpipeline(pipeline);
+   return 0;
+}
+
+static void display_stop(void)
+{
+   vidpipe_stats_t stats;
+
+   if (NULL == pipeline)
+      return;
+
+   vidpipe_close(pipeline);
+   pthread_join(display_thread, NULL);
+
+   vidpipe_getstats(pipeline, &stats);
+   hostrun.produced = stats.produced;
+   hostrun.displayed = stats.displayed;
+   hostrun.dropped = stats.dropped;
+   hostrun.producer_stall_us = stats.producer_stall;
+   hostrun.consumer_stall_us = stats.consumer_stall;
+
+   /* the emulator is done drawing, vid_shutdown() leaves the buffers alone */
+}
+
+/*
+** 6502 histogram
+*/
+#ifdef NES6502_HISTOGRAM
+static const char *op_names[256] =
+{
+   "brk", "ora", "jam", "slo", "nop", "ora", "asl", "slo", "php", "ora", "asl", "anc", "nop", "ora", "asl", "slo",
+   "bpl", "ora", "jam", "slo", "nop", "ora", "asl", "slo", "clc", "ora", "nop", "slo", "nop", "ora", "asl", "slo",
+   "jsr", "and", "jam", "rla", "bit", "and", "rol", "rla", "plp", "and", "rol", "anc", "bit", "and", "rol", "rla",
+   "bmi", "and", "jam", "rla", "nop", "and", "rol", "rla", "sec", "and", "nop", "rla", "nop", "and", "rol", "rla",
+   "rti", "eor", "jam", "sre", "nop", "eor", "lsr", "sre", "pha", "eor", "lsr", "asr", "jmp", "eor", "lsr", "sre",
+   "bvc", "eor", "jam", "sre", "nop", "eor", "lsr", "sre", "cli", "eor", "nop", "sre", "nop", "eor", "lsr", "sre",
+   "rts", "adc", "jam", "rra", "nop", "adc", "ror", "rra", "pla", "adc", "ror", "arr", "jmp", "adc", "ror", "rra",
+   "bvs", "adc", "jam", "rra", "nop", "adc", "ror", "rra", "sei", "adc", "nop", "rra", "nop", "adc", "ror", "rra",
+   "nop", "sta", "nop", "sax", "sty", "sta", "stx", "sax", "dey", "nop", "txa", "ane", "sty", "sta", "stx", "sax",
+   "bcc", "sta", "jam", "sha", "sty", "sta", "stx", "sax", "tya", "sta", "txs", "shs", "shy", "sta", "shx", "sha",
+   "ldy", "lda", "ldx", "lax", "ldy", "lda", "ldx", "lax", "tay", "lda", "tax", "lxa", "ldy", "lda", "ldx", "lax",
+   "bcs", "lda", "jam", "lax", "ldy", "lda", "ldx", "lax", "clv", "lda", "tsx", "las", "ldy", "lda", "ldx", "lax",
+   "cpy", "cmp", "nop", "dcp", "cpy", "cmp", "dec", "dcp", "iny", "cmp", "dex", "sbx", "cpy", "cmp", "dec", "dcp",
+   "bne", "cmp", "jam", "dcp", "nop", "cmp", "dec", "dcp", "cld", "cmp", "nop", "dcp", "nop", "cmp", "dec", "dcp",
+   "cpx", "sbc", "nop", "isb", "cpx", "sbc", "inc", "isb", "inx", "sbc", "nop", "sbc", "cpx", "sbc", "inc", "isb",
+   "beq", "sbc", "jam", "isb", "nop", "sbc", "inc", "isb", "sed", "sbc", "nop", "isb", "nop", "sbc", "inc", "isb"
+};
+
+static nes6502_hist *hist_sort;
+
+static int hist_byopcycles(const void *a, const void *b)
+{
+   uint32 ca = hist_sort->op_cycles[*(const int *) a], cb = hist_sort->op_cycles[*(const int *) b];
+
+   return (ca < cb) - (ca > cb);
+}
+
+/* grouped by bank, the hottest instructions first */
+static int hist_bypc(const void *a, const void *b)
+{
+   const nes6502_pchist *pa = *(const nes6502_pchist **) a, *pb = *(const nes6502_pchist **) b;
+
+   if (pa->page != pb->page)
+      return (pa->page < pb->page) ? -1 : 1;
+
+   return (pa->cycles < pb->cycles) - (pa->cycles > pb->cycles);
+}
+
+/* where a bank pointer is, in terms of the cartridge */
+static void hist_bankname(char *name, int len, const uint8 *page)
+{
+   nes_t *nes = nes_getcontextptr();
+   rominfo_t *rom = nes->rominfo;
+
+   if (page >= rom->rom && page < rom->rom + rom->rom_banks * 0x4000)
+      snprintf(name, len, "PRG $%05X", (int) (page - rom->rom));
+   else if (rom->sram && page >= rom->sram && page < rom->sram + rom->sram_banks * 0x2000)
+      snprintf(name, len, "SRAM $%04X", (int) (page - rom->sram));
+   else if (page == nes->cpu->mem_page[0])
+      snprintf(name, len, "RAM");
+   else
+      snprintf(name, len, "other %p", (void *) page);
+}
+
+static void hist_handlers(FILE *f, const char *what, const uint32 *count, uint32 ram, uint32 rom)
+{
+   nes_t *nes = nes_getcontextptr();
+   uint32 min, max;
+   int i;
+
+   fprintf(f, "\n%s:\n", what);
+   fprintf(f, "  $0000-$07FF  RAM            %10u\n", ram);
+   if (rom)
+      fprintf(f, "  $8000-$FFFF  PRG ROM        %10u\n", rom);
+   fprintf(f, "  $0800-$7FFF  no handler     %10u\n", count[0]);
+
+   for (i = 0; i < NES6502_HISTHANDLERS; i++)
+   {
+      if (count == hist_sort->read_count)
+      {
+         if (NULL == nes->readhandler[i].read_func)
+            break;
+         min = nes->readhandler[i].min_range;
+         max = nes->readhandler[i].max_range;
+      }
+      else
+      {
+         if (NULL == nes->writehandler[i].write_func)
+            break;
+         min = nes->writehandler[i].min_range;
+         max = nes->writehandler[i].max_range;
+      }
+
+      fprintf(f, "  $%04X-$%04X  handler %-2d     %10u\n", min, max, i, count[i + 1]);
+   }
+}
+
+/* Written while the cartridge is still loaded, to name the banks. */
+static void hist_write(void)
+{
+   nes6502_hist *hist = nes6502_gethist();
+   nes6502_pchist **pcs, *pc;
+   uint64_t instrs = 0, cycles = 0, bank_cycles;
+   int ops[256], i, j, n = 0, shown;
+   char bank[32];
+   FILE *f;
+
+   f = fopen(hostrun.hist_path, "w");
+   if (NULL == f)
+   {
+      fprintf(stderr, "Couldn't write %s\n", hostrun.hist_path);
+      return;
+   }
+
+   hist_sort = hist;
+   for (i = 0; i < 256; i++)
+   {
+      ops[i] = i;
+      instrs += hist->op_count[i];
+      cycles += hist->op_cycles[i];
+   }
+   qsort(ops, 256, sizeof(int), hist_byopcycles);
+
+   fprintf(f, "rom: %s, %d frames\n", hostrun.rom_path, hostrun.frames_done);
+   fprintf(f, "instructions: %llu, %llu cycles\n", (unsigned long long) instrs, (unsigned long long) cycles);
+   fprintf(f, "addresses: %u, %u instructions not counted\n", hist->pcs_used, hist->pc_overflow);
+
+   fprintf(f, "\nopcodes, by cycles:\n");
+   fprintf(f, "  op  name       count      cycles  cyc/op  share\n");
+   for (i = 0; i < 256 && hist->op_count[ops[i]]; i++)
+   {
+      j = ops[i];
+      fprintf(f, "  %02X  %s  %10u  %10u  %6.2f  %5.2f%%\n", j, op_names[j], hist->op_count[j],
+              hist->op_cycles[j], (double) hist->op_cycles[j] / hist->op_count[j],
+              cycles ? hist->op_cycles[j] * 100.0 / cycles : 0.0);
+   }
+
+   hist_handlers(f, "reads", hist->read_count, hist->ram_reads, hist->rom_reads);
+   hist_handlers(f, "writes", hist->write_count, hist->ram_writes, 0);
+
+   pcs = malloc(hist->pcs_used * sizeof(*pcs));
+   if (pcs)
+   {
+      for (i = 0; i < NES6502_HISTPCS; i++)
+      {
+         if (hist->pcs[i].page)
+            pcs[n++] = &hist->pcs[i];
+      }
+      qsort(pcs, n, sizeof(*pcs), hist_bypc);
+
+      fprintf(f, "\nhot instructions, per bank:\n");
+      for (i = 0; i < n; i = j)
+      {
+         bank_cycles = 0;
+         for (j = i; j < n && pcs[j]->page == pcs[i]->page; j++)
+            bank_cycles += pcs[j]->cycles;
+
+         hist_bankname(bank, sizeof(bank), pcs[i]->page);
+         fprintf(f, "  %s at $%04X: %d addresses, %.2f%% of cycles\n", bank, pcs[i]->pc & ~NES6502_BANKMASK,
+                 j - i, cycles ? bank_cycles * 100.0 / cycles : 0.0);
+
+         for (shown = 0; shown < HIST_BANKPCS && i + shown < j; shown++)
+         {
+            pc = pcs[i + shown];
+            fprintf(f, "    $%04X  %s  %10u  %10u  %5.2f%%\n", pc->pc, op_names[pc->page[pc->pc & NES6502_BANKMASK]],
+                    pc->count, pc->cycles, cycles ? pc->cycles * 100.0 / cycles : 0.0);
+         }
+      }
+
+      free(pcs);
+   }
+
+   fclose(f);
+}
+#else /* !NES6502_HISTOGRAM */
+static void hist_write(void)
+{
+}
+#endif /* !NES6502_HISTOGRAM */
+
+/*
+** Profiler
+*/
+#ifdef NOFRENDO_PROFILE
+static FILE *trace;
+
+static uint32 trace_clock(void)
+{
+   return (uint32) host_cycles();
+}
+
+/* host_cycles() per microsecond, against the monotonic clock */
+static uint32 trace_calibrate(void)
+{
+   uint64_t ns, cycles;
+
+   ns = host_nanos();
+   cycles = host_cycles();
+   usleep(20000);
+   ns = host_nanos() - ns;
+   cycles = host_cycles() - cycles;
+
+   return (uint32) ((cycles * 1000 + ns / 2) / ns);
+}
+
+static void trace_out(void *arg, const char *text)
+{
+   fputs(text, (FILE *) arg);
+}
+
+static int trace_start(void)
+{
+   trace = fopen(hostrun.trace_path, "w");
+   if (NULL == trace)
+      return -1;
+
+   if (prof_init(trace_clock, trace_calibrate(), TRACE_EVENTS))
+   {
+      fclose(trace);
+      trace = NULL;
+      return -1;
+   }
+
+   prof_writeheader(trace_out, trace);
+   return 0;
+}
+
+static void trace_frame(void)
+{
+   if (trace)
+      hostrun.trace_events += prof_writeevents(trace_out, trace);
+}
+
+static void trace_stop(void)
+{
+   if (NULL == trace)
+      return;
+
+   trace_frame();
+   prof_writefooter(trace_out, trace);
+   hostrun.trace_dropped = prof_dropped();
+
+   prof_shutdown();
+   fclose(trace);
+   trace = NULL;
+}
+#else /* !NOFRENDO_PROFILE */
+static int trace_start(void)
+{
+   return -1;
+}
+
+static void trace_frame(void)
+{
+}
+
+static void trace_stop(void)
+{
+}
+#endif /* !NOFRENDO_PROFILE */
+
+void osd_endframe(void)
+{
+   nes6502_decodestats decode;
+   nes6502_idlestats idle;
+   uint32 cycles;
+
+   cycles = nes6502_getcycles(false);
+   hostrun.cpu_cycles += (uint32) (cycles - last_cpu_cycles);
+   last_cpu_cycles = cycles;
+
+   do_audio_frame();
+   trace_frame();
+
+   if (++hostrun.frames_done == hostrun.frames)
+   {
+      hostrun.host_end = host_cycles();
+      hostrun.ns_end = host_nanos();
+
+      nes6502_getdecodestats(&decode, false);
+      hostrun.decode_hits = decode.hits;
+      hostrun.decode_misses = decode.misses;
+      hostrun.decode_uncached = decode.uncached;
+
+      nes6502_getidlestats(&idle, false);
+      hostrun.idle_skips = idle.skips;
+      hostrun.idle_iterations = idle.iterations;
+      hostrun.idle_cycles = idle.cycles;
+   }
+}
+
+/* with frameskip the run ends on the first frame drawn after the last one */
+static void custom_blit(bitmap_t *bmp, int num_dirties, rect_t *dirty_rects)
+{
+   int y;
+
+   UNUSED(num_dirties);
+   UNUSED(dirty_rects);
+
+   if (hostrun.frames_done < hostrun.frames)
+      return;
+
+   hostrun.frame_hash = FNV_OFFSET;
+   for (y = 0; y < bmp->height; y++)
+      hostrun.frame_hash = fnv_hash(hostrun.frame_hash, bmp->line[y], bmp->width);
+}
+
+/*
+** Input
+*/
+void osd_getinput(void)
+{
+   event_t evh;
+
+   /* done: unwind out of nes_emulate() */
+   if (hostrun.frames_done >= hostrun.frames)
+   {
+      display_stop();
+      sink_stop();
+      trace_stop();
+      if (hostrun.hist_path)
+         hist_write();
+
+      evh = event_get(event_quit);
+      if (evh)
+         evh(INP_STATE_MAKE);
+   }
+}
+
+void osd_getmouse(int *x, int *y, int *button)
+{
+   UNUSED(x);
+   UNUSED(y);
+   UNUSED(button);
+}
+
+/*
+** Startup / shutdown
+*/
+
+static int logprint(const char *string)
+{
+   return fprintf(stderr, "%s", string);
+}
+
+int osd_init(void)
+{
+   if (getenv("NOFRENDO_LOG"))
+      log_chain_logfunc(logprint);
+
+   hostrun.audio_hash = FNV_OFFSET;
+
+   if (hostrun.trace_path && trace_start())
+   {
+      fprintf(stderr, "Couldn't start the profiler trace %s\n", hostrun.trace_path);
+      return -1;
+   }
+
+   if (hostrun.buffers && display_start())
+   {
+      fprintf(stderr, "Couldn't start the display pipeline\n");
+      return -1;
+   }
+
+   if (hostrun.audio_sink && sink_start())
+   {
+      fprintf(stderr, "Couldn't start the audio sink\n");
+      return -1;
+   }
+
+   return 0;
+}
+
+void osd_shutdown(void)
+{
+   audio_callback = NULL;
+}
+
+/*
+** File system interface
+*/
+char configfilename[] = "na";
+
+int osd_main(int argc, char *argv[])
+{
+   UNUSED(argc);
+   UNUSED(argv);
+
+   config.filename = configfilename;
+
+   /* same bogus name as the ESP32 build, so no .sav/.pal files get touched */
+   return main_loop("rom", system_autodetect);
+}
+
+void osd_fullname(char *fullname, const char *shortname)
+{
+   strncpy(fullname, shortname, PATH_MAX);
+}
+
+char *osd_newextension(char *string, char *ext)
+{
+   UNUSED(ext);
+
+   return string;
+}
+
+int osd_makesnapname(char *filename, int len)
+{
+   UNUSED(filename);
+   UNUSED(len);
+
+   return -1;
+}
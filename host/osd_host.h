@@ -0,0 +1,71 @@
+/* vim: set tabstop=3 expandtab:
+**
+** This file is in the public domain.
+**
+** osd_host.h
+**
+** Headless host OSD layer: run control and measurements
+*/
+
+#ifndef _OSD_HOST_H_
+#define _OSD_HOST_H_
+
+#include <stdint.h>
+
+#define  HOST_SAMPLERATE      22100 /* same as the ESP32 build */
+#define  FNV_OFFSET           0x811C9DC5
+
+typedef struct hostrun_s
+{
+   /* set up by the runner before nofrendo_main() */
+   const char *rom_path;
+   char *rom_data;            /* image mapped by the runner, or NULL to map rom_path */
+   int frames;                /* stop after this many emulated frames */
+   int buffers;               /* frame pipeline to a fake display, 0 for none */
+   int display_us;            /* time the fake display takes per frame */
+   int synth;                 /* APU_SYNTH_SAMPLE or APU_SYNTH_BLEP */
+   int audio_sink;            /* real time fake audio output */
+   int pace;                  /* PACE_FREE, PACE_TIMER or PACE_AUDIO */
+   int skip;                  /* PACE_SKIP_xxx with autoframeskip, -1 for none */
+   int fixskip;               /* draw one frame in this many, 0 for none */
+   const char *trace_path;    /* Chrome trace of the profiler zones, or NULL */
+   const char *hist_path;     /* 6502 histogram report, or NULL */
+   int idle_off;              /* idle loop skipping turned off */
+
+   /* filled in by the OSD layer */
+   int frames_done;
+   uint64_t cpu_cycles;       /* emulated 6502 cycles */
+   uint64_t host_start, host_end;
+   uint64_t ns_start, ns_end;
+   uint32_t frame_hash;       /* FNV-1a of the final framebuffer */
+   uint32_t audio_hash;       /* FNV-1a of every generated sample */
+   long audio_samples;
+
+   /* frame pipeline */
+   uint32_t produced, displayed, dropped;
+   uint32_t producer_stall_us, consumer_stall_us;
+
+   /* audio sink */
+   uint32_t sink_read, sink_underruns, sink_overruns;
+   uint32_t sink_min_fill, sink_max_fill;
+   int32_t sink_adjust;       /* last rate adjustment, in 1/65536 */
+   uint32_t latency_min_us, latency_avg_us, latency_max_us;
+
+   /* profiler */
+   uint32_t trace_events, trace_dropped;
+
+   /* 6502 instruction fetches through the decode cache */
+   uint32_t decode_hits, decode_misses, decode_uncached;
+
+   /* waiting loops fast-forwarded */
+   uint32_t idle_skips, idle_iterations, idle_cycles;
+} hostrun_t;
+
+extern hostrun_t hostrun;
+extern uint16_t host_palette[]; /* RGB565 for the fake display, see pal_conv.h */
+
+extern uint64_t host_cycles(void);
+extern uint64_t host_nanos(void);
+extern uint32_t fnv_hash(uint32_t hash, const uint8_t *data, int len);
+
+#endif /* !_OSD_HOST_H_ */
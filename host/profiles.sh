@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Compare the release and debug builds of the core on one ROM:
+#
+#   make -C host profiles ROM=game.nes [FRAMES=n]
+#
+# The debug build is run with and without memguard, so the cost of
+# ASSERTs/logging and of the heap guard blocks shows up separately.
+#
+
+ROM=$1
+export ROM
+FRAMES=${FRAMES:-600}
+
+if [ -z "$ROM" ]; then
+   echo "usage: $0 rom.nes" >&2
+   exit 2
+fi
+
+cd "$(dirname "$0")" || exit 1
+
+run() {
+   # fps from the report, core chatter on stdout is dropped
+   "$@" -f "$FRAMES" "$ROM" 2>/dev/null | awk '/^fps:/ { print $2 }'
+}
+
+release=$(run build/release/nesbench)
+debug_nomg=$(run build/debug/nesbench -M)
+debug=$(run build/debug/nesbench)
+
+if [ -z "$release" ] || [ -z "$debug_nomg" ] || [ -z "$debug" ]; then
+   echo "benchmark run failed" >&2
+   exit 1
+fi
+
+awk -v r="$release" -v n="$debug_nomg" -v d="$debug" -v f="$FRAMES" 'BEGIN {
+   printf("%d frames of %s\n", f, ENVIRON["ROM"]);
+   printf("%-26s %9s %10s %8s\n", "profile", "fps", "ms/frame", "cost");
+   printf("%-26s %9.1f %10.3f %8s\n", "release", r, 1000 / r, "-");
+   printf("%-26s %9.1f %10.3f %+7.1f%%\n", "debug, memguard off", n, 1000 / n, (r / n - 1) * 100);
+   printf("%-26s %9.1f %10.3f %+7.1f%%\n", "debug", d, 1000 / d, (r / d - 1) * 100);
+}'